@@ -12,6 +12,7 @@
 
 #include "qemu/osdep.h"
 #include "exec/exec-all.h"
+#include "sysemu/idle-poll.h"
 
 void tb_flush(CPUState *cpu)
 {
@@ -37,3 +38,12 @@ void QEMU_NORETURN cpu_loop_exit_restore(CPUState *cpu, uintptr_t pc)
 {
     g_assert_not_reached();
 }
+
+bool tcg_idle_poll_enable(unsigned int threshold, int64_t max_sleep_ns)
+{
+    return false;
+}
+
+void tcg_idle_poll_wake(void)
+{
+}
@@ -1365,6 +1365,9 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
         cpu_transaction_failed(cpu, physaddr, addr, memop_size(op), access_type,
                                mmu_idx, iotlbentry->attrs, r, retaddr);
     }
+    if (unlikely(cpu->idle_poll)) {
+        tcg_idle_poll_read(cpu, mr, mr_offset, val, retaddr);
+    }
     if (locked) {
         qemu_mutex_unlock_iothread();
     }
@@ -1406,6 +1409,9 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
         cpu_io_recompile(cpu, retaddr);
     }
     cpu->mem_io_pc = retaddr;
+    if (unlikely(cpu->idle_poll)) {
+        tcg_idle_poll_reset(cpu);
+    }
 
     /*
      * The memory_region_dispatch may trigger a flush/resize
@@ -0,0 +1,146 @@
+/*
+ * TCG idle-poll detector
+ *
+ * Guests that wait for a device by spinning on a status register cost a
+ * full MMIO dispatch per iteration.  Reads of registers the devices
+ * declared pollable are tracked per vCPU; once the same load keeps
+ * returning the same value in a tight loop, the vCPU leaves the execution
+ * loop and sleeps until something can have changed the register.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "exec/memory.h"
+#include "hw/core/cpu.h"
+#include "sysemu/cpus.h"
+#include "sysemu/cpu-timers.h"
+#include "sysemu/idle-poll.h"
+#include "sysemu/tcg.h"
+#include "internal.h"
+#include "trace.h"
+
+/*
+ * Reads further apart than this are not a tight loop: the guest does
+ * real work between them.
+ */
+#define IDLE_POLL_MAX_GAP_NS (10 * SCALE_US)
+
+typedef struct IdlePollState {
+    /* the load being repeated, identified by its host return address */
+    MemoryRegion *mr;
+    hwaddr offset;
+    uint64_t val;
+    uintptr_t retaddr;
+    int64_t last_ns;
+    unsigned int count;
+
+    bool sleep_pending;
+    bool sleeping;
+} IdlePollState;
+
+static unsigned int idle_poll_threshold;
+static int64_t idle_poll_max_sleep_ns;
+
+bool tcg_idle_poll_enable(unsigned int threshold, int64_t max_sleep_ns)
+{
+    CPUState *cpu;
+
+    assert(threshold > 0 && max_sleep_ns > 0);
+    if (!tcg_enabled() || icount_enabled() || !qemu_tcg_mttcg_enabled()) {
+        return false;
+    }
+
+    idle_poll_threshold = threshold;
+    idle_poll_max_sleep_ns = max_sleep_ns;
+    CPU_FOREACH(cpu) {
+        if (!cpu->idle_poll) {
+            cpu->idle_poll = g_new0(IdlePollState, 1);
+        }
+    }
+    return true;
+}
+
+void tcg_idle_poll_wake(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->idle_poll && cpu->idle_poll->sleeping) {
+            qemu_cpu_kick(cpu);
+        }
+    }
+}
+
+void tcg_idle_poll_read(CPUState *cpu, MemoryRegion *mr, hwaddr offset,
+                        uint64_t val, uintptr_t retaddr)
+{
+    IdlePollState *p = cpu->idle_poll;
+    int64_t now;
+
+    if (!memory_region_is_pollable(mr, offset)) {
+        p->count = 0;
+        return;
+    }
+
+    now = get_clock();
+    if (p->count && p->mr == mr && p->offset == offset && p->val == val &&
+        p->retaddr == retaddr && now - p->last_ns < IDLE_POLL_MAX_GAP_NS) {
+        if (++p->count >= idle_poll_threshold) {
+            trace_tcg_idle_poll_detect(cpu->cpu_index, memory_region_name(mr),
+                                       offset, val);
+            p->count = 0;
+            p->sleep_pending = true;
+            /* finish this TB, the vCPU thread then sleeps */
+            cpu_exit(cpu);
+        }
+    } else {
+        p->mr = mr;
+        p->offset = offset;
+        p->val = val;
+        p->retaddr = retaddr;
+        p->count = 1;
+    }
+    p->last_ns = now;
+}
+
+void tcg_idle_poll_reset(CPUState *cpu)
+{
+    cpu->idle_poll->count = 0;
+}
+
+/* Called by the vCPU thread with the BQL held, between two tcg_cpus_exec() */
+void tcg_idle_poll_sleep(CPUState *cpu)
+{
+    IdlePollState *p = cpu->idle_poll;
+    int64_t sleep_ns;
+
+    if (!p || !p->sleep_pending) {
+        return;
+    }
+    p->sleep_pending = false;
+
+    /* anything already queued for the vCPU ends the wait right away */
+    if (cpu_has_work(cpu) || cpu->stop || qatomic_read(&cpu->exit_request) ||
+        !cpu_work_list_empty(cpu)) {
+        return;
+    }
+
+    sleep_ns = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL,
+                                          QEMU_TIMER_ATTR_ALL);
+    if (sleep_ns < 0 || sleep_ns > idle_poll_max_sleep_ns) {
+        sleep_ns = idle_poll_max_sleep_ns;
+    }
+    /* the wait has millisecond granularity, shorter waits keep spinning */
+    if (sleep_ns < SCALE_MS) {
+        return;
+    }
+
+    trace_tcg_idle_poll_sleep(cpu->cpu_index, sleep_ns);
+    p->sleeping = true;
+    qemu_cond_timedwait_iothread(cpu->halt_cond, sleep_ns / SCALE_MS);
+    p->sleeping = false;
+}
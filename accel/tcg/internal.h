@@ -19,4 +19,10 @@ void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 void page_init(void);
 void tb_htable_init(void);
 
+/* idle-poll.c, only called while cpu->idle_poll is set */
+void tcg_idle_poll_read(CPUState *cpu, MemoryRegion *mr, hwaddr offset,
+                        uint64_t val, uintptr_t retaddr);
+void tcg_idle_poll_reset(CPUState *cpu);
+void tcg_idle_poll_sleep(CPUState *cpu);
+
 #endif /* ACCEL_TCG_INTERNAL_H */
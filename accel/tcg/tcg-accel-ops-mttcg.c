@@ -33,6 +33,7 @@
 #include "exec/exec-all.h"
 #include "hw/boards.h"
 
+#include "internal.h"
 #include "tcg-accel-ops.h"
 #include "tcg-accel-ops-mttcg.h"
 
@@ -120,6 +121,7 @@ static void *mttcg_cpu_thread_fn(void *arg)
         }
 
         qatomic_mb_set(&cpu->exit_request, 0);
+        tcg_idle_poll_sleep(cpu);
         qemu_wait_io_event(cpu);
     } while (!cpu->unplug || cpu_can_run(cpu));
 
@@ -253,6 +253,28 @@ SRST
     Show memory tree.
 ERST
 
+    {
+        .name       = "mtree-profile",
+        .args_type  = "by_count:-c,buckets:-b,max:i?",
+        .params     = "[-c] [-b] [max]",
+        .help       = "show MMIO profiling info, up to max regions "
+                      "(default: 10), sorted by time spent in their handlers "
+                      "(-c: sort by number of accesses; -b: also show the "
+                      "busiest offsets of each region)",
+        .cmd        = hmp_info_mtree_profile,
+    },
+
+SRST
+  ``info mtree-profile [-c|-b]`` [*max*]
+    Show the MMIO accesses collected by ``mtree-profile``, up to *max* memory
+    regions (default: 10), sorted by host time spent handling them.
+
+    ``-c``
+      sort by number of accesses
+    ``-b``
+      also show the busiest 4-byte offsets of each region
+ERST
+
 #if defined(CONFIG_TCG)
     {
         .name       = "jit",
@@ -622,6 +622,21 @@ SRST
   whether profiling is on or off.
 ERST
 
+    {
+        .name       = "mtree-profile",
+        .args_type  = "op:s?",
+        .params     = "[on|off|reset]",
+        .help       = "enable, disable or reset MMIO profiling. "
+                      "With no arguments, prints whether profiling is on or off.",
+        .cmd        = hmp_mtree_profile,
+    },
+
+SRST
+``mtree-profile [on|off|reset]``
+  Enable, disable or reset accounting of the MMIO accesses dispatched to each
+  memory region. With no arguments, prints whether profiling is on or off.
+ERST
+
     {
         .name       = "system_reset",
         .args_type  = "",
@@ -7,13 +7,15 @@
 #include "hw/irq.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/reset.h"
+#include "migration/vmstate.h"
 #include "hw/platform-bus.h"
 #include "hw/block/flash.h"
 #include "hw/qdev-clock.h"
+#include "sysemu/idle-poll.h"
 #include "hw/arm/ipod_nano3g.h"
+#include "hw/arm/ipod_nano3g_milestones.h"
 #include "hw/arm/exynos4210.h"
 #include "hw/dma/pl080.h"
-#include <openssl/aes.h>
 
 static uint64_t prng_workaround_read(void *opaque, hwaddr addr, unsigned size)
 {
@@ -179,6 +181,20 @@ static void S5L8702_usb_phys_write(void *opaque, hwaddr addr, uint64_t val, unsi
     }
 }
 
+static const VMStateDescription vmstate_S5L8702_usb_phys = {
+    .name = "ipodnano3g.usbphys",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(usb_ophypwr, S5L8702_usb_phys_s),
+        VMSTATE_UINT32(usb_ophyclk, S5L8702_usb_phys_s),
+        VMSTATE_UINT32(usb_orstcon, S5L8702_usb_phys_s),
+        VMSTATE_UINT32(usb_ophytune, S5L8702_usb_phys_s),
+        VMSTATE_UINT32(usb_ucondet, S5L8702_usb_phys_s),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const MemoryRegionOps usb_phys_ops = {
     .read = S5L8702_usb_phys_read,
     .write = S5L8702_usb_phys_write,
@@ -290,13 +306,103 @@ static void ipod_nano3g_set_bootloader_path(Object *obj, const char *value, Erro
     g_strlcpy(nms->bootloader_path, value, sizeof(nms->bootloader_path));
 }
 
+static char *ipod_nano3g_get_nor_path(Object *obj, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    return g_strdup(nms->nor_path);
+}
+
+static void ipod_nano3g_set_nor_path(Object *obj, const char *value, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    g_strlcpy(nms->nor_path, value, sizeof(nms->nor_path));
+}
+
+static char *ipod_nano3g_get_nand_path(Object *obj, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    return g_strdup(nms->nand_path);
+}
+
+static void ipod_nano3g_set_nand_path(Object *obj, const char *value, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    g_strlcpy(nms->nand_path, value, sizeof(nms->nand_path));
+}
+
+static char *ipod_nano3g_get_nand_overlay_path(Object *obj, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    return g_strdup(nms->nand_overlay_path);
+}
+
+static void ipod_nano3g_set_nand_overlay_path(Object *obj, const char *value, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    g_strlcpy(nms->nand_overlay_path, value, sizeof(nms->nand_overlay_path));
+}
+
+static bool ipod_nano3g_get_nand_pristine(Object *obj, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    return nms->nand_pristine;
+}
+
+static void ipod_nano3g_set_nand_pristine(Object *obj, bool value, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    nms->nand_pristine = value;
+}
+
+static bool ipod_nano3g_get_idle_poll(Object *obj, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    return nms->idle_poll;
+}
+
+static void ipod_nano3g_set_idle_poll(Object *obj, bool value, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    nms->idle_poll = value;
+}
+
+static char *ipod_nano3g_get_milestone_log_path(Object *obj, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    return g_strdup(nms->milestone_log_path);
+}
+
+static void ipod_nano3g_set_milestone_log_path(Object *obj, const char *value, Error **errp)
+{
+    IPodNano3GMachineState *nms = IPOD_NANO3G_MACHINE(obj);
+    g_strlcpy(nms->milestone_log_path, value, sizeof(nms->milestone_log_path));
+}
+
 static void ipod_nano3g_instance_init(Object *obj)
 {
 	object_property_add_str(obj, "bootrom", ipod_nano3g_get_bootrom_path, ipod_nano3g_set_bootrom_path);
     object_property_set_description(obj, "bootrom", "Path to the S5L8730 bootrom binary");
 
     object_property_add_str(obj, "bootloader", ipod_nano3g_get_bootloader_path, ipod_nano3g_set_bootloader_path);
-    object_property_set_description(obj, "bootloader", "Path to the decrypted EFI bootloader");
+    object_property_set_description(obj, "bootloader", "Path to the decrypted EFI bootloader, placed at 0x8000 of an otherwise empty NOR");
+
+    object_property_add_str(obj, "nor", ipod_nano3g_get_nor_path, ipod_nano3g_set_nor_path);
+    object_property_set_description(obj, "nor", "Path to a full NOR image (see build_nor.sh), takes precedence over bootloader");
+
+    object_property_add_str(obj, "nand", ipod_nano3g_get_nand_path, ipod_nano3g_set_nand_path);
+    object_property_set_description(obj, "nand", "Path to the flat NAND image (see nand_image.py)");
+
+    object_property_add_str(obj, "nand-overlay", ipod_nano3g_get_nand_overlay_path, ipod_nano3g_set_nand_overlay_path);
+    object_property_set_description(obj, "nand-overlay", "Raw or qcow2 image that programmed NAND pages are flushed to when the VM stops");
+
+    object_property_add_bool(obj, "nand-pristine", ipod_nano3g_get_nand_pristine, ipod_nano3g_set_nand_pristine);
+    object_property_set_description(obj, "nand-pristine", "Drop all programmed NAND pages on system reset");
+
+    object_property_add_str(obj, "milestone-log", ipod_nano3g_get_milestone_log_path, ipod_nano3g_set_milestone_log_path);
+    object_property_set_description(obj, "milestone-log", "File that boot milestones are logged to as JSON lines, with timings and MMIO counts");
+
+    object_property_add_bool(obj, "idle-poll", ipod_nano3g_get_idle_poll, ipod_nano3g_set_idle_poll);
+    object_property_set_description(obj, "idle-poll", "Let the CPU sleep while it spins on a device status register");
 }
 
 static inline qemu_irq S5L8702_get_irq(IPodNano3GMachineState *s, int n)
@@ -361,6 +467,10 @@ static void ipod_nano3g_machine_init(MachineState *machine)
 
     ipod_nano3g_cpu_setup(machine, &sysmem, &cpu, &nsas);
 
+    if (*nms->milestone_log_path) {
+        ipod_nano3g_milestones_init(nms->milestone_log_path, &error_fatal);
+    }
+
     // setup clock
     nms->sysclk = clock_new(OBJECT(machine), "SYSCLK");
     clock_set_hz(nms->sysclk, 12000000ULL);
@@ -391,12 +501,15 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     IPodNano3GClockState *clock0_state = IPOD_NANO3G_CLOCK(dev);
     nms->clock0 = clock0_state;
     memory_region_add_subregion(sysmem, CLOCK0_MEM_BASE, &clock0_state->iomem);
+    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
 
     // init clock 1
     dev = qdev_new("ipodnano3g.clock");
     IPodNano3GClockState *clock1_state = IPOD_NANO3G_CLOCK(dev);
     nms->clock1 = clock1_state;
     memory_region_add_subregion(sysmem, CLOCK1_MEM_BASE, &clock1_state->iomem);
+    qdev_connect_clock_in(dev, "osc", nms->sysclk);
+    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
 
     // init the timer
     dev = qdev_new("ipodnano3g.timer");
@@ -405,7 +518,9 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     memory_region_add_subregion(sysmem, TIMER1_MEM_BASE, &timer_state->iomem);
     SysBusDevice *busdev = SYS_BUS_DEVICE(dev);
     sysbus_connect_irq(busdev, 0, S5L8702_get_irq(nms, S5L8702_TIMER1_IRQ));
-    timer_state->sysclk = nms->sysclk;
+    qdev_connect_clock_in(dev, "pclk", qdev_get_clock_out(DEVICE(clock1_state), "pclk"));
+    qdev_connect_clock_in(dev, "eclk", nms->sysclk);
+    sysbus_realize(busdev, &error_fatal);
 
     // init sysic
     dev = qdev_new("ipodnano3g.sysic");
@@ -424,18 +539,21 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     sysbus_connect_irq(busdev, 0, S5L8702_get_irq(nms, S5L8702_GPIO_G4_IRQ));
     sysbus_connect_irq(busdev, 0, S5L8702_get_irq(nms, S5L8702_GPIO_G5_IRQ));
     sysbus_connect_irq(busdev, 0, S5L8702_get_irq(nms, S5L8702_GPIO_G6_IRQ));
+    sysbus_realize(busdev, &error_fatal);
 
     // init GPIO
     dev = qdev_new("ipodnano3g.gpio");
     IPodNano3GGPIOState *gpio_state = IPOD_NANO3G_GPIO(dev);
     nms->gpio_state = gpio_state;
     memory_region_add_subregion(sysmem, GPIO_MEM_BASE, &gpio_state->iomem);
+    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
 
     // init SDIO
     dev = qdev_new("ipodnano3g.sdio");
     IPodNano3GSDIOState *sdio_state = IPOD_NANO3G_SDIO(dev);
     nms->sdio_state = sdio_state;
     memory_region_add_subregion(sysmem, SDIO_MEM_BASE, &sdio_state->iomem);
+    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
 
     dev = exynos4210_uart_create(UART0_MEM_BASE, 256, 0, serial_hd(0), nms->irq[0][24]);
     if (!dev) {
@@ -471,7 +589,7 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     set_spi_base(0);
     dev = sysbus_create_simple("S5L8702spi", SPI0_MEM_BASE, S5L8702_get_irq(nms, S5L8702_SPI0_IRQ));
     S5L8702SPIState *spi0_state = S5L8702SPI(dev);
-    spi0_state->nor->bootloader_path = nms->bootloader_path;
+    ipod_nano3g_nor_spi_load(spi0_state->nor, nms->nor_path, nms->bootloader_path, &error_fatal);
 
     set_spi_base(1);
     sysbus_create_simple("S5L8702spi", SPI1_MEM_BASE, S5L8702_get_irq(nms, S5L8702_SPI1_IRQ));
@@ -494,6 +612,7 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     nms->lcd_state = lcd_state;
     busdev = SYS_BUS_DEVICE(dev);
     sysbus_connect_irq(busdev, 0, S5L8702_get_irq(nms, S5L8702_LCD_IRQ));
+    qdev_connect_clock_in(dev, "clk", qdev_get_clock_out(DEVICE(nms->clock1), "lcd"));
     memory_region_add_subregion(sysmem, DISPLAY_MEM_BASE, &lcd_state->iomem);
     sysbus_realize(busdev, &error_fatal);
 
@@ -502,12 +621,14 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     S5L8702AESState *aes_state = IPOD_NANO3G_AES(dev);
     nms->aes_state = aes_state;
     memory_region_add_subregion(sysmem, AES_MEM_BASE, &aes_state->iomem);
+    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
 
     // init SHA1 engine
     dev = qdev_new("ipodnano3g.sha1");
     S5L8702SHA1State *sha1_state = IPOD_NANO3G_SHA1(dev);
     nms->sha1_state = sha1_state;
     memory_region_add_subregion(sysmem, SHA1_MEM_BASE, &sha1_state->iomem);
+    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
 
     // init 8702 engine
     MemoryRegion *iomem = g_new(MemoryRegion, 1);
@@ -517,22 +638,27 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     // init NAND flash
     dev = qdev_new("itnand");
     ITNandState *nand_state = ITNAND(dev);
-    nand_state->nand_path = "nope";
+    nand_state->nand_path = nms->nand_path;
+    nand_state->overlay_path = nms->nand_overlay_path;
+    nand_state->pristine_on_reset = nms->nand_pristine;
     nand_state->downstream_as = nsas;
     nms->nand_state = nand_state;
     //object_property_set_link(OBJECT(dev), "downstream", OBJECT(sysmem), &error_fatal);
+    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
     memory_region_add_subregion(sysmem, NAND_MEM_BASE, &nand_state->iomem);
 
     // init NAND ECC module
     dev = qdev_new("itnand_ecc");
     ITNandECCState *nand_ecc_state = ITNANDECC(dev);
     nms->nand_ecc_state = nand_ecc_state;
+    nand_ecc_state->nand_state = nand_state;
     busdev = SYS_BUS_DEVICE(dev);
     sysbus_connect_irq(busdev, 0, S5L8702_get_irq(nms, S5L8702_NAND_ECC_IRQ));
     memory_region_add_subregion(sysmem, NAND_ECC_MEM_BASE, &nand_ecc_state->iomem);
+    sysbus_realize(busdev, &error_fatal);
 
     // init USB OTG
-    dev = ipod_nano3g_init_usb_otg(nms->irq[0][13], S5L8702_usb_hwcfg);
+    dev = ipod_nano3g_init_usb_otg(nms->irq[0][13], S5L8702_usb_hwcfg, sysmem);
     synopsys_usb_state *usb_otg = S5L8702USBOTG(dev);
     nms->usb_otg = usb_otg;
     memory_region_add_subregion(sysmem, USBOTG_MEM_BASE, &nms->usb_otg->iomem);
@@ -549,6 +675,7 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     iomem = g_new(MemoryRegion, 1);
     memory_region_init_io(iomem, OBJECT(s), &usb_phys_ops, usb_state, "usbphys", 0x40);
     memory_region_add_subregion(sysmem, USBPHYS_MEM_BASE, iomem);
+    vmstate_register(NULL, 0, &vmstate_S5L8702_usb_phys, usb_state);
 
     // TODO: unknown peripheral at 0x38500000
     allocate_ram(sysmem, "ipod.unknown", 0x38500000, 0x2000);
@@ -596,6 +723,7 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     busdev = SYS_BUS_DEVICE(dev);
     sysbus_connect_irq(busdev, 0, S5L8702_get_irq(nms, S5L8702_I2C0_IRQ));
     memory_region_add_subregion(sysmem, I2C0_MEM_BASE, &i2c_state->iomem);
+    sysbus_realize(busdev, &error_fatal);
 
     // init the PMU
     I2CSlave *pmu = i2c_slave_create_simple(i2c_state->bus, "pcf50633", 0xe6);
@@ -606,6 +734,7 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     busdev = SYS_BUS_DEVICE(dev);
     sysbus_connect_irq(busdev, 0, S5L8702_get_irq(nms, S5L8702_I2C1_IRQ));
     memory_region_add_subregion(sysmem, I2C1_MEM_BASE, &i2c_state->iomem);
+    sysbus_realize(busdev, &error_fatal);
 
     // init the ADM
     dev = qdev_new("ipodnano3g.adm");
@@ -627,7 +756,7 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     // object_property_set_link(OBJECT(dev), "downstream", OBJECT(sysmem), &error_fatal);
     busdev = SYS_BUS_DEVICE(dev);
     sysbus_realize(busdev, &error_fatal);
-    sysbus_connect_irq(busdev, 0, S5L8702_get_irq(nms, S5L8702_ADM_IRQ));
+    // the engine's VIC input is unknown and the firmware polls it, so its IRQ stays unconnected
     memory_region_add_subregion(sysmem, MPVD_MEM_BASE, &jpeg_state->iomem);
 
     // Init DRAM Express (DREX) controller
@@ -635,6 +764,7 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     IPodNano5GDREXState *drex_state = IPOD_NANO5G_DREX(dev);
     nms->drex_state = drex_state;
     memory_region_add_subregion(sysmem, DREX_MEM_BASE, &drex_state->iomem);
+    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
 
     // init MBX
     // iomem = g_new(MemoryRegion, 1);
@@ -646,6 +776,7 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     IPodNano3GChipIDState *chipid_state = IPOD_NANO3G_CHIPID(dev);
     nms->chipid_state = chipid_state;
     memory_region_add_subregion(sysmem, CHIPID_MEM_BASE, &chipid_state->iomem);
+    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
 
     // init the TVOut instances
     dev = qdev_new("ipodnano3g.tvout");
@@ -653,6 +784,7 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     tvout_state->index = 1;
     nms->tvout1_state = tvout_state;
     memory_region_add_subregion(sysmem, TVOUT1_MEM_BASE, &tvout_state->iomem);
+    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
 
     dev = qdev_new("ipodnano3g.tvout");
     tvout_state = IPOD_NANO3G_TVOUT(dev);
@@ -661,12 +793,14 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     memory_region_add_subregion(sysmem, TVOUT2_MEM_BASE, &tvout_state->iomem);
     busdev = SYS_BUS_DEVICE(dev);
     sysbus_connect_irq(busdev, 0, S5L8702_get_irq(nms, S5L8702_TVOUT_SDO_IRQ));
+    sysbus_realize(busdev, &error_fatal);
 
     dev = qdev_new("ipodnano3g.tvout");
     tvout_state = IPOD_NANO3G_TVOUT(dev);
     tvout_state->index = 3;
     nms->tvout3_state = tvout_state;
     memory_region_add_subregion(sysmem, TVOUT3_MEM_BASE, &tvout_state->iomem);
+    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
 
     // setup workaround for TVOut
     iomem = g_new(MemoryRegion, 1);
@@ -676,6 +810,11 @@ static void ipod_nano3g_machine_init(MachineState *machine)
     qemu_register_reset(ipod_nano3g_cpu_reset, nms);
 
     qemu_add_kbd_event_handler(ipod_nano3g_key_event, spi2_state->mt);
+
+    // the devices have declared their status registers pollable by now
+    if (nms->idle_poll) {
+        tcg_idle_poll_enable(IPOD_NANO3G_IDLE_POLL_THRESHOLD, IPOD_NANO3G_IDLE_POLL_MAX_SLEEP_NS);
+    }
 }
 
 static void ipod_nano3g_machine_class_init(ObjectClass *obj, void *data)
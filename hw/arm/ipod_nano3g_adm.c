@@ -2,6 +2,8 @@
 #include "hw/qdev-properties.h"
 #include "hw/arm/ipod_nano3g_nand.h"
 #include "qapi/error.h"
+#include "migration/vmstate.h"
+#include "qemu/log.h"
 
 static void set_bank(ITNandState *s, uint8_t activate_bank) {
     for(int bank = 0; bank < 8; bank++) {
@@ -31,6 +33,65 @@ static uint64_t ipod_nano3g_adm_read(void *opaque, hwaddr offset, unsigned size)
     return 0;
 }
 
+// the command block the firmware hands to the ADM, fields are big-endian
+#define ADM_CMD_BLOCK 0x1104
+#define ADM_CMD_OPCODE (ADM_CMD_BLOCK + 0x24)
+#define ADM_CMD_NUM_PAGES (ADM_CMD_BLOCK + 0x28)
+#define ADM_CMD_BANKS (ADM_CMD_BLOCK + 0x44)
+#define ADM_CMD_PAGES (ADM_CMD_BLOCK + 0x244)
+
+// per-page metadata the ADM reports back in the third data section
+#define ADM_PAGE_META_SIZE 0xC
+
+static uint32_t adm_cmd_read32(IPodNano3GADMState *s, uint32_t offset)
+{
+    uint32_t val = 0;
+    address_space_read(&s->downstream_as, s->data2_sec_addr + offset, MEMTXATTRS_UNSPECIFIED, &val, 4);
+    return val;
+}
+
+static uint16_t adm_cmd_read16_be(IPodNano3GADMState *s, uint32_t offset)
+{
+    uint8_t buf[2] = { 0 };
+    address_space_read(&s->downstream_as, s->data2_sec_addr + offset, MEMTXATTRS_UNSPECIFIED, buf, 2);
+    return lduw_be_p(buf);
+}
+
+static uint32_t adm_cmd_read32_be(IPodNano3GADMState *s, uint32_t offset)
+{
+    uint8_t buf[4] = { 0 };
+    address_space_read(&s->downstream_as, s->data2_sec_addr + offset, MEMTXATTRS_UNSPECIFIED, buf, 4);
+    return ldl_be_p(buf);
+}
+
+static uint8_t adm_cmd_read8(IPodNano3GADMState *s, uint32_t offset)
+{
+    uint8_t val = 0;
+    address_space_read(&s->downstream_as, s->data2_sec_addr + offset, MEMTXATTRS_UNSPECIFIED, &val, 1);
+    return val;
+}
+
+/*
+ * Hands a resolved multi-page read to the NAND, which gathers all pages at
+ * once and then streams them through the FIFO.
+ */
+static void adm_start_bulk_read(IPodNano3GADMState *s, uint32_t num_pages)
+{
+    ITNandState *nand = s->nand_state;
+    uint8_t *meta;
+
+    num_pages = MIN(num_pages, NAND_MAX_BULK_PAGES);
+    itnand_prefetch_pages(nand, num_pages);
+
+    // one metadata entry per page, with the FTL mark set
+    meta = g_malloc0(num_pages * ADM_PAGE_META_SIZE);
+    for (uint32_t i = 0; i < num_pages; i++) {
+        meta[i * ADM_PAGE_META_SIZE + 10] = 0xFF;
+    }
+    address_space_write(&s->downstream_as, s->data3_sec_addr, MEMTXATTRS_UNSPECIFIED, meta, num_pages * ADM_PAGE_META_SIZE);
+    g_free(meta);
+}
+
 static void ipod_nano3g_adm_write(void *opaque, hwaddr offset, uint64_t value, unsigned size)
 {
     IPodNano3GADMState *s = (IPodNano3GADMState *)opaque;
@@ -42,158 +103,90 @@ static void ipod_nano3g_adm_write(void *opaque, hwaddr offset, uint64_t value, u
             if(value == 0x3) {
                 // some kind of start-up command?
                 // write some bits to data2_sec_addr to indicate that the device is started
-                uint32_t *data = (uint32_t *) malloc(sizeof(uint32_t));
-                data[0] = 0x50;
-                address_space_rw(&s->downstream_as, s->data2_sec_addr, MEMTXATTRS_UNSPECIFIED, (uint8_t *)data, 4, 1);
+                uint32_t started = 0x50;
+                address_space_rw(&s->downstream_as, s->data2_sec_addr, MEMTXATTRS_UNSPECIFIED, (uint8_t *)&started, 4, 1);
 
                 // dunno, write some bytes to data4_sec_addr to indicate that the NAND banks are ready
-                data = (uint32_t *) malloc(sizeof(uint32_t) * 8);
-                for(int i = 0; i < 8; i++) {
-                    data[i] = NAND_CHIP_ID;
+                uint32_t chip_ids[NAND_NUM_BANKS];
+                for(int i = 0; i < NAND_NUM_BANKS; i++) {
+                    chip_ids[i] = NAND_CHIP_ID;
                 }
-                
-                address_space_rw(&s->downstream_as, s->data3_sec_addr, MEMTXATTRS_UNSPECIFIED, (uint8_t *)data, 8 * sizeof(uint32_t), 1);
+
+                address_space_rw(&s->downstream_as, s->data3_sec_addr, MEMTXATTRS_UNSPECIFIED, (uint8_t *)chip_ids, sizeof(chip_ids), 1);
             }
             break;
         case ADM_CTRL2:
             if(value == 0x2) {
                 // read the command and initialize the right device
+                ITNandState *nand = s->nand_state;
                 uint32_t page;
                 uint16_t num_pages;
                 uint8_t bank;
-                uint32_t *buf = malloc(80);
-                address_space_read(&s->downstream_as, s->data2_sec_addr + 0x1104 + 0x24, MEMTXATTRS_UNSPECIFIED, buf, 80);
-                int cmd = *buf;
+                int cmd = adm_cmd_read32(s, ADM_CMD_OPCODE);
                 // printf("Setting command: 0x%08x\n", cmd);
-                // for(int i = 0; i < 20; i++) {
-                //     printf("0x%08x ", buf[i]);
-                // }
-                // printf("\n");
                 switch(cmd) {
                     case 0x200:
-                        // read multiple pages simultaneously from the same bank
-                        s->nand_state->reading_multiple_pages = true;
-                        buf = malloc(2);
-                        address_space_read(&s->downstream_as, s->data2_sec_addr + 0x1104 + 0x28, MEMTXATTRS_UNSPECIFIED, buf, 2);
-                        num_pages = *(uint16_t*)buf;
-                        num_pages = ( (((num_pages) >> 8) & 0x00FF) | (((num_pages) << 8) & 0xFF00) ); // swap endianness
-                        //printf("Reading %d pages at once, ", num_pages);
-
-                        buf = malloc(4);
-                        address_space_read(&s->downstream_as, s->data2_sec_addr + 0x1104 + 0x244, MEMTXATTRS_UNSPECIFIED, buf, 4);
-                        page = *buf;
-                        page = ((page>>24)&0xff) | // move byte 3 to byte 0
-                               ((page<<8)&0xff0000) | // move byte 1 to byte 2
-                               ((page>>8)&0xff00) | // move byte 2 to byte 1
-                               ((page<<24)&0xff000000); // byte 0 to byte 3
-                        //printf("starting with page %d\n", page);
-
-                        uint16_t ops = num_pages / 8;
-                        for(int op = 0; op < ops; op++) {
-                            for(int i = 0; i < 8; i++) {
-                                s->nand_state->pages_to_read[op * 8 + i] = page;
-                                s->nand_state->banks_to_read[op * 8 + i] = i;
+                        // read multiple pages simultaneously, striped over all banks
+                        num_pages = MIN(adm_cmd_read16_be(s, ADM_CMD_NUM_PAGES), NAND_MAX_BULK_PAGES);
+                        page = adm_cmd_read32_be(s, ADM_CMD_PAGES);
+                        //printf("Reading %d pages at once, starting with page %d\n", num_pages, page);
+
+                        for(int op = 0; op < num_pages / NAND_NUM_BANKS; op++) {
+                            for(int i = 0; i < NAND_NUM_BANKS; i++) {
+                                nand->pages_to_read[op * NAND_NUM_BANKS + i] = page;
+                                nand->banks_to_read[op * NAND_NUM_BANKS + i] = i;
                             }
                             page++;
                         }
 
-                        s->nand_state->fmdnum = (num_pages * 0x800);
-                        s->nand_state->cur_bank_reading = -1;
-
-                        for(int i = 0; i < num_pages; i++) {
-                            uint8_t *sbuf = malloc(0xC);
-                            sbuf[10] = 0xFF;
-                            address_space_rw(&s->downstream_as, s->data3_sec_addr + i * 0xC, MEMTXATTRS_UNSPECIFIED, sbuf, 0xC, 1);
-                        }
-                        
+                        adm_start_bulk_read(s, num_pages);
                         break;
                     case 0x300:
                         // seems to be the NAND read command, read the page(s) + bank and instruct the flash device
-                        s->nand_state->reading_multiple_pages = false;
-                        buf = malloc(2);
-                        address_space_read(&s->downstream_as, s->data2_sec_addr + 0x1104 + 0x28, MEMTXATTRS_UNSPECIFIED, buf, 2);
-                        num_pages = *(uint16_t*)buf;
-                        num_pages = ( (((num_pages) >> 8) & 0x00FF) | (((num_pages) << 8) & 0xFF00) ); // swap endianness
+                        nand->reading_multiple_pages = false;
+                        num_pages = adm_cmd_read16_be(s, ADM_CMD_NUM_PAGES);
                         if(num_pages == 1) {
-                            // TODO this can probably be refactored to re-use the logic to read multiple pages!
-                            address_space_read(&s->downstream_as, s->data2_sec_addr + 0x1104 + 0x44, MEMTXATTRS_UNSPECIFIED, buf, 1);
-                            bank = *(uint8_t*)buf;
-
-                            buf = malloc(4);
-                            address_space_read(&s->downstream_as, s->data2_sec_addr + 0x1104 + 0x244, MEMTXATTRS_UNSPECIFIED, buf, 4);
-                            page = *buf;
-                            page = ((page>>24)&0xff) | // move byte 3 to byte 0
-                                   ((page<<8)&0xff0000) | // move byte 1 to byte 2
-                                   ((page>>8)&0xff00) | // move byte 2 to byte 1
-                                   ((page<<24)&0xff000000); // byte 0 to byte 3
+                            bank = adm_cmd_read8(s, ADM_CMD_BANKS);
+                            page = adm_cmd_read32_be(s, ADM_CMD_PAGES);
                             //printf("Reading single page: %d (bank: %d)\n", page, bank);
 
                             // set the bank, page, and operation.
-                            set_bank(s->nand_state, bank);
-                            memory_region_dispatch_write(&s->nand_state->iomem, NAND_FMDNUM, 0x800 - 1, MO_32, MEMTXATTRS_UNSPECIFIED);
-                            memory_region_dispatch_write(&s->nand_state->iomem, NAND_FMADDR0, page << 16, MO_32, MEMTXATTRS_UNSPECIFIED);
-                            memory_region_dispatch_write(&s->nand_state->iomem, NAND_FMADDR1, (page >> 16) & 0xFF, MO_32, MEMTXATTRS_UNSPECIFIED);
-                            memory_region_dispatch_write(&s->nand_state->iomem, NAND_CMD, NAND_CMD_READ, MO_32, MEMTXATTRS_UNSPECIFIED);
+                            set_bank(nand, bank);
+                            memory_region_dispatch_write(&nand->iomem, NAND_FMDNUM, 0x800 - 1, MO_32, MEMTXATTRS_UNSPECIFIED);
+                            memory_region_dispatch_write(&nand->iomem, NAND_FMADDR0, page << 16, MO_32, MEMTXATTRS_UNSPECIFIED);
+                            memory_region_dispatch_write(&nand->iomem, NAND_FMADDR1, (page >> 16) & 0xFF, MO_32, MEMTXATTRS_UNSPECIFIED);
+                            memory_region_dispatch_write(&nand->iomem, NAND_CMD, NAND_CMD_READ, MO_32, MEMTXATTRS_UNSPECIFIED);
 
                             // write the spare of the page to the 3rd data section
-                            nand_set_buffered_page(s->nand_state, page);
-                            address_space_rw(&s->downstream_as, s->data3_sec_addr, MEMTXATTRS_UNSPECIFIED, (uint8_t *)s->nand_state->page_spare_buffer, NAND_BYTES_PER_SPARE, 1);
+                            nand_set_buffered_page(nand, page);
+                            address_space_rw(&s->downstream_as, s->data3_sec_addr, MEMTXATTRS_UNSPECIFIED, (uint8_t *)nand->page_spare_buffer, NAND_BYTES_PER_SPARE, 1);
                         }
                         else if(num_pages > 1) {
                             // read scattered pages
                             // printf("Reading %d scattered pages\n", num_pages);
-                            s->nand_state->reading_multiple_pages = true;
+                            num_pages = MIN(num_pages, NAND_MAX_BULK_PAGES);
                             for(int i = 0; i < num_pages; i++) {
-                                buf = malloc(4);
-                                address_space_read(&s->downstream_as, s->data2_sec_addr + 0x1104 + 0x244 + 4 * i, MEMTXATTRS_UNSPECIFIED, buf, 4);
-                                page = *buf;
-                                page = ((page>>24)&0xff) | // move byte 3 to byte 0
-                                       ((page<<8)&0xff0000) | // move byte 1 to byte 2
-                                       ((page>>8)&0xff00) | // move byte 2 to byte 1
-                                       ((page<<24)&0xff000000); // byte 0 to byte 3
-
-                                buf = malloc(1);
-                                address_space_read(&s->downstream_as, s->data2_sec_addr + 0x1104 + 0x44 + i, MEMTXATTRS_UNSPECIFIED, buf, 1);
-                                bank = *(uint8_t*)buf;
-                                // printf("Page: %d, bank: %d\n", page, bank);
-
-                                s->nand_state->pages_to_read[i] = page;
-                                s->nand_state->banks_to_read[i] = bank;
+                                nand->pages_to_read[i] = adm_cmd_read32_be(s, ADM_CMD_PAGES + 4 * i);
+                                nand->banks_to_read[i] = adm_cmd_read8(s, ADM_CMD_BANKS + i);
                             }
 
-                            s->nand_state->fmdnum = (num_pages * 0x800);
-                            s->nand_state->cur_bank_reading = -1;
-
-                            for(int i = 0; i < num_pages; i++) {
-                                uint8_t *sbuf = malloc(0xC);
-                                sbuf[10] = 0xFF;
-                                address_space_rw(&s->downstream_as, s->data3_sec_addr + i * 0xC, MEMTXATTRS_UNSPECIFIED, sbuf, 0xC, 1);
-                            }
+                            adm_start_bulk_read(s, num_pages);
                         }
                         break;
                     case 0x500:
                         // writing a page
-                        buf = malloc(1);
-                        address_space_read(&s->downstream_as, s->data2_sec_addr + 0x1104 + 0x44, MEMTXATTRS_UNSPECIFIED, buf, 1);
-                        bank = *(uint8_t*)buf;
-
-                        buf = malloc(4);
-                        address_space_read(&s->downstream_as, s->data2_sec_addr + 0x1104 + 0x244, MEMTXATTRS_UNSPECIFIED, buf, 4);
-                        page = *buf;
-                        page = ((page>>24)&0xff) | // move byte 3 to byte 0
-                               ((page<<8)&0xff0000) | // move byte 1 to byte 2
-                               ((page>>8)&0xff00) | // move byte 2 to byte 1
-                               ((page<<24)&0xff000000); // byte 0 to byte 3
+                        bank = adm_cmd_read8(s, ADM_CMD_BANKS);
+                        page = adm_cmd_read32_be(s, ADM_CMD_PAGES);
 
                         // set the bank, page, and operation.
                         //printf("Activating bank for writing: %d, page: %d\n", bank, page);
-                        set_bank(s->nand_state, bank);
-                        nand_set_buffered_page(s->nand_state, page);
-                        s->nand_state->fmdnum = NAND_BYTES_PER_PAGE;
-                        s->nand_state->is_writing = true;
+                        set_bank(nand, bank);
+                        nand_set_buffered_page(nand, page);
+                        nand->fmdnum = NAND_BYTES_PER_PAGE;
+                        nand->is_writing = true;
                         break;
                     default:
-                        printf("Unrecognized ADM command: %d\n", cmd);
+                        qemu_log_mask(LOG_UNIMP, "%s: unrecognized command %d\n", __func__, cmd);
                         break;
                 }
                 qemu_irq_raise(s->irq);
@@ -253,10 +246,24 @@ static void ipod_nano3g_adm_init(Object *obj)
     sysbus_init_irq(sbd, &s->irq);
 }
 
+static const VMStateDescription vmstate_ipod_nano3g_adm = {
+    .name = TYPE_IPOD_NANO3G_ADM,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(code_sec_addr, IPodNano3GADMState),
+        VMSTATE_UINT32(data1_sec_addr, IPodNano3GADMState),
+        VMSTATE_UINT32(data2_sec_addr, IPodNano3GADMState),
+        VMSTATE_UINT32(data3_sec_addr, IPodNano3GADMState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void ipod_nano3g_adm_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = ipod_nano3g_adm_realize;
+    dc->vmsd = &vmstate_ipod_nano3g_adm;
     device_class_set_props(dc, adm_properties);
 }
 
@@ -1,4 +1,13 @@
 #include "hw/arm/ipod_nano3g_aes.h"
+#include "hw/irq.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "exec/address-spaces.h"
+#include "migration/vmstate.h"
+#include "trace.h"
 
 static uint64_t S5L8702_aes_read(void *opaque, hwaddr offset, unsigned size)
 {
@@ -15,53 +24,143 @@ static uint64_t S5L8702_aes_read(void *opaque, hwaddr offset, unsigned size)
     return 0;
 }
 
+/*
+ * Returns a cipher for the selected key, reusing the previous one when the
+ * key did not change so the key schedule is only expanded once.
+ */
+static QCryptoCipher *S5L8702_aes_get_cipher(S5L8702AESState *s, const uint8_t *key, size_t nkey)
+{
+    Error *err = NULL;
+
+    if (s->cipher && s->cipher_nkey == nkey && memcmp(s->cipher_key, key, nkey) == 0) {
+        return s->cipher;
+    }
+
+    qcrypto_cipher_free(s->cipher);
+    s->cipher = qcrypto_cipher_new(nkey == 16 ? QCRYPTO_CIPHER_ALG_AES_128 : QCRYPTO_CIPHER_ALG_AES_256,
+                                   QCRYPTO_CIPHER_MODE_CBC, key, nkey, &err);
+    if (!s->cipher) {
+        error_report_err(err);
+        return NULL;
+    }
+    memcpy(s->cipher_key, key, nkey);
+    s->cipher_nkey = nkey;
+    return s->cipher;
+}
+
+static int S5L8702_aes_crypt(S5L8702AESState *s, QCryptoCipher *cipher, const void *in, void *out, size_t len)
+{
+    if (s->operation == AES_OP_DECRYPT) {
+        return qcrypto_cipher_decrypt(cipher, in, out, len, &error_abort);
+    }
+    return qcrypto_cipher_encrypt(cipher, in, out, len, &error_abort);
+}
+
+static void S5L8702_aes_run(S5L8702AESState *s)
+{
+    QCryptoCipher *cipher = NULL;
+    uint32_t len = s->insize & ~(AES_BLOCK_LEN - 1);
+    hwaddr inlen = len, outlen = len;
+    void *in, *out;
+
+    switch(s->keytype) {
+        case AESGID:
+            // the GID key can't be read out of the hardware, pass the data through
+            qemu_log_mask(LOG_UNIMP, "%s: No support for GID key, copying data unchanged\n", __func__);
+            break;
+        case AESUID:
+            cipher = S5L8702_aes_get_cipher(s, key_uid, sizeof(key_uid));
+            break;
+        case AESCustom:
+            cipher = S5L8702_aes_get_cipher(s, (uint8_t *)s->custkey, sizeof(s->custkey));
+            break;
+    }
+
+    if (s->insize != len) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: size %d is not a multiple of the block size, ignoring the tail\n", __func__, s->insize);
+    }
+
+    if (cipher) {
+        qcrypto_cipher_setiv(cipher, (uint8_t *)s->ivec, sizeof(s->ivec), &error_abort);
+    }
+
+    /*
+     * Work straight on guest RAM when both buffers map in one piece and are
+     * either the same buffer or don't overlap, otherwise bounce the data.
+     */
+    in = address_space_map(&address_space_memory, s->inaddr, &inlen, false, MEMTXATTRS_UNSPECIFIED);
+    out = address_space_map(&address_space_memory, s->outaddr, &outlen, true, MEMTXATTRS_UNSPECIFIED);
+    if (in && out && inlen == len && outlen == len &&
+        (s->inaddr == s->outaddr || s->inaddr + len <= s->outaddr || s->outaddr + len <= s->inaddr)) {
+        if (cipher) {
+            S5L8702_aes_crypt(s, cipher, in, out, len);
+        } else if (in != out) {
+            memcpy(out, in, len);
+        }
+        address_space_unmap(&address_space_memory, in, inlen, false, inlen);
+        address_space_unmap(&address_space_memory, out, outlen, true, outlen);
+    } else {
+        if (in) {
+            address_space_unmap(&address_space_memory, in, inlen, false, 0);
+        }
+        if (out) {
+            address_space_unmap(&address_space_memory, out, outlen, true, 0);
+        }
+
+        uint8_t *buf = g_malloc(len);
+        address_space_read(&address_space_memory, s->inaddr, MEMTXATTRS_UNSPECIFIED, buf, len);
+        if (cipher) {
+            S5L8702_aes_crypt(s, cipher, buf, buf, len);
+        }
+        address_space_write(&address_space_memory, s->outaddr, MEMTXATTRS_UNSPECIFIED, buf, len);
+        g_free(buf);
+    }
+
+    trace_s5l8702_aes_op(s->operation == AES_OP_DECRYPT ? "decrypted" : "encrypted", s->insize, s->inaddr, s->outaddr);
+
+    memset(s->custkey, 0, 0x20);
+    memset(s->ivec, 0, 0x10);
+    s->keylenop = 0;
+    s->outsize = s->insize;
+    s->status = AES_STATUS_DONE;
+}
+
+static void S5L8702_aes_done_bh(void *opaque)
+{
+    S5L8702AESState *s = opaque;
+
+    s->pending = false;
+    S5L8702_aes_run(s);
+    qemu_irq_raise(s->irq);
+}
+
 static void S5L8702_aes_write(void *opaque, hwaddr offset, uint64_t value, unsigned size)
 {
     struct S5L8702AESState *aesop = (struct S5L8702AESState *)opaque;
-    static uint8_t keylenop = 0;
-
-    uint8_t *inbuf;
-    uint8_t *buf;
 
     // fprintf(stderr, "%s: offset 0x%08x value 0x%08x\n", __FUNCTION__, offset, value);
 
     switch(offset) {
         case AES_GO:
-            inbuf = (uint8_t *)malloc(aesop->insize);
-            cpu_physical_memory_read((aesop->inaddr), inbuf, aesop->insize);
-
-            switch(aesop->keytype) {
-                    case AESGID:    
-                        fprintf(stderr, "%s: No support for GID key\n", __func__);
-                        break;         
-                    case AESUID:
-                        AES_set_decrypt_key(key_uid, sizeof(key_uid) * 8, &aesop->decryptKey);
-                        break;
-                    case AESCustom:
-                        AES_set_decrypt_key((uint8_t *)aesop->custkey, 0x20 * 8, &aesop->decryptKey);
-                        break;
+            if (aesop->async) {
+                // the operation completes later, from the main loop
+                aesop->status = 0;
+                aesop->pending = true;
+                qemu_irq_lower(aesop->irq);
+                qemu_bh_schedule(aesop->done_bh);
+            } else {
+                S5L8702_aes_run(aesop);
             }
-
-            buf = (uint8_t *) malloc(aesop->insize);
-
-            if(aesop->keytype != 0x01) AES_cbc_encrypt(inbuf, buf, aesop->insize, &aesop->decryptKey, (uint8_t *)aesop->ivec, aesop->operation);
-
-            printf("AES: %s %d bytes from 0x%08x to 0x%08x\n", aesop->operation == AES_DECRYPT ? "decrypted" : "encrypted", aesop->insize, aesop->inaddr, aesop->outaddr);
-
-            cpu_physical_memory_write((aesop->outaddr), buf, aesop->insize);
-            memset(aesop->custkey, 0, 0x20);
-            memset(aesop->ivec, 0, 0x10);
-            free(inbuf);
-            free(buf);
-            keylenop = 0;
-            aesop->outsize = aesop->insize;
-            aesop->status = 0xf;
+            break;
+        case AES_STATUS:
+            // acknowledges the completion interrupt
+            qemu_irq_lower(aesop->irq);
             break;
         case AES_KEYLEN:
-            if(keylenop == 1) {
+            if(aesop->keylenop == 1) {
                 aesop->operation = value;
             }
-            keylenop++;
+            aesop->keylenop++;
             aesop->keylen = value;
             break;
         case AES_INADDR:
@@ -111,14 +210,61 @@ static void S5L8702_aes_init(Object *obj)
 
     memory_region_init_io(&s->iomem, obj, &aes_ops, s, "aes", 0x100);
     sysbus_init_mmio(sbd, &s->iomem);
+    sysbus_init_irq(sbd, &s->irq);
+    s->done_bh = qemu_bh_new(S5L8702_aes_done_bh, s);
 
     memset(&s->custkey, 0, 8 * sizeof(uint32_t));
     memset(&s->ivec, 0, 4 * sizeof(uint32_t));
 }
 
+static int S5L8702_aes_post_load(void *opaque, int version_id)
+{
+    S5L8702AESState *s = opaque;
+
+    // an operation that was started but not yet run completes after the restore
+    if (s->pending) {
+        qemu_bh_schedule(s->done_bh);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_S5L8702_aes = {
+    .name = TYPE_IPOD_NANO3G_AES,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = S5L8702_aes_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(pending, S5L8702AESState),
+        VMSTATE_UINT8(keylenop, S5L8702AESState),
+        VMSTATE_UINT32_ARRAY(ivec, S5L8702AESState, 4),
+        VMSTATE_UINT32(insize, S5L8702AESState),
+        VMSTATE_UINT32(inaddr, S5L8702AESState),
+        VMSTATE_UINT32(outsize, S5L8702AESState),
+        VMSTATE_UINT32(outaddr, S5L8702AESState),
+        VMSTATE_UINT32(auxaddr, S5L8702AESState),
+        VMSTATE_UINT32(keytype, S5L8702AESState),
+        VMSTATE_UINT32(status, S5L8702AESState),
+        VMSTATE_UINT32(ctrl, S5L8702AESState),
+        VMSTATE_UINT32(unkreg0, S5L8702AESState),
+        VMSTATE_UINT32(unkreg1, S5L8702AESState),
+        VMSTATE_UINT32(operation, S5L8702AESState),
+        VMSTATE_UINT32(keylen, S5L8702AESState),
+        VMSTATE_UINT32_ARRAY(custkey, S5L8702AESState, 8),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property S5L8702_aes_properties[] = {
+    DEFINE_PROP_BOOL("async", S5L8702AESState, async, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void S5L8702_aes_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
 
+    device_class_set_props(dc, S5L8702_aes_properties);
+    dc->vmsd = &vmstate_S5L8702_aes;
 }
 
 static const TypeInfo ipod_nano3g_aes_info = {
@@ -1,4 +1,67 @@
 #include "hw/arm/ipod_nano3g_clock.h"
+#include "hw/qdev-clock.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "trace.h"
+
+// without enforced gating a stopped output keeps running at its last frequency
+static bool S5L8702_clock_set(IPodNano3GClockState *s, Clock *clk, uint64_t period, bool propagate)
+{
+    if (!period && !s->gating) {
+        return false;
+    }
+    if (!clock_set(clk, period)) {
+        return false;
+    }
+    trace_ipod_nano3g_clock_update(object_get_canonical_path_component(OBJECT(clk)),
+                                   clock_get_hz(clk));
+    if (propagate) {
+        clock_propagate(clk);
+    }
+    return true;
+}
+
+static uint64_t S5L8702_pll_period(IPodNano3GClockState *s, uint32_t pllcon)
+{
+    uint32_t p = (pllcon >> CLOCK1_PLL_P_SHIFT) & CLOCK1_PLL_P_MASK;
+    uint32_t m = (pllcon >> CLOCK1_PLL_M_SHIFT) & CLOCK1_PLL_M_MASK;
+    uint32_t sdiv = pllcon & CLOCK1_PLL_S_MASK;
+
+    // a PLL without a pre-divider or multiplier is powered down
+    if (!p || !m) {
+        return 0;
+    }
+    return clock_get(s->osc) * (p << sdiv) / m;
+}
+
+static uint64_t S5L8702_cg_period(IPodNano3GClockState *s, uint16_t cg)
+{
+    uint32_t src = (cg >> CLOCK1_CG_SRC_SHIFT) & CLOCK1_CG_SRC_MASK;
+    uint32_t div = ((cg >> CLOCK1_CG_DIV_SHIFT) & CLOCK1_CG_DIV_MASK) + 1;
+    Clock *in = src == CLOCK1_CG_SRC_OSC ? s->osc : s->pll[src];
+
+    if (cg & CLOCK1_CG_DISABLE) {
+        return 0;
+    }
+    return clock_get(in) * div;
+}
+
+// recomputes the PLLs first, then the generators fed by them
+static void S5L8702_clock_update(IPodNano3GClockState *s, bool propagate)
+{
+    S5L8702_clock_set(s, s->pll[0], S5L8702_pll_period(s, s->pll0con), propagate);
+    S5L8702_clock_set(s, s->pll[1], S5L8702_pll_period(s, s->pll1con), propagate);
+    S5L8702_clock_set(s, s->pll[2], S5L8702_pll_period(s, s->pll2con), propagate);
+
+    S5L8702_clock_set(s, s->fclk, S5L8702_cg_period(s, s->config0 & 0xFFFF), propagate);
+    S5L8702_clock_set(s, s->pclk, S5L8702_cg_period(s, s->config1 & 0xFFFF), propagate);
+    S5L8702_clock_set(s, s->lcdclk, S5L8702_cg_period(s, s->config1 >> 16), propagate);
+}
+
+static void S5L8702_clock_osc_update(void *opaque, ClockEvent event)
+{
+    S5L8702_clock_update(opaque, true);
+}
 
 static void S5L8702_clock1_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
 {
@@ -14,6 +77,18 @@ static void S5L8702_clock1_write(void *opaque, hwaddr addr, uint64_t val, unsign
         case CLOCK1_CONFIG2:
             s->config2 = val;
             break;
+        case CLOCK1_PLL0CON:
+            s->pll0con = val;
+            break;
+        case CLOCK1_PLL1CON:
+            s->pll1con = val;
+            break;
+        case CLOCK1_PLL2CON:
+            s->pll2con = val;
+            break;
+        case CLOCK1_PLL3CON:
+            s->pll3con = val;
+            break;
         case CLOCK1_PLLLOCK:
             s->plllock = val;
             break;
@@ -23,6 +98,8 @@ static void S5L8702_clock1_write(void *opaque, hwaddr addr, uint64_t val, unsign
       default:
             break;
     }
+
+    S5L8702_clock_update(s, true);
 }
 
 static uint64_t S5L8702_clock1_read(void *opaque, hwaddr addr, unsigned size)
@@ -107,11 +184,61 @@ static void S5L8702_clock_init(Object *obj)
     s->pllmode = 0x00010001;
 
     memory_region_init_io(&s->iomem, obj, &clock1_ops, s, "clock", 0x1000);
+
+    s->osc = qdev_init_clock_in(dev, "osc", S5L8702_clock_osc_update, s, ClockUpdate);
+    s->pll[0] = qdev_init_clock_out(dev, "pll0");
+    s->pll[1] = qdev_init_clock_out(dev, "pll1");
+    s->pll[2] = qdev_init_clock_out(dev, "pll2");
+    s->fclk = qdev_init_clock_out(dev, "fclk");
+    s->pclk = qdev_init_clock_out(dev, "pclk");
+    s->lcdclk = qdev_init_clock_out(dev, "lcd");
+}
+
+static void S5L8702_clock_realize(DeviceState *dev, Error **errp)
+{
+    // consumers connected later pick up the output periods when they connect
+    S5L8702_clock_update(IPOD_NANO3G_CLOCK(dev), true);
+}
+
+static int S5L8702_clock_post_load(void *opaque, int version_id)
+{
+    // the consumers restore their own view of the clocks
+    S5L8702_clock_update(opaque, false);
+    return 0;
 }
 
+static const VMStateDescription vmstate_ipod_nano3g_clock = {
+    .name = TYPE_IPOD_NANO3G_CLOCK,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = S5L8702_clock_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(config0, IPodNano3GClockState),
+        VMSTATE_UINT32(config1, IPodNano3GClockState),
+        VMSTATE_UINT32(config2, IPodNano3GClockState),
+        VMSTATE_UINT32(pll0con, IPodNano3GClockState),
+        VMSTATE_UINT32(pll1con, IPodNano3GClockState),
+        VMSTATE_UINT32(pll2con, IPodNano3GClockState),
+        VMSTATE_UINT32(pll3con, IPodNano3GClockState),
+        VMSTATE_UINT32(plllock, IPodNano3GClockState),
+        VMSTATE_UINT32(pllmode, IPodNano3GClockState),
+        VMSTATE_CLOCK(osc, IPodNano3GClockState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property S5L8702_clock_properties[] = {
+    DEFINE_PROP_BOOL("gating", IPodNano3GClockState, gating, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void S5L8702_clock_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
 
+    dc->realize = S5L8702_clock_realize;
+    device_class_set_props(dc, S5L8702_clock_properties);
+    dc->vmsd = &vmstate_ipod_nano3g_clock;
 }
 
 static const TypeInfo ipod_nano3g_clock_info = {
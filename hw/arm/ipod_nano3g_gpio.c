@@ -1,4 +1,5 @@
 #include "hw/arm/ipod_nano3g_gpio.h"
+#include "migration/vmstate.h"
 
 static void S5L8702_gpio_write(void *opaque, hwaddr addr, uint64_t value, unsigned size)
 {
@@ -41,9 +42,21 @@ static void S5L8702_gpio_init(Object *obj)
     memory_region_init_io(&s->iomem, obj, &gpio_ops, s, "gpio", 0x10000);
 }
 
+static const VMStateDescription vmstate_ipod_nano3g_gpio = {
+    .name = TYPE_IPOD_NANO3G_GPIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(gpio_state, IPodNano3GGPIOState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void S5L8702_gpio_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
 
+    dc->vmsd = &vmstate_ipod_nano3g_gpio;
 }
 
 static const TypeInfo ipod_nano3g_gpio_info = {
@@ -1,13 +1,23 @@
 #include "hw/arm/ipod_nano3g_jpeg.h"
-
-uint8_t zigzag[] = { 0, 1, 5, 6, 14, 15, 27, 28, 
-                     2, 4, 7, 13, 16, 26, 29, 42, 
-                     3, 8, 12, 17, 25, 30, 41, 43, 
-                     9, 11, 18, 24, 31, 40, 44, 53, 
-                     10, 19, 23, 32, 39, 45, 52, 54, 
-                     20, 22, 33, 38, 46, 51, 55, 60, 
-                     21, 34, 37, 47, 50, 56, 59, 61, 
-                     35, 36, 48, 49, 57, 58, 62, 63 };
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "qemu/host-utils.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
+#include "block/thread-pool.h"
+#include "block/aio-wait.h"
+#include "migration/vmstate.h"
+#include "sysemu/runstate.h"
+#include <math.h>
+
+static const uint8_t zigzag[] = { 0, 1, 5, 6, 14, 15, 27, 28,
+                                  2, 4, 7, 13, 16, 26, 29, 42,
+                                  3, 8, 12, 17, 25, 30, 41, 43,
+                                  9, 11, 18, 24, 31, 40, 44, 53,
+                                  10, 19, 23, 32, 39, 45, 52, 54,
+                                  20, 22, 33, 38, 46, 51, 55, 60,
+                                  21, 34, 37, 47, 50, 56, 59, 61,
+                                  35, 36, 48, 49, 57, 58, 62, 63 };
 
 static uint8_t clamp(double x) {
     if (x < 0) {
@@ -19,125 +29,258 @@ static uint8_t clamp(double x) {
     }
 }
 
-static double idct_lookup[8][8][8][8];
+/*
+ * The 2D IDCT basis factors as idct_c[u] * idct_cos[x][u] times
+ * idct_c[v] * idct_cos[y][v], so a block is transformed with two passes of
+ * eight 8-wide multiply-adds (the compiler lowers JPEGVec to SSE2/AVX/NEON)
+ * instead of 64 multiply-adds per pixel.
+ */
+static double idct_c[8];
+static double idct_cos[8][8];
+static double idct_a[8][8];
+static JPEGVec idct_b[8];
+
+/*
+ * The separable sums are rounded differently from the original direct
+ * evaluation, by far less than the margin used here. Only pixels that land
+ * this close to a .5 rounding boundary could round the other way, and those
+ * are recomputed with the direct formula so the output is unchanged. Zero
+ * coefficients add exactly nothing to the direct sum, so only the nonzero
+ * ones (in their original order) are visited.
+ */
+static double s5l8702_jpeg_idct_direct(const int32_t *dct, const uint8_t *nonzero, int count, int y, int x) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        int u = nonzero[i] / 8;
+        int v = nonzero[i] % 8;
+        double basis = idct_c[u] * idct_c[v] * idct_cos[x][u] * idct_cos[y][v];
+        sum += basis * dct[nonzero[i]];
+    }
+    return round(sum/4 + 128);
+}
 
-static void s5l8702_jpeg_decode(EncodedMCU* mcu, uint32_t* qtable1, uint32_t* qtable2, uint8_t* yout, uint8_t* cbout, uint8_t* crout) {
-    DecodedMCU* decoded = malloc(sizeof(DecodedMCU) * 300);
-    double *yplane = malloc(sizeof(double) * 320 * 240);
-    double *crplane = malloc(sizeof(double) * 160 * 120);
-    double *cbplane = malloc(sizeof(double) * 160 * 120);
+/*
+ * Dequantizes and transforms one 8x8 block and stores it into the output
+ * plane. The hardware emits the block transposed with every group of four
+ * pixels byte-reversed, which is folded into the stores.
+ */
+static void s5l8702_jpeg_idct_block(const Block *block, const uint32_t *qtable, uint8_t *out, unsigned stride) {
+    int32_t dct[64];
+    uint8_t nonzero[64];
+    int count = 0;
+    double magnitude = 0;
+    uint8_t rows = 0;
+    JPEGVec t[8];
+
+    // dequantize, undoing the zigzag order
+    for (int l = 0; l < 0x40; l++) {
+        dct[l] = __builtin_bswap32(block->coeff[zigzag[l]]) * qtable[l];
+        magnitude += fabs((double)dct[l]);
+        if (dct[l]) {
+            rows |= 1 << (l / 8);
+            nonzero[count++] = l;
+        }
+    }
 
-    int32_t dct_matrix[8][8];
+    const double margin = magnitude * 0x1p-36 + 0x1p-30;
 
-    for(int i = 0; i < 300; i++) {
-        // do the luminance blocks
-        for (int data_unit_row = 0; data_unit_row < 2; data_unit_row++) {
-            for (int data_unit_column = 0; data_unit_column < 2; data_unit_column++) {
-                
-                // dequantize
-                for (int l = 0; l < 0x40; l++) {
-                    dct_matrix[l / 8][l % 8] = __builtin_bswap32(mcu[i].lum[data_unit_row*2+data_unit_column].coeff[zigzag[l]]) * qtable1[l];
-                }
-
-                // perform IDCT
-                for (int y = 0; y < 8; y++) {
-                    for (int x = 0; x < 8; x++) {
-                        double sum = 0;
-                        for (int u = 0; u < 8; u++) {
-                            for (int v = 0; v < 8; v++) {
-                                sum += idct_lookup[y][x][u][v] * dct_matrix[u][v];
-                            }
-                        }
-
-                        decoded[i].yplane[data_unit_column*8+y][data_unit_row*8+x] = round(sum/4 + 128);
-                    }
-                }
-            }
+    // most coefficient rows are empty, those contribute nothing to either pass
+    for (int u = 0; u < 8; u++) {
+        if (!(rows & (1 << u))) {
+            continue;
         }
-
-        // do the chrominance blocks
-        // dequantize
-        for (int l = 0; l < 0x40; l++) {
-            dct_matrix[l / 8][l % 8] = __builtin_bswap32(mcu[i].chromb.coeff[zigzag[l]]) * qtable2[l];
+        JPEGVec acc = (double)dct[u * 8] * idct_b[0];
+        for (int v = 1; v < 8; v++) {
+            acc += (double)dct[u * 8 + v] * idct_b[v];
         }
+        t[u] = acc;
+    }
 
-        // perform IDCT
-        for (int y = 0; y < 8; y++) {
-            for (int x = 0; x < 8; x++) {
-                double sum = 0;
-                for (int u = 0; u < 8; u++) {
-                    for (int v = 0; v < 8; v++) {
-                        sum += idct_lookup[y][x][u][v] * dct_matrix[u][v];
-                    }
-                }
-
-                // set four pixels
-                decoded[i].cbplane[y][x] = round(sum/4 + 128);
+    for (int x = 0; x < 8; x++) {
+        JPEGVec sum = (JPEGVec){ 0 };
+        for (int u = 0; u < 8; u++) {
+            if (rows & (1 << u)) {
+                sum += idct_a[x][u] * t[u];
             }
         }
+        // biased by one half, so that truncating rounds to the nearest value
+        sum = sum / 4 + (128 + 0.5);
 
-        // dequantize
-        for (int l = 0; l < 0x40; l++) {
-            dct_matrix[l / 8][l % 8] = __builtin_bswap32(mcu[i].chromr.coeff[zigzag[l]]) * qtable2[l];
+        uint8_t *row = out + x * stride;
+        unsigned ties = 0;
+        for (int y = 0; y < 8; y++) {
+            // clamping to the middle of the edge pixel values keeps them out of the tie check
+            double q = sum[y];
+            q = q < 0.5 ? 0.5 : q;
+            q = q > 255.5 ? 255.5 : q;
+
+            int truncated = q;
+            double frac = q - truncated;
+            ties |= (frac <= margin || frac >= 1 - margin) << y;
+            row[y ^ 3] = truncated;
         }
 
-        // perform IDCT
-        for (int y = 0; y < 8; y++) {
-            for (int x = 0; x < 8; x++) {
-                double sum = 0;
-                for (int u = 0; u < 8; u++) {
-                    for (int v = 0; v < 8; v++) {
-                        sum += idct_lookup[y][x][u][v] * dct_matrix[u][v];
-                    }
-                }
-
-                // set four pixels
-                decoded[i].crplane[y][x] = round(sum/4 + 128);
-            }
+        while (ties) {
+            int y = ctz32(ties);
+            row[y ^ 3] = clamp(s5l8702_jpeg_idct_direct(dct, nonzero, count, y, x));
+            ties &= ties - 1;
         }
     }
+}
 
-    // reconstruct the image
-    for (int i = 0; i < 300; i++) {
-        for (int y = 0; y < 16; y++) {
-            for (int x = 0; x < 16; x++) {
-                yplane[(i%20)*16 + (i/20) * 16 * 320 + (y)*320 + x] = decoded[i].yplane[x][y];
-            }
-        }
-        for (int y = 0; y < 8; y++) {
-            for (int x = 0; x < 8; x++) {
-                cbplane[(i%20)*8 + (i/20) * 8 * 160 + (y)*160 + x] = decoded[i].cbplane[x][y];
-                crplane[(i%20)*8 + (i/20) * 8 * 160 + (y)*160 + x] = decoded[i].crplane[x][y];
+// decodes one row of MCUs of the current frame, may run on a worker thread
+static void s5l8702_jpeg_decode_row(S5L8702JPEGState *s, unsigned mcu_y) {
+    const S5L8702JPEGFrame *f = &s->frame;
+    unsigned lum_blocks = f->lum_cols * f->lum_rows;
+
+    for (unsigned mcu_x = 0; mcu_x < f->mcus_x; mcu_x++) {
+        const Block *mcu = s->blocks + (mcu_y * f->mcus_x + mcu_x) * (lum_blocks + 2);
+
+        // do the luminance blocks
+        for (unsigned data_unit_row = 0; data_unit_row < f->lum_rows; data_unit_row++) {
+            for (unsigned data_unit_column = 0; data_unit_column < f->lum_cols; data_unit_column++) {
+                uint8_t *out = s->yplane + (mcu_y * f->lum_rows * 8 + data_unit_row * 8) * f->y_stride
+                             + mcu_x * f->lum_cols * 8 + data_unit_column * 8;
+                s5l8702_jpeg_idct_block(&mcu[data_unit_row * f->lum_cols + data_unit_column], f->qtable1, out, f->y_stride);
             }
         }
+
+        // do the chrominance blocks
+        unsigned chroma_offset = mcu_y * 8 * f->c_stride + mcu_x * 8;
+        s5l8702_jpeg_idct_block(&mcu[lum_blocks], f->qtable2, s->cbplane + chroma_offset, f->c_stride);
+        s5l8702_jpeg_idct_block(&mcu[lum_blocks + 1], f->qtable2, s->crplane + chroma_offset, f->c_stride);
+    }
+}
+
+/*
+ * Lays out the configured geometry. The planes are padded to whole MCUs and
+ * the scratch buffers are sized once, every frame has the same layout.
+ */
+static bool s5l8702_jpeg_setup_geometry(S5L8702JPEGState *s, Error **errp) {
+    S5L8702JPEGFrame *f = &s->frame;
+
+    switch (s->subsampling) {
+    case JPEG_FORMAT_420:
+        f->lum_cols = 2;
+        f->lum_rows = 2;
+        break;
+    case JPEG_FORMAT_422:
+        f->lum_cols = 2;
+        f->lum_rows = 1;
+        break;
+    case JPEG_FORMAT_444:
+        f->lum_cols = 1;
+        f->lum_rows = 1;
+        break;
+    default:
+        error_setg(errp, "unknown subsampling format %d", s->subsampling);
+        return false;
+    }
+
+    if (!s->width || !s->height || s->width > JPEG_MAX_DIMENSION || s->height > JPEG_MAX_DIMENSION) {
+        error_setg(errp, "frame of %ux%u is not supported", s->width, s->height);
+        return false;
+    }
+
+    f->mcus_x = DIV_ROUND_UP(s->width, f->lum_cols * 8);
+    f->mcus_y = DIV_ROUND_UP(s->height, f->lum_rows * 8);
+    f->y_stride = f->mcus_x * f->lum_cols * 8;
+    f->c_stride = f->mcus_x * 8;
+    f->y_size = f->y_stride * f->mcus_y * f->lum_rows * 8;
+    f->c_size = f->c_stride * f->mcus_y * 8;
+    f->num_blocks = f->mcus_x * f->mcus_y * (f->lum_cols * f->lum_rows + 2);
+
+    s->blocks = g_new(Block, f->num_blocks);
+    s->yplane = g_malloc(f->y_size);
+    s->cbplane = g_malloc(f->c_size);
+    s->crplane = g_malloc(f->c_size);
+    return true;
+}
+
+static void s5l8702_jpeg_write_output(S5L8702JPEGState *s) {
+    const S5L8702JPEGFrame *f = &s->frame;
+
+    address_space_write(s->nsas, f->out_addr, MEMTXATTRS_UNSPECIFIED, s->yplane, f->y_size);
+    address_space_write(s->nsas, f->out_addr + f->y_size, MEMTXATTRS_UNSPECIFIED, s->cbplane, f->c_size);
+    address_space_write(s->nsas, f->out_addr + f->y_size + f->c_size, MEMTXATTRS_UNSPECIFIED, s->crplane, f->c_size);
+}
+
+// the line stays raised until the guest acknowledges the frame
+static void s5l8702_jpeg_frame_done(S5L8702JPEGState *s) {
+    s->irq_pending = true;
+    qemu_irq_raise(s->irq);
+}
+
+static void s5l8702_jpeg_start(S5L8702JPEGState *s);
+
+static int s5l8702_jpeg_row_worker(void *opaque) {
+    S5L8702JPEGRowTask *task = opaque;
+    s5l8702_jpeg_decode_row(task->s, task->mcu_y);
+    return 0;
+}
+
+// thread pool completions run from a bottom half in the main loop
+static void s5l8702_jpeg_row_done(void *opaque, int ret) {
+    S5L8702JPEGRowTask *task = opaque;
+    S5L8702JPEGState *s = task->s;
+
+    g_free(task);
+    if (--s->rows_pending > 0) {
+        return;
     }
 
-    for (int i = 0; i < 320 * 240; i++) {
-        yout[i] = clamp(yplane[i]);
+    if (s->discard_frame) {
+        // the engine was reset while the frame was decoding
+        s->discard_frame = false;
+    } else {
+        s5l8702_jpeg_write_output(s);
+        s5l8702_jpeg_frame_done(s);
     }
 
-    for (int i = 0; i < 160 * 120; i++) {
-        cbout[i] = clamp(cbplane[i]);
-        crout[i] = clamp(crplane[i]);
+    if (s->start_queued) {
+        s->start_queued = false;
+        s5l8702_jpeg_start(s);
     }
+}
 
-    for (int i = 0; i < 320 * 240; i += 4) {
-        // __builtin_bswap32 the pixels to reverse columns of 4 pixels in place in each channel
-        uint32_t *y32 = (uint32_t *)&yout[i];
-        *y32 = __builtin_bswap32(*y32);
+static void s5l8702_jpeg_start(S5L8702JPEGState *s) {
+    S5L8702JPEGFrame *f = &s->frame;
+
+    if (s->rows_pending) {
+        // the frame is started as soon as the engine is idle again
+        if (s->start_queued) {
+            qemu_log_mask(LOG_GUEST_ERROR, "%s: engine started while busy, start already queued\n", __func__);
+        }
+        s->start_queued = true;
+        return;
     }
 
-    for (int i = 0; i < 160 * 120; i += 4) {
-        uint32_t *cb32 = (uint32_t *)&cbout[i];
-        uint32_t *cr32 = (uint32_t *)&crout[i];
-        *cb32 = __builtin_bswap32(*cb32);
-        *cr32 = __builtin_bswap32(*cr32);
+    // the workers must not see table updates for the next image
+    memcpy(f->qtable1, s->qtable1, sizeof(f->qtable1));
+    memcpy(f->qtable2, s->qtable2, sizeof(f->qtable2));
+    f->out_addr = (s->regs[JPEG_REG(JPEG_REG_OUT_CRPLANE)] + 0x10000) ^ 0x80000000;
+
+    address_space_read(s->nsas, s->regs[JPEG_REG(JPEG_REG_COEFF_BLOCKS)] ^ 0x80000000, MEMTXATTRS_UNSPECIFIED, s->blocks, sizeof(Block) * f->num_blocks);
+
+    // small images, like the boot splash, are done before the guest can notice
+    if (f->mcus_x * f->mcus_y <= JPEG_SYNC_MAX_MCUS) {
+        for (unsigned mcu_y = 0; mcu_y < f->mcus_y; mcu_y++) {
+            s5l8702_jpeg_decode_row(s, mcu_y);
+        }
+        s5l8702_jpeg_write_output(s);
+        s5l8702_jpeg_frame_done(s);
+        return;
     }
 
-    free(decoded);
-    free(yplane);
-    free(cbplane);
-    free(crplane);
+    // anything larger is decoded one MCU row per worker, keeping the vCPU running
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_aio_context());
+    s->rows_pending = f->mcus_y;
+    for (unsigned mcu_y = 0; mcu_y < f->mcus_y; mcu_y++) {
+        S5L8702JPEGRowTask *task = g_new(S5L8702JPEGRowTask, 1);
+        task->s = s;
+        task->mcu_y = mcu_y;
+        thread_pool_submit_aio(pool, s5l8702_jpeg_row_worker, task, s5l8702_jpeg_row_done, task);
+    }
 }
 
 static uint64_t s5l8702_jpeg_read(void *opaque, hwaddr addr, unsigned size) {
@@ -146,8 +289,9 @@ static uint64_t s5l8702_jpeg_read(void *opaque, hwaddr addr, unsigned size) {
     uint32_t r = 0;
 
     switch (addr) {
-    case 0x60000:
-        r = 0xFFFFFFFF;
+    case JPEG_REG_STATUS:
+        // all bits read as set once the engine is idle
+        r = s->rows_pending ? 0 : 0xFFFFFFFF;
         break;
     
     default:
@@ -163,7 +307,9 @@ static void s5l8702_jpeg_write(void *opaque, hwaddr addr, uint64_t data, unsigne
     // fprintf(stderr, "%s: writing 0x%08x to 0x%08x\n", __func__, data, addr);
     
     S5L8702JPEGState *s = S5L8702JPEG(opaque);
-    s->regs[addr / 4] = data;
+    if (addr >= JPEG_REG_WINDOW && addr < JPEG_REG_WINDOW + sizeof(s->regs)) {
+        s->regs[JPEG_REG(addr)] = data;
+    }
 
     switch (addr) {
     case JPEG_REG_QTABLE1 ... JPEG_REG_QTABLE1 + JPEG_QTABLE_LEN:
@@ -173,23 +319,11 @@ static void s5l8702_jpeg_write(void *opaque, hwaddr addr, uint64_t data, unsigne
         s->qtable2[(addr - JPEG_REG_QTABLE2)/4] = data;
         break;
     case JPEG_REG_CTRL:
-        EncodedMCU* mcu = malloc(sizeof(EncodedMCU) * 300);
-        uint8_t *yplane = malloc(sizeof(uint8_t) * 320 * 240);
-        uint8_t *cbplane = malloc(sizeof(uint8_t) * 320 * 240);
-        uint8_t *crplane = malloc(sizeof(uint8_t) * 320 * 240);
-
-        MemTxResult result = address_space_read(s->nsas, s->regs[JPEG_REG_COEFF_BLOCKS/4] ^ 0x80000000, MEMTXATTRS_UNSPECIFIED, mcu, sizeof(EncodedMCU) * 300);
-
-        s5l8702_jpeg_decode(mcu, s->qtable1, s->qtable2, yplane, cbplane, crplane);
-
-        address_space_write(s->nsas, (s->regs[JPEG_REG_OUT_CRPLANE/4] + 0x10000) ^ 0x80000000, MEMTXATTRS_UNSPECIFIED, yplane, 320 * 240);
-        address_space_write(s->nsas, (s->regs[JPEG_REG_OUT_CRPLANE/4] + 0x10000 + 0x12C00) ^ 0x80000000, MEMTXATTRS_UNSPECIFIED, cbplane, 160 * 120);
-        address_space_write(s->nsas, (s->regs[JPEG_REG_OUT_CRPLANE/4] + 0x10000 + 0x12C00 + 0x4B00) ^ 0x80000000, MEMTXATTRS_UNSPECIFIED, crplane, 160 * 120);
-
-        free(mcu);
-        free(yplane);
-        free(cbplane);
-        free(crplane);
+        s5l8702_jpeg_start(s);
+        break;
+    case JPEG_REG_STATUS:
+        s->irq_pending = false;
+        qemu_irq_lower(s->irq);
         break;
     
     default:
@@ -206,21 +340,42 @@ static const MemoryRegionOps jpeg_ops = {
 static void s5l8702_jpeg_reset(DeviceState *d) {
     S5L8702JPEGState *s = (S5L8702JPEGState *)d;
 	memset(s->regs, 0, sizeof(s->regs));
+    if (s->rows_pending) {
+        s->discard_frame = true;
+    }
+    s->start_queued = false;
+    s->irq_pending = false;
+    qemu_irq_lower(s->irq);
+}
+
+// row workers write into the state, so finish the frame before it is saved
+static void s5l8702_jpeg_vm_state_change(void *opaque, bool running, RunState state) {
+    S5L8702JPEGState *s = opaque;
+
+    if (!running) {
+        AIO_WAIT_WHILE(NULL, s->rows_pending > 0);
+    }
 }
 
 static void s5l8702_jpeg_realize(DeviceState *dev, struct Error **errp) {
     S5L8702JPEGState *s = S5L8702JPEG(dev);
 
-    // precompute the IDCT lookup table
-    for (int y = 0; y < 8; y++) { 
-        for (int x = 0; x < 8; x++) { 
-            for (int u = 0; u < 8; u++) { 
-                for (int v = 0; v < 8; v++) { 
-                    double cu = (u == 0) ? (1 / sqrt(2)) : 1;
-                    double cv = (v == 0) ? (1 / sqrt(2)) : 1;
-                    idct_lookup[y][x][u][v] = cu * cv * cos(((2 * x + 1) * u * M_PI) / 16) * cos(((2 * y + 1) * v * M_PI) / 16);
-                }
-            }
+    if (!s5l8702_jpeg_setup_geometry(s, errp)) {
+        return;
+    }
+    qemu_add_vm_change_state_handler(s5l8702_jpeg_vm_state_change, s);
+
+    // precompute the IDCT basis
+    for (int u = 0; u < 8; u++) {
+        idct_c[u] = (u == 0) ? (1 / sqrt(2)) : 1;
+        for (int x = 0; x < 8; x++) {
+            idct_cos[x][u] = cos(((2 * x + 1) * u * M_PI) / 16);
+        }
+    }
+    for (int u = 0; u < 8; u++) {
+        for (int x = 0; x < 8; x++) {
+            idct_a[x][u] = idct_c[u] * idct_cos[x][u];
+            idct_b[u][x] = idct_c[u] * idct_cos[x][u];
         }
     }
 }
@@ -230,18 +385,40 @@ static void s5l8702_jpeg_init(Object *obj) {
     DeviceState *dev = DEVICE(sbd);
     S5L8702JPEGState *s = S5L8702JPEG(dev);
 
-    memory_region_init_io(&s->iomem, obj, &jpeg_ops, s, "jpeg", sizeof(s->regs));
+    memory_region_init_io(&s->iomem, obj, &jpeg_ops, s, "jpeg", JPEG_MMIO_SIZE);
     sysbus_init_mmio(sbd, &s->iomem);
     sysbus_init_irq(sbd, &s->irq);
 
     s5l8702_jpeg_reset(s);
 }
 
+static const VMStateDescription vmstate_s5l8702_jpeg = {
+    .name = TYPE_S5L8702JPEG,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, S5L8702JPEGState, JPEG_NUM_REGS),
+        VMSTATE_UINT32_ARRAY(qtable1, S5L8702JPEGState, 64),
+        VMSTATE_UINT32_ARRAY(qtable2, S5L8702JPEGState, 64),
+        VMSTATE_BOOL(irq_pending, S5L8702JPEGState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property s5l8702_jpeg_properties[] = {
+    DEFINE_PROP_UINT32("width", S5L8702JPEGState, width, 320),
+    DEFINE_PROP_UINT32("height", S5L8702JPEGState, height, 240),
+    DEFINE_PROP_UINT8("subsampling", S5L8702JPEGState, subsampling, JPEG_FORMAT_420),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void s5l8702_jpeg_class_init(ObjectClass *klass, void *data) {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = s5l8702_jpeg_realize;
+    device_class_set_props(dc, s5l8702_jpeg_properties);
     dc->reset = s5l8702_jpeg_reset;
+    dc->vmsd = &vmstate_s5l8702_jpeg;
 }
 
 static const TypeInfo s5l8702_jpeg_info = {
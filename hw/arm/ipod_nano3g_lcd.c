@@ -1,7 +1,11 @@
 #include "hw/arm/ipod_nano3g_lcd.h"
-#include "ui/pixel_ops.h"
+#include "hw/arm/ipod_nano3g_milestones.h"
 #include "ui/console.h"
 #include "hw/display/framebuffer.h"
+#include "hw/qdev-clock.h"
+#include "qapi/error.h"
+#include "migration/vmstate.h"
+#include "sysemu/runstate.h"
 
 #define LCD_CONFIG (0x000)
 #define LCD_WCMD   (0x004)
@@ -13,6 +17,112 @@
 #define LCD_PHTIME (0x020)
 #define LCD_WDATA  (0x040)
 
+/*
+ * Maps the framebuffer RAM so that GRAM writes become plain stores. Returns
+ * false if the framebuffer is not RAM-backed, in which case writes go
+ * through the address space.
+ */
+static bool lcd_map_gram(IPodNano3GLCDState *s) {
+    if (s->gram) {
+        return true;
+    }
+
+    s->gram_section = memory_region_find(s->sysmem, LCD_FRAMEBUFFER_BASE, LCD_WIDTH * LCD_HEIGHT * 2);
+    if (!s->gram_section.mr) {
+        return false;
+    }
+    if (!memory_region_is_ram(s->gram_section.mr) || int128_get64(s->gram_section.size) < LCD_WIDTH * LCD_HEIGHT * 2) {
+        memory_region_unref(s->gram_section.mr);
+        s->gram_section.mr = NULL;
+        return false;
+    }
+
+    s->gram = memory_region_get_ram_ptr(s->gram_section.mr) + s->gram_section.offset_within_region;
+    return true;
+}
+
+/*
+ * The bootloader's Red-X screen is the only thing it draws that is mostly
+ * saturated red, so a few percent of such pixels in GRAM is enough to tell.
+ * Only checked until the milestone has been seen, and at most once per
+ * refresh, after GRAM changed.
+ */
+static void lcd_detect_red_x(IPodNano3GLCDState *s) {
+    unsigned red = 0;
+
+    for (unsigned i = 0; i < LCD_WIDTH * LCD_HEIGHT; i++) {
+        uint16_t px = lduw_le_p(s->gram + i * 2);
+        if ((px >> 11) >= 24 && ((px >> 5) & 0x3F) <= 16 && (px & 0x1F) <= 8) {
+            red++;
+        }
+    }
+
+    if (red >= LCD_WIDTH * LCD_HEIGHT / 50) {
+        ipod_nano3g_milestone(IPOD_NANO3G_MILESTONE_RED_X);
+    }
+}
+
+// marks everything stored since the last flush dirty in one go
+static void lcd_flush_gram(IPodNano3GLCDState *s) {
+    if (s->gram_dirty_end <= s->gram_dirty_start) {
+        return;
+    }
+
+    s->red_x_check = true;
+    memory_region_set_dirty(s->gram_section.mr, s->gram_section.offset_within_region + s->gram_dirty_start,
+                            s->gram_dirty_end - s->gram_dirty_start);
+    s->gram_dirty_start = s->gram_dirty_end = 0;
+}
+
+// collects the four parameter bytes of a 0x2A/0x2B command: start and end, big-endian
+static void lcd_window_param(IPodNano3GLCDState *s, uint8_t val) {
+    if (s->window_param_count >= 4) {
+        return;
+    }
+
+    s->window_params[s->window_param_count++] = val;
+    if (s->window_param_count < 4) {
+        return;
+    }
+
+    uint16_t start = s->window_params[0] << 8 | s->window_params[1];
+    uint16_t end = s->window_params[2] << 8 | s->window_params[3];
+    if (s->lcd_wcmd == 0x2A) {
+        s->col_end = MIN(end, LCD_WIDTH - 1);
+        s->col_start = MIN(start, s->col_end);
+    } else {
+        s->row_end = MIN(end, LCD_HEIGHT - 1);
+        s->row_start = MIN(start, s->row_end);
+    }
+}
+
+static void lcd_write_pixel(IPodNano3GLCDState *s, uint16_t val) {
+    hwaddr offset = ((hwaddr)s->cur_row * LCD_WIDTH + s->cur_col) * 2;
+
+    if (lcd_map_gram(s)) {
+        stw_le_p(s->gram + offset, val);
+        if (s->gram_dirty_end <= s->gram_dirty_start) {
+            s->gram_dirty_start = offset;
+            s->gram_dirty_end = offset + 2;
+        } else {
+            s->gram_dirty_start = MIN(s->gram_dirty_start, offset);
+            s->gram_dirty_end = MAX(s->gram_dirty_end, offset + 2);
+        }
+    } else {
+        uint8_t buf[2];
+        stw_le_p(buf, val);
+        address_space_write(s->nsas, LCD_FRAMEBUFFER_BASE + offset, MEMTXATTRS_UNSPECIFIED, buf, 2);
+    }
+
+    // advance through the window, wrapping back to its top left corner
+    if (++s->cur_col > s->col_end) {
+        s->cur_col = s->col_start;
+        if (++s->cur_row > s->row_end) {
+            s->cur_row = s->row_start;
+        }
+    }
+}
+
 static uint64_t S5L8702_lcd_read(void *opaque, hwaddr addr, unsigned size) {
     IPodNano3GLCDState *s = (IPodNano3GLCDState *)opaque;
     uint64_t r = 0;
@@ -63,18 +173,25 @@ static void S5L8702_lcd_write(void *opaque, hwaddr addr, uint64_t val, unsigned
             s->lcd_config = val;
             break;
         case LCD_WCMD:
+            ipod_nano3g_milestone(IPOD_NANO3G_MILESTONE_LCD_FIRST_CMD);
+            lcd_flush_gram(s);
             s->lcd_wcmd = val;
             //if(val < 0x2A || val > 0x2C) printf("LCD Got Command 0x%08x\n", s->lcd_wcmd);
             switch(s->lcd_wcmd) {
                 case 0x04:
-                    fifo8_reset(s->dbuff_buf);
-                    fifo8_push(s->dbuff_buf, 0x00);
-                    fifo8_push(s->dbuff_buf, 0x38);
-                    fifo8_push(s->dbuff_buf, 0xB3);
-                    fifo8_push(s->dbuff_buf, 0x71);
+                    fifo8_reset(&s->dbuff_buf);
+                    fifo8_push(&s->dbuff_buf, 0x00);
+                    fifo8_push(&s->dbuff_buf, 0x38);
+                    fifo8_push(&s->dbuff_buf, 0xB3);
+                    fifo8_push(&s->dbuff_buf, 0x71);
+                    break;
+                case 0x2a:
+                case 0x2b:
+                    s->window_param_count = 0;
                     break;
                 case 0x2c:
-                    s->memcnt = 0;
+                    s->cur_col = s->col_start;
+                    s->cur_row = s->row_start;
                     break;
                 case 0x28:
                     printf("DISPLAY OFF\n");
@@ -90,8 +207,8 @@ static void S5L8702_lcd_write(void *opaque, hwaddr addr, uint64_t val, unsigned
         case LCD_RDATA:
             s->lcd_rdata = val;
             if(val == 0) {
-                if(fifo8_is_empty(s->dbuff_buf)) s->lcd_dbuff = 0;
-                else s->lcd_dbuff = fifo8_pop(s->dbuff_buf) << 1;
+                if(fifo8_is_empty(&s->dbuff_buf)) s->lcd_dbuff = 0;
+                else s->lcd_dbuff = fifo8_pop(&s->dbuff_buf) << 1;
             }
             break;
         case LCD_DBUFF:
@@ -110,22 +227,18 @@ static void S5L8702_lcd_write(void *opaque, hwaddr addr, uint64_t val, unsigned
             s->lcd_wdata = val;
             switch(s->lcd_wcmd) {
             case 0x2A:
-                //printf("LCD GOT 0x2A: %04x\n", val);
-                break;
             case 0x2B:
-                //printf("LCD GOT 0x2B: %04x\n", val);
+                //printf("LCD GOT 0x%02x: %04x\n", s->lcd_wcmd, val);
+                lcd_window_param(s, val & 0xFF);
                 break;
             case 0x2C:
-                address_space_rw(s->nsas, 0xfe00000 + s->memcnt, MEMTXATTRS_UNSPECIFIED, &val, 2, 1);
-                s->invalidate = true;
-                //printf("FB writing %08x to %08x\n", val, s->memcnt);
-                s->memcnt += 2;
+                lcd_write_pixel(s, val);
                 break;
             case 0x3A:
                 //printf("LCD GOT 0x3A: %04x\n", val);
                 break;
             default:
-                s->lcd_regs[s->lcd_wcmd] = s->lcd_regs[s->lcd_wcmd] << 8 | (val & 0xFF);
+                s->lcd_regs[s->lcd_wcmd & 0xFF] = s->lcd_regs[s->lcd_wcmd & 0xFF] << 8 | (val & 0xFF);
                 // fprintf(stderr, "LCD Register 0x%02x = 0x%016llx\n", s->lcd_wcmd, s->lcd_regs[s->lcd_wcmd]);
                 break;
             }
@@ -142,25 +255,6 @@ static void lcd_invalidate(void *opaque)
     s->invalidate = 1;
 }
 
-static void draw_line32_32(void *opaque, uint8_t *d, const uint8_t *s, int width, int deststep)
-{
-    uint8_t r, g, b;
-
-    do {
-        uint16_t v = lduw_le_p((void *) s);
-        //printf("V: %d\n", *s);
-        // convert 5-6-5 to 8-8-8
-        // uint16_t v = ((uint16_t *) s)[0];
-        r = (uint8_t)(((v & 0xF800) >> 11) << 3);
-        g = (uint8_t)(((v & 0x7E0) >> 5) << 2);
-        b = (uint8_t)(((v & 0x1F)) << 3);
-        // if(r > 0 && r < 0xFF) printf("R: %d, G: %d, B: %d\n", r, g, b);
-        ((uint32_t *) d)[0] = rgb_to_pixel32(r, g, b);
-        s += 2;
-        d += 4;
-    } while (-- width != 0);
-}
-
 static void lcd_refresh(void *opaque)
 {
     //fprintf(stderr, "%s: refreshing LCD screen\n", __func__);
@@ -175,20 +269,31 @@ static void lcd_refresh(void *opaque)
     if (!lcd || !lcd->con || !surface_bits_per_pixel(surface))
         return;
 
+    // the panel is fed 5-6-5 pixels
+    draw_line = framebuffer_get_drawfn(FRAMEBUFFER_FORMAT_RGB565, surface_bits_per_pixel(surface));
+    if (!draw_line)
+        return;
     dest_width = 4;
-    draw_line = draw_line32_32;
 
     /* Resolution */
     first = last = 0;
     width = 240;
     height = 376;
-    lcd->invalidate = 1;
 
     src_width =  2 * width;
     linesize = surface_stride(surface);
 
+    // pixels pushed through 0x2C since the last command are marked dirty now
+    lcd_flush_gram(lcd);
+
+    // the framebuffer RAM is dirty-logged, so only a full invalidate needs a
+    // new section; otherwise just the rows the guest wrote get redrawn
     if(lcd->invalidate) {
-        framebuffer_update_memory_section(&lcd->fbsection, lcd->sysmem, 0xfe00000, height, src_width);
+        framebuffer_update_memory_section(&lcd->fbsection, lcd->sysmem, LCD_FRAMEBUFFER_BASE, height, src_width);
+        if (!lcd->fbsection.mr) {
+            // the framebuffer isn't backed by RAM (yet), retry on the next refresh
+            return;
+        }
     }
 
     framebuffer_update_display(surface, &lcd->fbsection,
@@ -238,39 +343,147 @@ static void ipod_nano3g_lcd_mouse_event(void *opaque, int x, int y, int z, int b
     }
 }
 
+// nothing is scheduled while the LCD clock is gated
+static void refresh_timer_schedule(IPodNano3GLCDState *s)
+{
+    if (!clock_is_enabled(s->clk)) {
+        timer_del(s->refresh_timer);
+        return;
+    }
+    timer_mod(s->refresh_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + clock_ticks_to_ns(s->clk, s->refresh_cycles));
+}
+
 static void refresh_timer_tick(void *opaque)
 {
     IPodNano3GLCDState *s = (IPodNano3GLCDState *)opaque;
 
     qemu_irq_raise(s->irq);
 
-    timer_mod(s->refresh_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + NANOSECONDS_PER_SECOND / LCD_REFRESH_RATE_FREQUENCY);
+    if (s->red_x_check && ipod_nano3g_milestone_pending(IPOD_NANO3G_MILESTONE_RED_X)) {
+        lcd_detect_red_x(s);
+    }
+    s->red_x_check = false;
+
+    refresh_timer_schedule(s);
+}
+
+static void S5L8702_lcd_clk_update(void *opaque, ClockEvent event)
+{
+    refresh_timer_schedule(opaque);
+}
+
+static void S5L8702_lcd_vm_state_change(void *opaque, bool running, RunState state)
+{
+    IPodNano3GLCDState *s = opaque;
+
+    // GRAM stores bypass dirty logging until flushed, so flush before RAM is saved
+    if (!running) {
+        lcd_flush_gram(s);
+    }
 }
 
 static void S5L8702_lcd_realize(DeviceState *dev, Error **errp)
 {
     IPodNano3GLCDState *s = IPOD_NANO3G_LCD(dev);
+
+    // the refresh rate follows the LCD clock from the rate it has when the machine is built
+    s->refresh_cycles = clock_get_hz(s->clk) / LCD_REFRESH_RATE_FREQUENCY;
+    if (!s->refresh_cycles) {
+        error_setg(errp, "the LCD clock is not running");
+        return;
+    }
+
     s->con = graphic_console_init(dev, 0, &S5L8702_gfx_ops, s);
-    qemu_console_resize(s->con, 240, 376);
+    qemu_console_resize(s->con, LCD_WIDTH, LCD_HEIGHT);
+    s->invalidate = 1;
+
+    // GRAM writes cover the whole panel until the firmware sets a window
+    s->col_end = LCD_WIDTH - 1;
+    s->row_end = LCD_HEIGHT - 1;
 
     // add mouse handler
     // qemu_add_mouse_event_handler(ipod_nano3g_lcd_mouse_event, s, 1, "iPod Touch Touchscreen");
 
     // initialize the refresh timer
     s->refresh_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, refresh_timer_tick, s);
-    timer_mod(s->refresh_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + NANOSECONDS_PER_SECOND / LCD_REFRESH_RATE_FREQUENCY);
+    refresh_timer_schedule(s);
 
     // initialize the dbuff buffer
-    s->dbuff_buf = g_malloc0(sizeof(Fifo8));
-    fifo8_create(s->dbuff_buf, 0x4);
+    fifo8_create(&s->dbuff_buf, 0x4);
 
-    // initialize the lcd's internal registers (they're all just uint64_t's)
-    s->lcd_regs = g_malloc0(sizeof(uint64_t) * 0xFF);
+    qemu_add_vm_change_state_handler(S5L8702_lcd_vm_state_change, s);
 
     // initialize the lcd's internal framebuffer
     s->framebuffer = g_malloc0(sizeof(uint16_t) * 240 * 376);
 }
 
+static int S5L8702_lcd_post_load(void *opaque, int version_id)
+{
+    IPodNano3GLCDState *s = opaque;
+
+    if (s->window_param_count > 4 || s->col_end >= LCD_WIDTH || s->row_end >= LCD_HEIGHT ||
+        s->col_start > s->col_end || s->row_start > s->row_end ||
+        s->cur_col < s->col_start || s->cur_col > s->col_end ||
+        s->cur_row < s->row_start || s->cur_row > s->row_end) {
+        return -EINVAL;
+    }
+
+    // redraw everything from the restored framebuffer RAM
+    s->gram_dirty_start = s->gram_dirty_end = 0;
+    s->invalidate = 1;
+    return 0;
+}
+
+static const VMStateDescription vmstate_S5L8702_lcd = {
+    .name = TYPE_IPOD_NANO3G_LCD,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = S5L8702_lcd_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(lcd_config, IPodNano3GLCDState),
+        VMSTATE_UINT32(lcd_wcmd, IPodNano3GLCDState),
+        VMSTATE_UINT32(lcd_rcmd, IPodNano3GLCDState),
+        VMSTATE_UINT32(lcd_rdata, IPodNano3GLCDState),
+        VMSTATE_UINT32(lcd_dbuff, IPodNano3GLCDState),
+        VMSTATE_UINT32(lcd_intcon, IPodNano3GLCDState),
+        VMSTATE_UINT32(lcd_status, IPodNano3GLCDState),
+        VMSTATE_UINT32(lcd_phtime, IPodNano3GLCDState),
+        VMSTATE_UINT32(lcd_wdata, IPodNano3GLCDState),
+        VMSTATE_FIFO8(dbuff_buf, IPodNano3GLCDState),
+        VMSTATE_UINT64_ARRAY(lcd_regs, IPodNano3GLCDState, 0x100),
+        VMSTATE_UINT8_ARRAY(window_params, IPodNano3GLCDState, 4),
+        VMSTATE_UINT8(window_param_count, IPodNano3GLCDState),
+        VMSTATE_UINT16(col_start, IPodNano3GLCDState),
+        VMSTATE_UINT16(col_end, IPodNano3GLCDState),
+        VMSTATE_UINT16(row_start, IPodNano3GLCDState),
+        VMSTATE_UINT16(row_end, IPodNano3GLCDState),
+        VMSTATE_UINT16(cur_col, IPodNano3GLCDState),
+        VMSTATE_UINT16(cur_row, IPodNano3GLCDState),
+        VMSTATE_UINT32(unknown1, IPodNano3GLCDState),
+        VMSTATE_UINT32(unknown2, IPodNano3GLCDState),
+        VMSTATE_UINT32(wnd_con, IPodNano3GLCDState),
+        VMSTATE_UINT32(vid_con0, IPodNano3GLCDState),
+        VMSTATE_UINT32(vid_con1, IPodNano3GLCDState),
+        VMSTATE_UINT32(vidt_con0, IPodNano3GLCDState),
+        VMSTATE_UINT32(vidt_con1, IPodNano3GLCDState),
+        VMSTATE_UINT32(vidt_con2, IPodNano3GLCDState),
+        VMSTATE_UINT32(vidt_con3, IPodNano3GLCDState),
+        VMSTATE_UINT32(w1_hspan, IPodNano3GLCDState),
+        VMSTATE_UINT32(w1_framebuffer_base, IPodNano3GLCDState),
+        VMSTATE_UINT32(w1_display_resolution_info, IPodNano3GLCDState),
+        VMSTATE_UINT32(w1_display_depth_info, IPodNano3GLCDState),
+        VMSTATE_UINT32(w1_qlen, IPodNano3GLCDState),
+        VMSTATE_UINT32(w2_hspan, IPodNano3GLCDState),
+        VMSTATE_UINT32(w2_framebuffer_base, IPodNano3GLCDState),
+        VMSTATE_UINT32(w2_display_resolution_info, IPodNano3GLCDState),
+        VMSTATE_UINT32(w2_display_depth_info, IPodNano3GLCDState),
+        VMSTATE_UINT32(w2_qlen, IPodNano3GLCDState),
+        VMSTATE_TIMER_PTR(refresh_timer, IPodNano3GLCDState),
+        VMSTATE_CLOCK(clk, IPodNano3GLCDState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void S5L8702_lcd_init(Object *obj)
 {
     SysBusDevice *sbd = SYS_BUS_DEVICE(obj);
@@ -280,6 +493,7 @@ static void S5L8702_lcd_init(Object *obj)
     memory_region_init_io(&s->iomem, obj, &lcd_ops, s, "lcd", 0x1000);
     sysbus_init_mmio(sbd, &s->iomem);
     sysbus_init_irq(sbd, &s->irq);
+    s->clk = qdev_init_clock_in(dev, "clk", S5L8702_lcd_clk_update, s, ClockUpdate);
 }
 
 static void S5L8702_lcd_class_init(ObjectClass *klass, void *data)
@@ -287,6 +501,7 @@ static void S5L8702_lcd_class_init(ObjectClass *klass, void *data)
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = S5L8702_lcd_realize;
+    dc->vmsd = &vmstate_S5L8702_lcd;
 }
 
 static const TypeInfo ipod_nano3g_lcd_info = {
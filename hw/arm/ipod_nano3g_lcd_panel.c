@@ -1,4 +1,5 @@
 #include "hw/arm/ipod_nano3g_lcd_panel.h"
+#include "migration/vmstate.h"
 
 static uint32_t ipod_nano3g_lcd_panel_transfer(SSIPeripheral *dev, uint32_t value)
 {
@@ -41,9 +42,22 @@ static void ipod_nano3g_lcd_panel_realize(SSIPeripheral *d, Error **errp)
 
 }
 
+static const VMStateDescription vmstate_ipod_nano3g_lcd_panel = {
+    .name = TYPE_IPOD_NANO3G_LCD_PANEL,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_SSI_PERIPHERAL(ssidev, IPodNano3GLCDPanelState),
+        VMSTATE_UINT32(cur_cmd, IPodNano3GLCDPanelState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void ipod_nano3g_lcd_panel_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SSIPeripheralClass *k = SSI_PERIPHERAL_CLASS(klass);
+    dc->vmsd = &vmstate_ipod_nano3g_lcd_panel;
     k->realize = ipod_nano3g_lcd_panel_realize;
     k->transfer = ipod_nano3g_lcd_panel_transfer;
 }
@@ -1,4 +1,5 @@
 #include "hw/arm/ipod_nano3g_lis302dl.h"
+#include "migration/vmstate.h"
 
 static int lis302dl_event(I2CSlave *i2c, enum i2c_event event)
 {
@@ -30,10 +31,23 @@ static void lis302dl_init(Object *obj)
 
 }
 
+static const VMStateDescription vmstate_lis302dl = {
+    .name = TYPE_LIS302DL,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_I2C_SLAVE(i2c, LIS302DLState),
+        VMSTATE_UINT32(cmd, LIS302DLState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void lis302dl_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     I2CSlaveClass *k = I2C_SLAVE_CLASS(klass);
 
+    dc->vmsd = &vmstate_lis302dl;
     k->event = lis302dl_event;
     k->recv = lis302dl_recv;
     k->send = lis302dl_send;
@@ -0,0 +1,91 @@
+#include "hw/arm/ipod_nano3g_milestones.h"
+#include "qapi/error.h"
+#include "qapi/qmp/json-writer.h"
+#include "qemu/notify.h"
+#include "qemu/timer.h"
+#include "exec/address-spaces.h"
+#include "exec/memory.h"
+#include "sysemu/cpu-timers.h"
+#include "sysemu/sysemu.h"
+#include "trace.h"
+
+uint32_t ipod_nano3g_milestones_pending;
+
+static const char *const milestone_names[IPOD_NANO3G_MILESTONE__MAX] = {
+    [IPOD_NANO3G_MILESTONE_NOR_FIRST_READ] = "nor-first-read",
+    [IPOD_NANO3G_MILESTONE_LCD_FIRST_CMD] = "lcd-first-cmd",
+    [IPOD_NANO3G_MILESTONE_NAND_FIRST_READ] = "nand-first-read",
+    [IPOD_NANO3G_MILESTONE_RED_X] = "red-x",
+};
+
+static FILE *milestone_log;
+static int64_t milestone_start_ns;
+static Notifier milestone_exit_notifier;
+
+static void milestone_write_region(MemoryRegion *mr, uint64_t reads, uint64_t writes, void *opaque)
+{
+    JSONWriter *writer = opaque;
+
+    json_writer_start_object(writer, NULL);
+    json_writer_str(writer, "region", memory_region_name(mr));
+    json_writer_uint64(writer, "addr", mr->addr);
+    json_writer_uint64(writer, "reads", reads);
+    json_writer_uint64(writer, "writes", writes);
+    json_writer_end_object(writer);
+}
+
+static void milestone_write(const char *name)
+{
+    g_autoptr(JSONWriter) writer = json_writer_new(false);
+    int64_t wall_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - milestone_start_ns;
+    int64_t insns = icount_enabled() ? icount_get_raw() : -1;
+
+    trace_ipod_nano3g_milestone(name, wall_ns, insns);
+
+    json_writer_start_object(writer, NULL);
+    json_writer_str(writer, "milestone", name);
+    json_writer_int64(writer, "wall-ns", wall_ns);
+    json_writer_int64(writer, "virtual-ns", qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    if (insns >= 0) {
+        json_writer_int64(writer, "insns", insns);
+    }
+    json_writer_start_array(writer, "mmio");
+    memory_region_count_foreach(&address_space_memory, milestone_write_region, writer);
+    json_writer_end_array(writer);
+    json_writer_end_object(writer);
+
+    fprintf(milestone_log, "%s\n", json_writer_get(writer));
+    fflush(milestone_log);
+}
+
+void ipod_nano3g_milestone_record(IPodNano3GMilestone m)
+{
+    ipod_nano3g_milestones_pending &= ~(1U << m);
+    milestone_write(milestone_names[m]);
+}
+
+// the totals for the whole run go out as a final "exit" record
+static void milestone_exit(Notifier *notifier, void *data)
+{
+    milestone_write("exit");
+    fclose(milestone_log);
+    milestone_log = NULL;
+    ipod_nano3g_milestones_pending = 0;
+}
+
+void ipod_nano3g_milestones_init(const char *log_path, Error **errp)
+{
+    milestone_log = fopen(log_path, "w");
+    if (!milestone_log) {
+        error_setg_errno(errp, errno, "Could not open milestone log '%s'", log_path);
+        return;
+    }
+
+    milestone_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    ipod_nano3g_milestones_pending = (1U << IPOD_NANO3G_MILESTONE__MAX) - 1;
+    // plain counts, the profiler's locking and clock reads would skew the timings
+    memory_region_set_counting(true);
+
+    milestone_exit_notifier.notify = milestone_exit;
+    qemu_add_exit_notifier(&milestone_exit_notifier);
+}
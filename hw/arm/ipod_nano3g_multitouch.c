@@ -1,4 +1,7 @@
 #include "hw/arm/ipod_nano3g_multitouch.h"
+#include "migration/vmstate.h"
+#include "migration/qemu-file-types.h"
+#include "trace.h"
 
 static void prepare_interface_version_response(IPodNano3GMultitouchState *s) {
     memset(s->out_buffer + 1, 0, 15);
@@ -116,6 +119,34 @@ static void prepare_short_control_response(IPodNano3GMultitouchState *s, uint8_t
     s->out_buffer[15] = (checksum >> 8) & 0xFF;
 }
 
+/*
+ * Returns a zeroed response buffer of at least size bytes. The buffer is kept
+ * across commands and only ever grows.
+ */
+static uint8_t *multitouch_response_buffer(IPodNano3GMultitouchState *s, uint32_t size)
+{
+    if (size > s->out_storage_size) {
+        s->out_storage = g_realloc(s->out_storage, size);
+        s->out_storage_size = size;
+    }
+    memset(s->out_storage, 0, size);
+    return s->out_storage;
+}
+
+// whether the current command still needs to see incoming bytes one by one
+static bool multitouch_in_header(IPodNano3GMultitouchState *s)
+{
+    switch(s->cur_cmd) {
+        case MT_CMD_HBPP_DATA_PACKET:
+            return s->in_buffer_ind < 10;
+        case MT_CMD_GET_REPORT_INFO:
+        case MT_CMD_SHORT_CONTROL_READ:
+            return s->in_buffer_ind < 2;
+        default:
+            return false;
+    }
+}
+
 static uint32_t ipod_nano3g_multitouch_transfer(SSIPeripheral *dev, uint32_t value)
 {
     IPodNano3GMultitouchState *s = IPOD_NANO3G_MULTITOUCH(dev);
@@ -126,10 +157,9 @@ static uint32_t ipod_nano3g_multitouch_transfer(SSIPeripheral *dev, uint32_t val
         //printf("Starting command 0x%02x\n", value);
         // we're currently not in a command - start a new command
         s->cur_cmd = value;
-        s->out_buffer = malloc(0x100);
+        s->out_buffer = multitouch_response_buffer(s, MT_RESPONSE_LEN);
         s->out_buffer[0] = value; // the response header
         s->buf_ind = 0;
-        s->in_buffer = malloc(0x100);
         s->in_buffer_ind = 0;
         
         if(value == 0x18) { // filler packet??
@@ -194,9 +224,8 @@ static uint32_t ipod_nano3g_multitouch_transfer(SSIPeripheral *dev, uint32_t val
             s->buf_size = 16;
         }
         else if(value == MT_CMD_FRAME_READ) {
-            printf("Will read frame!\n");
+            trace_ipod_nano3g_multitouch_frame_read();
             s->buf_size = sizeof(MTFrame);
-            free(s->out_buffer);
             s->out_buffer = (uint8_t *) s->next_frame;
         }
         else {
@@ -204,7 +233,9 @@ static uint32_t ipod_nano3g_multitouch_transfer(SSIPeripheral *dev, uint32_t val
         }
     }
 
-    s->in_buffer[s->in_buffer_ind] = value;
+    if(s->in_buffer_ind < MT_CMD_HEADER_LEN) {
+        s->in_buffer[s->in_buffer_ind] = value;
+    }
     s->in_buffer_ind++;
 
     if(s->cur_cmd == MT_CMD_HBPP_DATA_PACKET && s->in_buffer_ind == 10) {
@@ -219,13 +250,8 @@ static uint32_t ipod_nano3g_multitouch_transfer(SSIPeripheral *dev, uint32_t val
         }
 
         uint32_t data_len = (s->in_buffer[2] << 10) | (s->in_buffer[3] << 2) + 5;
-        // extend the lengths of the in/out buffers
-        free(s->in_buffer);
-        s->in_buffer = malloc(data_len + 0x10);
-
-        free(s->out_buffer);
-        s->out_buffer = malloc(data_len);
-        memset(s->out_buffer, 0, data_len);
+        // extend the length of the response
+        s->out_buffer = multitouch_response_buffer(s, data_len);
         s->buf_size = data_len;
         s->buf_ind = 0;
     }
@@ -258,13 +284,38 @@ static uint32_t ipod_nano3g_multitouch_transfer(SSIPeripheral *dev, uint32_t val
         // we're done with the command
         s->cur_cmd = 0;
         s->buf_size = 0;
-        //free(s->out_buffer);
-        //free(s->in_buffer);
     }
 
     return ret_val;
 }
 
+static uint32_t ipod_nano3g_multitouch_transfer_bulk(SSIPeripheral *dev, const uint8_t *tx,
+                                                     uint8_t *rx, uint32_t len)
+{
+    IPodNano3GMultitouchState *s = IPOD_NANO3G_MULTITOUCH(dev);
+    uint32_t n;
+
+    // starting a command, parsing its header and finishing it stay on the byte path
+    if(s->cur_cmd == 0 || multitouch_in_header(s) || s->buf_ind + 1 >= s->buf_size) {
+        return 0;
+    }
+
+    n = MIN(len, s->buf_size - s->buf_ind - 1);
+    if(s->in_buffer_ind < MT_CMD_HEADER_LEN) {
+        uint32_t keep = MIN(n, MT_CMD_HEADER_LEN - s->in_buffer_ind);
+        if(tx) {
+            memcpy(s->in_buffer + s->in_buffer_ind, tx, keep);
+        } else {
+            memset(s->in_buffer + s->in_buffer_ind, 0xFF, keep);
+        }
+    }
+    s->in_buffer_ind += n;
+
+    memcpy(rx, s->out_buffer + s->buf_ind, n);
+    s->buf_ind += n;
+    return n;
+}
+
 static MTFrame *get_frame(IPodNano3GMultitouchState *s, uint8_t event, float x, float y, uint16_t radius1, uint16_t radius2, uint16_t radius3, uint16_t contactDensity) {
     MTFrame *frame = calloc(sizeof(MTFrame), sizeof(uint8_t *));
 
@@ -393,11 +444,119 @@ static void ipod_nano3g_multitouch_realize(SSIPeripheral *d, Error **errp)
     s->last_frame_timestamp = 0;
 }
 
+// the touch coordinates are floats, which vmstate has no type for
+static int get_touch_coord(QEMUFile *f, void *pv, size_t size, const VMStateField *field)
+{
+    uint32_t bits = qemu_get_be32(f);
+
+    memcpy(pv, &bits, sizeof(bits));
+    return 0;
+}
+
+static int put_touch_coord(QEMUFile *f, void *pv, size_t size, const VMStateField *field,
+                           JSONWriter *vmdesc)
+{
+    uint32_t bits;
+
+    memcpy(&bits, pv, sizeof(bits));
+    qemu_put_be32(f, bits);
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_touch_coord = {
+    .name = "float",
+    .get = get_touch_coord,
+    .put = put_touch_coord,
+};
+
+#define VMSTATE_TOUCH_COORD(_f, _s) \
+    VMSTATE_SINGLE(_f, _s, 0, vmstate_info_touch_coord, float)
+
+static int ipod_nano3g_multitouch_pre_save(void *opaque)
+{
+    IPodNano3GMultitouchState *s = opaque;
+
+    // the frame is always sent, an empty one if no touch happened yet
+    if (!s->next_frame) {
+        s->next_frame = g_new0(MTFrame, 1);
+    }
+    return 0;
+}
+
+static int ipod_nano3g_multitouch_pre_load(void *opaque)
+{
+    IPodNano3GMultitouchState *s = opaque;
+
+    if (!s->next_frame) {
+        s->next_frame = g_new0(MTFrame, 1);
+    }
+    // reallocated to the incoming size
+    g_free(s->out_storage);
+    s->out_storage = NULL;
+    s->out_buffer = NULL;
+    return 0;
+}
+
+static int ipod_nano3g_multitouch_post_load(void *opaque, int version_id)
+{
+    IPodNano3GMultitouchState *s = opaque;
+
+    if (s->cur_cmd == MT_CMD_FRAME_READ) {
+        s->out_buffer = (uint8_t *) s->next_frame;
+        if (s->buf_size > sizeof(MTFrame)) {
+            return -EINVAL;
+        }
+    } else {
+        s->out_buffer = s->out_storage;
+        if (s->cur_cmd != 0 && s->buf_size > s->out_storage_size) {
+            return -EINVAL;
+        }
+    }
+    if (s->cur_cmd != 0 && s->buf_ind >= s->buf_size) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_ipod_nano3g_multitouch = {
+    .name = TYPE_IPOD_NANO3G_MULTITOUCH,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = ipod_nano3g_multitouch_pre_save,
+    .pre_load = ipod_nano3g_multitouch_pre_load,
+    .post_load = ipod_nano3g_multitouch_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_SSI_PERIPHERAL(ssidev, IPodNano3GMultitouchState),
+        VMSTATE_UINT8(cur_cmd, IPodNano3GMultitouchState),
+        VMSTATE_UINT32(out_storage_size, IPodNano3GMultitouchState),
+        VMSTATE_VBUFFER_ALLOC_UINT32(out_storage, IPodNano3GMultitouchState, 0, NULL, out_storage_size),
+        VMSTATE_UINT8_ARRAY(in_buffer, IPodNano3GMultitouchState, MT_CMD_HEADER_LEN),
+        VMSTATE_UINT32(buf_size, IPodNano3GMultitouchState),
+        VMSTATE_UINT32(buf_ind, IPodNano3GMultitouchState),
+        VMSTATE_UINT32(in_buffer_ind, IPodNano3GMultitouchState),
+        VMSTATE_UINT8_ARRAY(hbpp_atn_ack_response, IPodNano3GMultitouchState, 2),
+        VMSTATE_BUFFER_POINTER_UNSAFE(next_frame, IPodNano3GMultitouchState, 0, sizeof(MTFrame)),
+        VMSTATE_UINT32(frame_counter, IPodNano3GMultitouchState),
+        VMSTATE_BOOL(touch_down, IPodNano3GMultitouchState),
+        VMSTATE_TIMER_PTR(touch_timer, IPodNano3GMultitouchState),
+        VMSTATE_TIMER_PTR(touch_end_timer, IPodNano3GMultitouchState),
+        VMSTATE_TOUCH_COORD(touch_x, IPodNano3GMultitouchState),
+        VMSTATE_TOUCH_COORD(touch_y, IPodNano3GMultitouchState),
+        VMSTATE_TOUCH_COORD(prev_touch_x, IPodNano3GMultitouchState),
+        VMSTATE_TOUCH_COORD(prev_touch_y, IPodNano3GMultitouchState),
+        VMSTATE_UINT64(last_frame_timestamp, IPodNano3GMultitouchState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void ipod_nano3g_multitouch_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SSIPeripheralClass *k = SSI_PERIPHERAL_CLASS(klass);
+    dc->vmsd = &vmstate_ipod_nano3g_multitouch;
     k->realize = ipod_nano3g_multitouch_realize;
     k->transfer = ipod_nano3g_multitouch_transfer;
+    k->transfer_bulk = ipod_nano3g_multitouch_transfer_bulk;
 }
 
 static const TypeInfo ipod_nano3g_multitouch_type_info = {
@@ -1,6 +1,20 @@
 #include "hw/arm/ipod_nano3g_nand.h"
+#include "hw/arm/ipod_nano3g_milestones.h"
 #include "hw/qdev-properties.h"
 #include "qapi/error.h"
+#include "block/block.h"
+#include "block/aio.h"
+#include "qemu/main-loop.h"
+#include "sysemu/block-backend.h"
+#include "sysemu/runstate.h"
+#include "sysemu/idle-poll.h"
+#include "block/aio-wait.h"
+#include "migration/vmstate.h"
+#include "qemu/error-report.h"
+#include "qemu/bitmap.h"
+#include "qemu/log.h"
+#include "trace.h"
+#include <sys/mman.h>
 
 static uint64_t itnand_read(void *opaque, hwaddr addr, unsigned size);
 static void itnand_write(void *opaque, hwaddr addr, uint64_t val, unsigned size);
@@ -13,130 +27,200 @@ static void fmiss_vm_reset(fmiss_vm *vm, uint32_t pc) {
     vm->pc = pc;
 }
 
-static uint64_t fmiss_vm_fetch(fmiss_vm *vm) {
-    uint64_t val = 0;
-    address_space_read(vm->iomem, vm->pc, MEMTXATTRS_UNSPECIFIED, &val, 8);
-    return val;
+static void fmiss_vm_flush_cache(fmiss_vm *vm) {
+    vm->num_ops = 0;
+    vm->used_ops = 0;
 }
 
+/*
+ * The firmware reuses a handful of FMISS programs, so they are decoded once
+ * and kept until FMI_PROGRAM points somewhere else or the program's code in
+ * guest memory changes. Checking the latter costs one bulk read of the part
+ * of the program that actually ran, instead of a memory dispatch per step.
+ */
+static void fmiss_vm_validate_cache(fmiss_vm *vm) {
+    uint64_t cur[FMISS_MAX_OPS];
+
+    if (vm->num_ops == 0) {
+        return;
+    }
+
+    if (vm->cached_pc != vm->start_pc) {
+        trace_fmiss_cache_invalidate(vm->cached_pc, vm->start_pc);
+        fmiss_vm_flush_cache(vm);
+        return;
+    }
+
+    address_space_read(vm->iomem, vm->start_pc, MEMTXATTRS_UNSPECIFIED, cur, vm->used_ops * 8);
+    if (memcmp(cur, vm->raw, vm->used_ops * 8) != 0) {
+        trace_fmiss_cache_invalidate(vm->cached_pc, vm->start_pc);
+        fmiss_vm_flush_cache(vm);
+        return;
+    }
+
+    // ops a forward jump skipped were not checked, decode them again when needed
+    vm->num_ops = vm->used_ops;
+}
+
+/*
+ * Decodes the program up to and including instruction idx. Nothing past the
+ * instructions the program reaches is fetched, the end of a program is only
+ * known once it terminates.
+ */
 // Reference: https://github.com/lemonjesus/S5L8702-FMISS-Tools/blob/main/Documentation.md
-static bool fmiss_vm_step(void *opaque, fmiss_vm *vm) {
-    uint64_t ins = fmiss_vm_fetch(vm);
+static bool fmiss_vm_decode(fmiss_vm *vm, uint32_t idx) {
+    uint32_t first = vm->num_ops;
+    uint32_t end = idx + 1;
 
-    uint32_t imm = ins >> 32;
-    uint8_t opcode = ins >> 24;
-    uint8_t dst = ins >> 16;
-    uint16_t src = ins;
+    if (idx >= FMISS_MAX_OPS) {
+        return false;
+    }
 
-    uint32_t addr, data;
+    if (first == 0) {
+        vm->cached_pc = vm->start_pc;
+    }
 
+    address_space_read(vm->iomem, vm->start_pc + first * 8, MEMTXATTRS_UNSPECIFIED,
+                       &vm->raw[first], (end - first) * 8);
 
-    printf("fmiss_vm: at %08x: %016lx (%02x %02x %04x %08x)",
-        vm->pc - vm->start_pc, ins, opcode, dst, src, imm);
-    for (int i = 0; i < 8; i++) {
-        printf(" %d:%08lx", i, vm->regs[i]);
+    for (uint32_t i = first; i < end; i++) {
+        uint64_t ins = le64_to_cpu(vm->raw[i]);
+        fmiss_op *op = &vm->ops[i];
+
+        op->imm = ins >> 32;
+        op->opcode = ins >> 24;
+        op->dst = ((ins >> 16) & 0xFF) % 8;
+        op->src = ins;
+        op->sreg = op->src % 8;
     }
-    printf("\n");
-    switch (opcode) {
-    case 0: // Terminate.
-        return false;
-    case 1: // Write immediate to memory.
-        itnand_write(opaque, src, imm, 4);
-        break;
-    case 2: // Write register to memory.
-        itnand_write(opaque, src, vm->regs[dst%8], 4);
-        break;
-    case 3: // Read memory to register.
-        addr = vm->regs[src%8];
-        data = 0;
-        address_space_read(vm->iomem, addr, MEMTXATTRS_UNSPECIFIED, &data, 4);
-        printf("fmiss_vm: mem %08x -> %08x\n", addr, data);
-        vm->regs[dst%8] = data;
-        break;
-    case 4: // Read from memory into a register.
-        uint32_t val = itnand_read(opaque, src, 4);
-        vm->regs[dst%8] = val;
-        break;
-    case 5: // Read immediate into register.
-        vm->regs[dst%8] = imm;
-        break;
-    case 6: // Transfer register to register.
-        vm->regs[dst%8] = vm->regs[src%8];
-    case 7: // Unknown, possibly wait for FMCSTAT. No-op.
-        break;
-    case 10: // AND two registers and an immediate.
-        if (imm == 0) {
-            vm->regs[dst%8] &= vm->regs[src%8];
-        } else {
-            vm->regs[dst%8] = vm->regs[src%8] & imm;
-        }
-        break;
-    case 11: // OR two registers and an immediate.
-        if (imm == 0) {
-            vm->regs[dst%8] |= vm->regs[src%8];
-        } else {
-            vm->regs[dst%8] = vm->regs[src%8] | imm;
-        }
-        break;
-    case 12: // Add an Immediate to a Register
-        if (imm == 0) {
-            vm->regs[dst%8] += vm->regs[src%8];
-        } else {
-            vm->regs[dst%8] = vm->regs[src%8] + imm;
-        }
-        break;
-    case 13: // Subtract an Immediate from a Register
-        if (imm == 0) {
-            vm->regs[dst%8] -= vm->regs[src%8];
-        } else {
-            vm->regs[dst%8] = vm->regs[src%8] - imm;
-        }
-        break;
-    case 14: // Jump If Not Equal.
-        if (vm->regs[dst%8] != src) {
-            vm->pc = vm->start_pc + imm;
-            return true;
-        }
-        break;
-    case 17: // Store a Register Value to a Memory Location Pointed to by a Register.
-        addr = vm->regs[src%8];
-        data = vm->regs[dst%8];
-        printf("fmiss_vm: mem %08x <- %08x\n", addr, data);
-        address_space_write(vm->iomem, addr, MEMTXATTRS_UNSPECIFIED, &data, 4);
-        break;
-    case 19: // Left Shift a Register by an Immediate
-        if (imm == 0) {
-            vm->regs[dst%8] <<= vm->regs[src%8];
-        } else {
-            vm->regs[dst%8] = vm->regs[src%8] << imm;
-        }
-        break;
-    case 20: // Right Shift a Register by an Immediate
-        if (imm == 0) {
-            vm->regs[dst%8] >>= vm->regs[src%8];
-        } else {
-            vm->regs[dst%8] = vm->regs[src%8] >> imm;
-        }
-        break;
-    case 23: // Jump if equal, but apparently not?
-        if (vm->regs[dst%8] == src) {
-            vm->pc = vm->start_pc + imm;
-            return true;
-        }
-        break;
-    default:
-        printf("fmiss_vm: unimplemented opcode %d!\n", opcode);
+
+    trace_fmiss_decode(vm->start_pc, first, end);
+    vm->num_ops = end;
+    return true;
+}
+
+// jump targets are byte offsets from the start of the program
+static bool fmiss_vm_jump_valid(fmiss_vm *vm, const fmiss_op *op) {
+    if (op->imm % 8) {
+        qemu_log_mask(LOG_GUEST_ERROR, "fmiss_vm: program at 0x%08x jumps to unaligned offset 0x%x\n",
+                      vm->start_pc, op->imm);
         return false;
     }
-    vm->pc += 8;
     return true;
 }
 
-static void fmiss_vm_execute(void *opaque, fmiss_vm *vm) {
-    printf("fmiss_vm: starting execution at %08lx...\n", vm->start_pc);
-    while (fmiss_vm_step(opaque, vm)) {
+/*
+ * Runs the program from vm->pc for at most budget instructions. Returns true
+ * once it terminated, false if it has to be resumed later.
+ */
+static bool fmiss_vm_execute(void *opaque, fmiss_vm *vm, uint32_t budget) {
+    uint32_t *regs = vm->regs;
+    uint32_t idx = (vm->pc - vm->start_pc) / 8;
+    uint32_t steps = 0;
+    uint32_t addr, data;
+
+    fmiss_vm_validate_cache(vm);
+    if (idx == 0) {
+        trace_fmiss_start(vm->start_pc, vm->num_ops);
+    }
+
+    for (;;) {
+        if (steps == budget) {
+            vm->pc = vm->start_pc + idx * 8;
+            return false;
+        }
+
+        if (idx >= vm->num_ops && !fmiss_vm_decode(vm, idx)) {
+            qemu_log_mask(LOG_GUEST_ERROR, "fmiss_vm: program at 0x%08x ran past %d instructions\n",
+                          vm->start_pc, FMISS_MAX_OPS);
+            break;
+        }
+
+        const fmiss_op *op = &vm->ops[idx];
+        vm->used_ops = MAX(vm->used_ops, idx + 1);
+        steps++;
+        trace_fmiss_step(idx * 8, op->opcode, op->dst, op->src, op->imm);
+
+        switch (op->opcode) {
+        case 0: // Terminate.
+            goto done;
+        case 1: // Write immediate to memory.
+            itnand_write(opaque, op->src, op->imm, 4);
+            break;
+        case 2: // Write register to memory.
+            itnand_write(opaque, op->src, regs[op->dst], 4);
+            break;
+        case 3: // Read memory to register.
+            addr = regs[op->sreg];
+            data = 0;
+            address_space_read(vm->iomem, addr, MEMTXATTRS_UNSPECIFIED, &data, 4);
+            trace_fmiss_mem_read(addr, data);
+            regs[op->dst] = data;
+            break;
+        case 4: // Read from memory into a register.
+            regs[op->dst] = itnand_read(opaque, op->src, 4);
+            break;
+        case 5: // Read immediate into register.
+            regs[op->dst] = op->imm;
+            break;
+        case 6: // Transfer register to register.
+            regs[op->dst] = regs[op->sreg];
+            break;
+        case 7: // Unknown, possibly wait for FMCSTAT. No-op.
+            break;
+        case 10: // AND two registers and an immediate.
+            regs[op->dst] = op->imm ? regs[op->sreg] & op->imm : regs[op->dst] & regs[op->sreg];
+            break;
+        case 11: // OR two registers and an immediate.
+            regs[op->dst] = op->imm ? regs[op->sreg] | op->imm : regs[op->dst] | regs[op->sreg];
+            break;
+        case 12: // Add an Immediate to a Register
+            regs[op->dst] = op->imm ? regs[op->sreg] + op->imm : regs[op->dst] + regs[op->sreg];
+            break;
+        case 13: // Subtract an Immediate from a Register
+            regs[op->dst] = op->imm ? regs[op->sreg] - op->imm : regs[op->dst] - regs[op->sreg];
+            break;
+        case 14: // Jump If Not Equal.
+            if (regs[op->dst] != op->src) {
+                if (!fmiss_vm_jump_valid(vm, op)) {
+                    goto done;
+                }
+                idx = op->imm / 8;
+                continue;
+            }
+            break;
+        case 17: // Store a Register Value to a Memory Location Pointed to by a Register.
+            addr = regs[op->sreg];
+            data = regs[op->dst];
+            trace_fmiss_mem_write(addr, data);
+            address_space_write(vm->iomem, addr, MEMTXATTRS_UNSPECIFIED, &data, 4);
+            break;
+        case 19: // Left Shift a Register by an Immediate
+            regs[op->dst] = op->imm ? regs[op->sreg] << op->imm : regs[op->dst] << regs[op->sreg];
+            break;
+        case 20: // Right Shift a Register by an Immediate
+            regs[op->dst] = op->imm ? regs[op->sreg] >> op->imm : regs[op->dst] >> regs[op->sreg];
+            break;
+        case 23: // Jump if equal, but apparently not?
+            if (regs[op->dst] == op->src) {
+                if (!fmiss_vm_jump_valid(vm, op)) {
+                    goto done;
+                }
+                idx = op->imm / 8;
+                continue;
+            }
+            break;
+        default:
+            qemu_log_mask(LOG_UNIMP, "fmiss_vm: unimplemented opcode %d!\n", op->opcode);
+            goto done;
+        }
+        idx++;
     }
-    printf("fmiss_vm: done executing\n");
+
+done:
+    vm->pc = vm->start_pc + idx * 8;
+    trace_fmiss_done(vm->start_pc, steps);
+    return true;
 }
 
 static int get_bank(ITNandState *s) {
@@ -159,38 +243,453 @@ static void set_bank(ITNandState *s, uint32_t activate_bank) {
     }
 }
 
+static bool itnand_page_valid(ITNandState *s, uint32_t bank, uint32_t page)
+{
+    return bank < NAND_NUM_BANKS && page < s->pages_per_bank;
+}
+
+// position of a page's record in the base and overlay images
+static uint64_t itnand_record_index(ITNandState *s, uint32_t bank, uint32_t page)
+{
+    return (uint64_t)bank * s->pages_per_bank + page;
+}
+
+/*
+ * Returns the record (page data followed by its spare area) for the given
+ * bank and page in the base image, or NULL if the image does not cover it.
+ */
+static const uint8_t *itnand_image_record(ITNandState *s, uint32_t bank, uint32_t page)
+{
+    if (!s->image || !itnand_page_valid(s, bank, page)) {
+        return NULL;
+    }
+
+    return s->image + itnand_record_index(s, bank, page) * NAND_BYTES_PER_RECORD;
+}
+
+static void itnand_blank_record(uint8_t *record)
+{
+    memset(record, 0, NAND_BYTES_PER_RECORD);
+    record[NAND_BYTES_PER_PAGE + 0xA] = 0xFF; // make sure we add the FTL mark to an empty page
+}
+
+// only for pages inside the geometry, realize keeps the key within 32 bits for those
+static inline gpointer itnand_overlay_key(uint32_t bank, uint32_t page)
+{
+    return GUINT_TO_POINTER(page * NAND_NUM_BANKS + bank);
+}
+
+/*
+ * Returns the overlay copy of a page, creating it from the base image on the
+ * first write. Everything the guest programs lands in the overlay, the base
+ * image is never modified.
+ */
+static ITNandOverlayPage *itnand_overlay_page(ITNandState *s, uint32_t bank, uint32_t page)
+{
+    gpointer key = itnand_overlay_key(bank, page);
+    ITNandOverlayPage *op;
+
+    assert(itnand_page_valid(s, bank, page));
+    op = g_hash_table_lookup(s->overlay, key);
+    if (op == NULL) {
+        const uint8_t *record = itnand_image_record(s, bank, page);
+
+        op = g_new(ITNandOverlayPage, 1);
+        op->bank = bank;
+        op->page = page;
+        if (record) {
+            memcpy(op->record, record, NAND_BYTES_PER_RECORD);
+        } else {
+            itnand_blank_record(op->record);
+        }
+        op->unflushed = false;
+        g_hash_table_insert(s->overlay, key, op);
+    }
+
+    return op;
+}
+
+/*
+ * Looks up the current contents of a page: the overlay takes precedence over
+ * the mapping. Pages nobody has ever stored come back empty.
+ */
+static const uint8_t *itnand_lookup_record(ITNandState *s, uint32_t bank, uint32_t page, bool *in_overlay)
+{
+    ITNandOverlayPage *op;
+    const uint8_t *record;
+
+    if (!itnand_page_valid(s, bank, page)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "itnand: bank %u page %u is outside the NAND\n", bank, page);
+        *in_overlay = false;
+        itnand_blank_record(s->blank_record);
+        return s->blank_record;
+    }
+
+    op = g_hash_table_lookup(s->overlay, itnand_overlay_key(bank, page));
+    *in_overlay = op != NULL;
+    if (op) {
+        return op->record;
+    }
+
+    // reads come straight from the mapping, the page cache makes them cheap
+    record = itnand_image_record(s, bank, page);
+    if (record == NULL) {
+        // no image - hand out an empty page
+        itnand_blank_record(s->blank_record);
+        record = s->blank_record;
+    }
+    return record;
+}
+
 void nand_set_buffered_page(ITNandState *s, uint32_t page) {
     uint32_t bank = get_bank(s);
     if(bank == -1) {
         hw_error("Active bank not set while nand_read with page %d is called (reading multiple pages: %d)!", page, s->reading_multiple_pages);
     }
 
+    ipod_nano3g_milestone(IPOD_NANO3G_MILESTONE_NAND_FIRST_READ);
     if(bank != s->buffered_bank || page != s->buffered_page) {
         // refresh the buffered page
-        //uint32_t vpn = page * 8 + bank;
-        char filename[200];
-        sprintf(filename, "%s/bank%d/%d.page", s->nand_path, bank, page);
-        struct stat st = {0};
-        if (stat(filename, &st) == -1) {
-            // page storage does not exist - initialize an empty buffer
-            memset(s->page_buffer, 0, NAND_BYTES_PER_PAGE);
-            memset(s->page_spare_buffer, 0, NAND_BYTES_PER_SPARE);
-            s->page_spare_buffer[0xA] = 0xFF; // make sure we add the FTL mark to an empty page
-        }
-        else {
-            FILE *f = fopen(filename, "rb");
-            if (f == NULL) { hw_error("Unable to read file!"); }
-            fread(s->page_buffer, sizeof(char), NAND_BYTES_PER_PAGE, f);
-            fread(s->page_spare_buffer, sizeof(char), NAND_BYTES_PER_SPARE, f);
-            fclose(f);
-        }
+        const uint8_t *record = itnand_lookup_record(s, bank, page, &s->buffered_in_overlay);
 
+        s->page_buffer = (uint8_t *)record;
+        s->page_spare_buffer = (uint8_t *)record + NAND_BYTES_PER_PAGE;
         s->buffered_page = page;
         s->buffered_bank = bank;
         // printf("Buffered bank: %d, page: %d\n", s->buffered_bank, s->buffered_page);
     }
 }
 
+/*
+ * Starts a multi-page read of the pages listed in pages_to_read/banks_to_read.
+ * All page data is gathered up front into the pooled prefetch buffer, from
+ * which the FIFO then streams without going back to the backing store.
+ */
+void itnand_prefetch_pages(ITNandState *s, uint32_t count)
+{
+    bool in_overlay;
+
+    ipod_nano3g_milestone(IPOD_NANO3G_MILESTONE_NAND_FIRST_READ);
+    count = MIN(count, NAND_MAX_BULK_PAGES);
+    if (!s->prefetch_buf) {
+        s->prefetch_buf = g_malloc(NAND_MAX_BULK_PAGES * NAND_BYTES_PER_PAGE);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *record = itnand_lookup_record(s, s->banks_to_read[i], s->pages_to_read[i], &in_overlay);
+        memcpy(s->prefetch_buf + i * NAND_BYTES_PER_PAGE, record, NAND_BYTES_PER_PAGE);
+    }
+
+    s->prefetch_pages = count;
+    s->reading_multiple_pages = true;
+    s->fmdnum = count * NAND_BYTES_PER_PAGE;
+    s->cur_bank_reading = -1;
+}
+
+/*
+ * Points the page buffers at a writable overlay copy of the buffered page.
+ * Returns false for a page outside the NAND, which cannot be programmed.
+ */
+static bool itnand_make_buffered_page_writable(ITNandState *s)
+{
+    ITNandOverlayPage *op;
+
+    if (!itnand_page_valid(s, s->buffered_bank, s->buffered_page)) {
+        return false;
+    }
+
+    op = itnand_overlay_page(s, s->buffered_bank, s->buffered_page);
+    s->page_buffer = op->record;
+    s->page_spare_buffer = op->record + NAND_BYTES_PER_PAGE;
+    s->buffered_in_overlay = true;
+    return true;
+}
+
+// the written bitmap byte that holds the given record, as it is stored in the overlay image
+static uint8_t itnand_written_byte(ITNandState *s, uint64_t index)
+{
+    uint64_t first = QEMU_ALIGN_DOWN(index, 8);
+    uint8_t byte = 0;
+
+    for (int i = 0; i < 8 && first + i < s->num_records; i++) {
+        if (test_bit(first + i, s->written)) {
+            byte |= 1 << i;
+        }
+    }
+    return byte;
+}
+
+static int itnand_write_bitmap(ITNandState *s)
+{
+    g_autofree unsigned long *le = bitmap_new(s->num_records);
+    int ret;
+
+    bitmap_to_le(le, s->written, s->num_records);
+    ret = blk_pwrite(s->overlay_blk, s->image_size, le, DIV_ROUND_UP(s->num_records, 8), 0);
+    if (ret < 0) {
+        error_report("itnand: failed to write the overlay page bitmap: %s", strerror(-ret));
+        return ret;
+    }
+    s->written_dirty = false;
+    return 0;
+}
+
+/*
+ * Writes every page programmed since the last flush to the overlay image, at
+ * the same offset it has in the base image. The overlay image is either a raw
+ * copy of the base image or a qcow2 image on top of it, followed by a bitmap
+ * with a bit per record that is set once the record holds a programmed page.
+ */
+static void itnand_flush_overlay(ITNandState *s)
+{
+    GHashTableIter iter;
+    ITNandOverlayPage *op;
+    int ret;
+
+    if (!s->overlay_blk) {
+        return;
+    }
+
+    g_hash_table_iter_init(&iter, s->overlay);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&op)) {
+        uint64_t index = itnand_record_index(s, op->bank, op->page);
+
+        if (!op->unflushed) {
+            continue;
+        }
+
+        ret = blk_pwrite(s->overlay_blk, index * NAND_BYTES_PER_RECORD,
+                         op->record, NAND_BYTES_PER_RECORD, 0);
+        if (ret < 0) {
+            error_report("itnand: failed to flush bank %d page %d to the overlay: %s",
+                         op->bank, op->page, strerror(-ret));
+            continue;
+        }
+        op->unflushed = false;
+        if (!test_and_set_bit(index, s->written)) {
+            s->written_dirty = true;
+        }
+    }
+
+    if (s->written_dirty) {
+        itnand_write_bitmap(s);
+    }
+    blk_flush(s->overlay_blk);
+}
+
+/*
+ * Brings the pages an earlier run programmed back into the overlay, as listed
+ * by the bitmap after the records. An overlay image without room for the
+ * bitmap is grown, the new space reads back as an empty bitmap.
+ */
+static bool itnand_load_overlay(ITNandState *s, Error **errp)
+{
+    int64_t bitmap_bytes = DIV_ROUND_UP(s->num_records, 8);
+    g_autofree unsigned long *le = bitmap_new(s->num_records);
+    int64_t len;
+    uint64_t index;
+    int ret;
+
+    len = blk_getlength(s->overlay_blk);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the size of NAND overlay '%s'", s->overlay_path);
+        return false;
+    }
+    if (len < s->image_size + bitmap_bytes &&
+        blk_truncate(s->overlay_blk, s->image_size + bitmap_bytes, false, PREALLOC_MODE_OFF, 0, errp) < 0) {
+        return false;
+    }
+
+    ret = blk_pread(s->overlay_blk, s->image_size, le, bitmap_bytes);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read NAND overlay '%s'", s->overlay_path);
+        return false;
+    }
+    s->written = bitmap_new(s->num_records);
+    bitmap_from_le(s->written, le, s->num_records);
+
+    for (index = find_first_bit(s->written, s->num_records); index < s->num_records;
+         index = find_next_bit(s->written, s->num_records, index + 1)) {
+        ITNandOverlayPage *op = itnand_overlay_page(s, index / s->pages_per_bank, index % s->pages_per_bank);
+
+        ret = blk_pread(s->overlay_blk, index * NAND_BYTES_PER_RECORD, op->record, NAND_BYTES_PER_RECORD);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read NAND overlay '%s'", s->overlay_path);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void itnand_io_done(ITNandState *s)
+{
+    assert(s->io_pending > 0);
+    if (--s->io_pending > 0) {
+        return;
+    }
+
+    // the FMISS program that issued the I/O is only done once the I/O is
+    if (s->fmi_int_deferred) {
+        s->fmi_int_deferred = false;
+        s->fmi_int |= 1;
+    }
+    notifier_list_notify(&s->idle_notifiers, s);
+}
+
+static ITNandPageIO *itnand_page_io_new(ITNandState *s, uint32_t bank, uint32_t page)
+{
+    ITNandPageIO *req = g_new0(ITNandPageIO, 1);
+
+    req->s = s;
+    req->bank = bank;
+    req->page = page;
+    req->record = g_malloc(NAND_BYTES_PER_RECORD);
+    s->inflight[bank] = req;
+    s->io_pending++;
+    return req;
+}
+
+static void itnand_page_io_free(ITNandPageIO *req)
+{
+    ITNandState *s = req->s;
+
+    if (s->inflight[req->bank] == req) {
+        s->inflight[req->bank] = NULL;
+        // the bank just became ready in FMCSTAT
+        tcg_idle_poll_wake();
+    }
+    g_free(req->record);
+    g_free(req);
+    itnand_io_done(s);
+}
+
+static void itnand_program_done(void *opaque, int ret)
+{
+    ITNandPageIO *req = opaque;
+    ITNandState *s = req->s;
+
+    if (ret < 0 && req->mark_written) {
+        error_report("itnand: failed to mark bank %d page %d as written in the overlay: %s",
+                     req->bank, req->page, strerror(-ret));
+        // written out in full on the next flush
+        s->written_dirty = true;
+    } else if (ret < 0) {
+        ITNandOverlayPage *op = g_hash_table_lookup(s->overlay, itnand_overlay_key(req->bank, req->page));
+
+        error_report("itnand: failed to write bank %d page %d to the overlay: %s",
+                     req->bank, req->page, strerror(-ret));
+        if (op) {
+            // try again on the next flush
+            op->unflushed = true;
+        }
+    } else if (!req->mark_written) {
+        uint64_t index = itnand_record_index(s, req->bank, req->page);
+
+        if (!test_and_set_bit(index, s->written)) {
+            // the record is in place, now the bitmap may point at it
+            req->mark_written = true;
+            req->record[0] = itnand_written_byte(s, index);
+            qemu_iovec_destroy(&req->qiov);
+            qemu_iovec_init_buf(&req->qiov, req->record, 1);
+            blk_aio_pwritev(s->overlay_blk, s->image_size + index / 8, &req->qiov, 0,
+                            itnand_program_done, req);
+            return;
+        }
+    }
+
+    qemu_iovec_destroy(&req->qiov);
+    itnand_page_io_free(req);
+}
+
+/*
+ * Writes a freshly programmed page through to the overlay image. The bank
+ * reports busy in FMCSTAT until the block layer completes the write.
+ */
+static void itnand_start_program(ITNandState *s, ITNandOverlayPage *op)
+{
+    ITNandPageIO *req;
+
+    if (!s->overlay_blk) {
+        return;
+    }
+
+    req = itnand_page_io_new(s, op->bank, op->page);
+    memcpy(req->record, op->record, NAND_BYTES_PER_RECORD);
+    qemu_iovec_init_buf(&req->qiov, req->record, NAND_BYTES_PER_RECORD);
+    op->unflushed = false;
+    blk_aio_pwritev(s->overlay_blk, itnand_record_index(s, op->bank, op->page) * NAND_BYTES_PER_RECORD,
+                    &req->qiov, 0, itnand_program_done, req);
+}
+
+static uint32_t itnand_fmcstat(ITNandState *s)
+{
+    uint32_t stat = NAND_FMCSTAT_READY;
+
+    for (int bank = 0; bank < NAND_NUM_BANKS; bank++) {
+        if (s->inflight[bank]) {
+            stat &= ~NAND_FMCSTAT_BANK_READY(bank);
+        }
+    }
+    return stat;
+}
+
+bool itnand_io_pending(ITNandState *s)
+{
+    return s->io_pending > 0;
+}
+
+void itnand_add_idle_notifier(ITNandState *s, Notifier *notifier)
+{
+    notifier_list_add(&s->idle_notifiers, notifier);
+}
+
+/*
+ * Runs a slice of the current FMISS program. A program that is not done yet
+ * continues from a bottom half, so that the main loop gets to complete the
+ * page I/O it may be polling FMCSTAT for.
+ */
+static void itnand_fmiss_run(ITNandState *s)
+{
+    if (!fmiss_vm_execute(s, &s->fmiss_vm, FMISS_SLICE_STEPS)) {
+        qemu_bh_schedule(s->fmiss_bh);
+        return;
+    }
+
+    s->fmiss_vm.running = false;
+    if (s->io_pending) {
+        // signal completion once the I/O started by the program is done
+        s->fmi_int_deferred = true;
+    } else {
+        s->fmi_int |= 1;
+    }
+}
+
+static void itnand_fmiss_bh(void *opaque)
+{
+    ITNandState *s = ITNAND(opaque);
+
+    // a stopped VM is picked up again by itnand_vm_state_change
+    if (s->fmiss_vm.running && runstate_is_running()) {
+        itnand_fmiss_run(s);
+    }
+}
+
+static void itnand_vm_state_change(void *opaque, bool running, RunState state)
+{
+    ITNandState *s = ITNAND(opaque);
+
+    if (running && s->fmiss_vm.running) {
+        qemu_bh_schedule(s->fmiss_bh);
+    }
+
+    if (!running) {
+        // page loads and programs land in the state, let them finish first
+        AIO_WAIT_WHILE(NULL, s->io_pending > 0);
+        itnand_flush_overlay(s);
+    }
+}
+
 static uint32_t itnand_fifo_read(void *opaque)
 {
     ITNandState *s = (ITNandState *) opaque;
@@ -209,21 +708,18 @@ static uint32_t itnand_fifo_read(void *opaque)
     case NAND_CMD_READ_PAGE:
         uint32_t read_val = 0;
         if(s->reading_multiple_pages) {
-            // which bank are we at?
-            if(s->fmdnum % 0x800 == 0) {
-                s->cur_bank_reading += 1;
-                //printf("WILL TURN TO BANK %d (cnt: %d)\n", s->cur_bank_reading, s->fmdnum);
-                set_bank(s, s->banks_to_read[s->cur_bank_reading]);
+            // stream the prefetched pages in order
+            uint32_t offset = s->prefetch_pages * NAND_BYTES_PER_PAGE - s->fmdnum;
+            if (s->fmdnum == 0 || offset >= s->prefetch_pages * NAND_BYTES_PER_PAGE) {
+                return 0;
             }
 
-            // compute the offset in the page
-            uint32_t page_offset = s->fmdnum % 0x800;
-            if(page_offset == 0) { page_offset = 0x800; }
-            nand_set_buffered_page(s, s->pages_to_read[s->cur_bank_reading]);
-            //printf("Reading page %d\n", s->pages_to_read[s->cur_bank_reading]);
-            read_val = ((uint32_t *)s->page_buffer)[(NAND_BYTES_PER_PAGE - page_offset) / 4];
-            //printf("FMDNUM: %d, offset: %d\n", s->fmdnum, (NAND_BYTES_PER_PAGE - page_offset) / 4);
-            //printf("Page offset: %d, bytes: 0x%08x\n", page_offset, read_val);
+            if (offset % NAND_BYTES_PER_PAGE == 0) {
+                // next page, switch to its bank like the hardware would
+                s->cur_bank_reading = offset / NAND_BYTES_PER_PAGE;
+                set_bank(s, s->banks_to_read[s->cur_bank_reading]);
+            }
+            read_val = ldl_he_p(s->prefetch_buf + offset);
         }
         else {
             uint32_t page = (s->fmaddr1 << 16) | (s->fmaddr0 >> 16);
@@ -231,27 +727,21 @@ static uint32_t itnand_fifo_read(void *opaque)
 
             if(s->reading_spare) {
                 read_val = ((uint32_t *)s->page_spare_buffer)[(NAND_BYTES_PER_SPARE - s->fmdnum - 1) / 4];
-                printf("fmc: Reading spare page %d -> %08x\n", page, read_val);
             } else {
                 read_val = ((uint32_t *)s->page_buffer)[(NAND_BYTES_PER_PAGE - s->fmdnum - 1) / 4];
-                printf("fmc: Reading page %d -> %08x\n", page, read_val);
             }
+            trace_itnand_fifo_read(page, s->reading_spare, read_val);
         }
         s->fmdnum -= 4;
         return read_val;
     default:
-        printf("fmc: unhandled FIFO read with CMD: %08lx\n", s->cmd);
+        qemu_log_mask(LOG_UNIMP, "%s: unhandled FIFO read with cmd 0x%02x\n", __func__, s->cmd);
         return 0xdeadbeef;
     }
 }
 
-static uint64_t itnand_read(void *opaque, hwaddr addr, unsigned size)
+static uint64_t itnand_read_reg(ITNandState *s, hwaddr addr)
 {
-    ITNandState *s = (ITNandState *) opaque;
-    //printf("%s(%08lx)...\n", __func__, addr);
-    if(s->reading_multiple_pages) {
-        fprintf(stderr, "%s: reading from 0x%08lx\n", __func__, addr);
-    }
 
     if (addr >= FMI_DMEM && addr < (FMI_DMEM+4*FMIVSS_DMEM_SIZE)) {
         uint32_t i = (addr - FMI_DMEM)/4;
@@ -269,9 +759,9 @@ static uint64_t itnand_read(void *opaque, hwaddr addr, unsigned size)
         case NAND_FMCTRL1:
             return s->fmctrl1;
         case NAND_FMFIFO:
-            return itnand_fifo_read(opaque);
+            return itnand_fifo_read(s);
         case NAND_FMCSTAT:
-            return (1 << 1) | (1 << 2) | (1 << 3) | (1 << 4) | (1 << 5) | (1 << 6) | (1 << 7) | (1 << 8) | (1 << 9) | (1 << 10) | (1 << 11) | (1 << 12); // this indicates that everything is ready, including our eight banks
+            return itnand_fmcstat(s);
         case NAND_RSCTRL:
             return s->rsctrl;
         case FMI_PROGRAM:
@@ -285,17 +775,23 @@ static uint64_t itnand_read(void *opaque, hwaddr addr, unsigned size)
         default:
             break;
     }
-    printf("fmc: unhandled MMIO read %08lx\n", addr);
+    qemu_log_mask(LOG_UNIMP, "%s: unhandled read at 0x%" HWADDR_PRIx "\n", __func__, addr);
     return 0;
 }
 
+static uint64_t itnand_read(void *opaque, hwaddr addr, unsigned size)
+{
+    uint64_t val = itnand_read_reg(opaque, addr);
+
+    trace_itnand_read(addr, val);
+    return val;
+}
+
 static void itnand_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
 {
-    //printf("%s(%08lx, %08lx)...\n", __func__, addr, val);
     ITNandState *s = (ITNandState *) opaque;
-    if(s->reading_multiple_pages) {
-        fprintf(stderr, "%s: writing 0x%08lx to 0x%08lx\n", __func__, val, addr);
-    }
+
+    trace_itnand_write(addr, val);
 
     if (addr >= FMI_DMEM && addr < (FMI_DMEM+4*FMIVSS_DMEM_SIZE)) {
         uint32_t i = (addr - FMI_DMEM)/4;
@@ -312,37 +808,29 @@ static void itnand_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
             s->fmctrl1 = val | (1<<30);
             switch (val&0b111) {
             case 0b001:
-                printf("fmc: fmctrl1: %08lx, addr tx\n", val);
+                trace_itnand_fmctrl1(val, "address");
                 break;
             case 0b010:
-                printf("fmc: fmctrl1: %08lx, read tx\n", val);
+                trace_itnand_fmctrl1(val, "read");
                 break;
             case 0b100:
-                printf("fmc: fmctrl1: %08lx, write tx\n", val);
+                trace_itnand_fmctrl1(val, "write");
                 break;
             }
             break;
         case NAND_FMADDR0:
-            printf("fmc: fmaddr0: %08lx\n", val);
             s->fmaddr0 = val;
             break;
         case NAND_FMADDR1:
-            printf("fmc: fmaddr1: %08lx\n", val);
             s->fmaddr1 = val;
             break;
         case NAND_FMANUM:
-            printf("fmc: fmanum: %08lx\n", val);
             s->fmanum = val;
             break;
         case NAND_CMD:
-            printf("fmc: cmd: %02x\n", val);
             s->cmd = val;
             break;
-        case NAND_DMADEST:
-            printf("fmc: dmadest: %02x\n", val);
-            break;
         case NAND_FMDNUM:
-            printf("fmc: fmdnum: %d\n", val);
             if(val == NAND_BYTES_PER_SPARE - 1) {
                 s->reading_spare = 1;
             } else {
@@ -356,6 +844,15 @@ static void itnand_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
                 return;
             }
 
+            if (!s->buffered_in_overlay && !itnand_make_buffered_page_writable(s)) {
+                // outside the NAND, the lookup already complained
+                s->fmdnum -= 4;
+                if (s->fmdnum == 0) {
+                    s->is_writing = false;
+                }
+                return;
+            }
+
             //printf("Setting offset %d: %d\n", s->fmdnum, (NAND_BYTES_PER_PAGE - s->fmdnum) / 4);
             ((uint32_t *)s->page_buffer)[(NAND_BYTES_PER_PAGE - s->fmdnum) / 4] = val;
             s->fmdnum -= 4;
@@ -364,20 +861,11 @@ static void itnand_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
                 // we're done!
                 s->is_writing = false;
 
-                // flush the page buffer to the disk
-                //uint32_t vpn = s->buffered_page * 8 + s->buffered_bank;
-                //printf("Flushing page %d, bank %d, vpn %d\n", s->buffered_page, s->buffered_bank, vpn);
-                qemu_mutex_lock(&s->lock);
-                qemu_mutex_unlock(&s->lock);
-                {
-                    char filename[200];
-                    sprintf(filename, "%s/bank%d/%d_new.page", s->nand_path, s->buffered_bank, s->buffered_page);
-                    FILE *f = fopen(filename, "wb");
-                    if (f == NULL) { hw_error("Unable to read file!"); }
-                    fwrite(s->page_buffer, sizeof(char), NAND_BYTES_PER_PAGE, f);
-                    fwrite(s->page_spare_buffer, sizeof(char), NAND_BYTES_PER_SPARE, f);
-                    fclose(f);
-                }
+                // the page buffer points at the overlay copy of the page, so
+                // the programmed data is already in place
+                ITNandOverlayPage *op = itnand_overlay_page(s, s->buffered_bank, s->buffered_page);
+                op->unflushed = true;
+                itnand_start_program(s, op);
             }
             break;
         case NAND_RSCTRL:
@@ -393,8 +881,8 @@ static void itnand_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
             if ((val & 1) == 0) {
                 s->fmiss_vm.iomem = s->downstream_as;
                 fmiss_vm_reset(&s->fmiss_vm, s->fmi_program);
-                fmiss_vm_execute(opaque, &s->fmiss_vm);
-                s->fmi_int |= 1;
+                s->fmiss_vm.running = true;
+                itnand_fmiss_run(s);
             }
             break;
         case  NAND_MEMFIFO_STAT:
@@ -405,7 +893,7 @@ static void itnand_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
                 }
                 for (int i = 0; i < count; i++) {
                     s->memfifo[i] = itnand_fifo_read(opaque);
-                    printf("fmc: memfifo read %d -> %08lx\n", i, s->memfifo[i]);
+                    trace_itnand_memfifo_read(i, s->memfifo[i]);
                 }
             }
             break;
@@ -426,10 +914,14 @@ static void itnand_init(Object *obj)
     ITNandState *s = ITNAND(obj);
 
     memory_region_init_io(&s->iomem, OBJECT(s), &nand_ops, s, "nand", 0x1000);
+    memory_region_set_pollable(&s->iomem, NAND_FMCSTAT, 4);
     sysbus_init_irq(sbd, &s->irq);
 
-    s->page_buffer = (uint8_t *)malloc(NAND_BYTES_PER_PAGE);
-    s->page_spare_buffer = (uint8_t *)malloc(NAND_BYTES_PER_SPARE);
+    s->overlay = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    notifier_list_init(&s->idle_notifiers);
+    s->blank_record = g_malloc0(NAND_BYTES_PER_RECORD);
+    s->page_buffer = s->blank_record;
+    s->page_spare_buffer = s->blank_record + NAND_BYTES_PER_PAGE;
     s->buffered_page = -1;
     s->buffered_bank = -1;
 
@@ -438,6 +930,68 @@ static void itnand_init(Object *obj)
     qemu_mutex_init(&s->lock);
 }
 
+static void itnand_realize(DeviceState *dev, Error **errp)
+{
+    ITNandState *s = ITNAND(dev);
+    struct stat st;
+    void *image;
+    int fd;
+
+    s->fmiss_bh = qemu_bh_new(itnand_fmiss_bh, s);
+    qemu_add_vm_change_state_handler(itnand_vm_state_change, s);
+
+    if (!s->nand_path || !*s->nand_path) {
+        // no image, every page reads back as empty until it is programmed
+        s->pages_per_bank = NAND_DEFAULT_PAGES_PER_BANK;
+        return;
+    }
+
+    fd = qemu_open(s->nand_path, O_RDONLY, errp);
+    if (fd < 0) {
+        return;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Could not stat NAND image '%s'", s->nand_path);
+        qemu_close(fd);
+        return;
+    }
+
+    if (st.st_size == 0 || st.st_size % (NAND_NUM_BANKS * NAND_BYTES_PER_RECORD) != 0 ||
+        st.st_size / (NAND_NUM_BANKS * NAND_BYTES_PER_RECORD) > UINT32_MAX / NAND_NUM_BANKS) {
+        error_setg(errp, "NAND image '%s' must hold %d banks of %d-byte page records",
+                   s->nand_path, NAND_NUM_BANKS, NAND_BYTES_PER_RECORD);
+        qemu_close(fd);
+        return;
+    }
+
+    // the base image is shared read-only, writes go to the overlay
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    qemu_close(fd);
+    if (image == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Could not map NAND image '%s'", s->nand_path);
+        return;
+    }
+
+    s->image = image;
+    s->image_size = st.st_size;
+    s->pages_per_bank = st.st_size / (NAND_NUM_BANKS * NAND_BYTES_PER_RECORD);
+    s->num_records = (uint64_t)NAND_NUM_BANKS * s->pages_per_bank;
+
+    if (s->overlay_path && *s->overlay_path) {
+        s->overlay_blk = blk_new_open(s->overlay_path, NULL, NULL, BDRV_O_RDWR | BDRV_O_RESIZE, errp);
+        if (!s->overlay_blk) {
+            return;
+        }
+
+        if (!itnand_load_overlay(s, errp)) {
+            blk_unref(s->overlay_blk);
+            s->overlay_blk = NULL;
+            return;
+        }
+    }
+}
+
 static void itnand_reset(DeviceState *d)
 {
     ITNandState *s = (ITNandState *) d;
@@ -452,17 +1006,212 @@ static void itnand_reset(DeviceState *d)
     s->cmd = 0;
     s->fmi_program = 0;
     s->fmi_int = 0;
+    s->fmi_int_deferred = false;
+    s->fmiss_vm.running = false;
+    if (s->fmiss_bh) {
+        qemu_bh_cancel(s->fmiss_bh);
+    }
+    s->reading_multiple_pages = false;
+    s->prefetch_pages = 0;
     s->reading_spare = 0;
     s->buffered_page = -1;
+    s->buffered_bank = -1;
+    s->is_writing = false;
+    s->page_buffer = s->blank_record;
+    s->page_spare_buffer = s->blank_record + NAND_BYTES_PER_PAGE;
+    s->buffered_in_overlay = false;
+    if (s->pristine_on_reset) {
+        // back to the base image, this only costs as much as there are programmed pages
+        AIO_WAIT_WHILE(NULL, s->io_pending > 0);
+        g_hash_table_remove_all(s->overlay);
+        if (s->overlay_blk && !bitmap_empty(s->written, s->num_records)) {
+            // the records stay, but the next start no longer loads them
+            bitmap_zero(s->written, s->num_records);
+            itnand_write_bitmap(s);
+        }
+    }
     for (int i = 0; i < NAND_MEMFIFO_SIZE; i++) {
         s->memfifo[i] = 0;
     }
 }
 
+static const VMStateDescription vmstate_fmiss_vm = {
+    .name = "fmiss_vm",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, fmiss_vm, 8),
+        VMSTATE_UINT32(pc, fmiss_vm),
+        VMSTATE_UINT32(start_pc, fmiss_vm),
+        VMSTATE_UINT32_ARRAY(dmem, fmiss_vm, FMIVSS_DMEM_SIZE),
+        VMSTATE_BOOL(running, fmiss_vm),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_itnand_overlay_page = {
+    .name = "itnand_overlay_page",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(bank, ITNandOverlayPage),
+        VMSTATE_UINT32(page, ITNandOverlayPage),
+        VMSTATE_BOOL(unflushed, ITNandOverlayPage),
+        VMSTATE_UINT8_ARRAY(record, ITNandOverlayPage, NAND_BYTES_PER_RECORD),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int itnand_pre_save(void *opaque)
+{
+    ITNandState *s = ITNAND(opaque);
+    GHashTableIter iter;
+    gpointer value;
+    int32_t i = 0;
+
+    // the overlay is a hash table, send it as a flat array of pages
+    s->migrate_num_pages = g_hash_table_size(s->overlay);
+    s->migrate_pages = g_new(ITNandOverlayPage, s->migrate_num_pages);
+    g_hash_table_iter_init(&iter, s->overlay);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        memcpy(&s->migrate_pages[i++], value, sizeof(ITNandOverlayPage));
+    }
+
+    s->prefetch_bytes = s->prefetch_pages * NAND_BYTES_PER_PAGE;
+    return 0;
+}
+
+static int itnand_post_save(void *opaque)
+{
+    ITNandState *s = ITNAND(opaque);
+
+    g_free(s->migrate_pages);
+    s->migrate_pages = NULL;
+    s->migrate_num_pages = 0;
+    return 0;
+}
+
+static int itnand_pre_load(void *opaque)
+{
+    ITNandState *s = ITNAND(opaque);
+
+    s->migrate_pages = NULL;
+    s->migrate_num_pages = 0;
+    if (!s->prefetch_buf) {
+        s->prefetch_buf = g_malloc(NAND_MAX_BULK_PAGES * NAND_BYTES_PER_PAGE);
+    }
+    return 0;
+}
+
+static bool itnand_prefetch_valid(void *opaque, int version_id)
+{
+    ITNandState *s = ITNAND(opaque);
+
+    return s->prefetch_pages <= NAND_MAX_BULK_PAGES &&
+           s->prefetch_bytes == s->prefetch_pages * NAND_BYTES_PER_PAGE;
+}
+
+// checked before the page array is allocated
+static bool itnand_migrate_pages_valid(void *opaque, int version_id)
+{
+    ITNandState *s = ITNAND(opaque);
+
+    return s->migrate_num_pages >= 0 &&
+           s->migrate_num_pages <= (uint64_t)NAND_NUM_BANKS * s->pages_per_bank;
+}
+
+static int itnand_post_load(void *opaque, int version_id)
+{
+    ITNandState *s = ITNAND(opaque);
+    bool in_overlay;
+    int ret = 0;
+
+    g_hash_table_remove_all(s->overlay);
+    if (s->migrate_num_pages < 0) {
+        ret = -EINVAL;
+    }
+    for (int32_t i = 0; i < s->migrate_num_pages; i++) {
+        ITNandOverlayPage *op = &s->migrate_pages[i];
+
+        if (!itnand_page_valid(s, op->bank, op->page)) {
+            ret = -EINVAL;
+            break;
+        }
+        g_hash_table_insert(s->overlay, itnand_overlay_key(op->bank, op->page),
+                            g_memdup(op, sizeof(ITNandOverlayPage)));
+    }
+    g_free(s->migrate_pages);
+    s->migrate_pages = NULL;
+    s->migrate_num_pages = 0;
+    if (ret) {
+        return ret;
+    }
+
+    if (s->buffered_bank < NAND_NUM_BANKS) {
+        const uint8_t *record = itnand_lookup_record(s, s->buffered_bank, s->buffered_page, &s->buffered_in_overlay);
+
+        s->page_buffer = (uint8_t *)record;
+        s->page_spare_buffer = (uint8_t *)record + NAND_BYTES_PER_PAGE;
+    } else {
+        s->page_buffer = s->blank_record;
+        s->page_spare_buffer = s->blank_record + NAND_BYTES_PER_PAGE;
+        s->buffered_in_overlay = false;
+    }
+
+    fmiss_vm_flush_cache(&s->fmiss_vm);
+    // a program still running resumes once the VM does
+    s->fmiss_vm.iomem = s->downstream_as;
+    return 0;
+}
+
+static const VMStateDescription vmstate_itnand = {
+    .name = TYPE_ITNAND,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = itnand_pre_save,
+    .post_save = itnand_post_save,
+    .pre_load = itnand_pre_load,
+    .post_load = itnand_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(fmctrl0, ITNandState),
+        VMSTATE_UINT32(fmctrl1, ITNandState),
+        VMSTATE_UINT32(fmaddr0, ITNandState),
+        VMSTATE_UINT32(fmaddr1, ITNandState),
+        VMSTATE_UINT32(fmanum, ITNandState),
+        VMSTATE_UINT32(fmdnum, ITNandState),
+        VMSTATE_UINT32(rsctrl, ITNandState),
+        VMSTATE_UINT32(cmd, ITNandState),
+        VMSTATE_UINT32_ARRAY(memfifo, ITNandState, NAND_MEMFIFO_SIZE),
+        VMSTATE_UINT32(fmi_program, ITNandState),
+        VMSTATE_UINT32(fmi_int, ITNandState),
+        VMSTATE_UINT8(reading_spare, ITNandState),
+        VMSTATE_UINT32(buffered_bank, ITNandState),
+        VMSTATE_UINT32(buffered_page, ITNandState),
+        VMSTATE_BOOL(reading_multiple_pages, ITNandState),
+        VMSTATE_UINT32(cur_bank_reading, ITNandState),
+        VMSTATE_UINT32_ARRAY(banks_to_read, ITNandState, NAND_MAX_BULK_PAGES),
+        VMSTATE_UINT32_ARRAY(pages_to_read, ITNandState, NAND_MAX_BULK_PAGES),
+        VMSTATE_UINT32(prefetch_pages, ITNandState),
+        VMSTATE_UINT32(prefetch_bytes, ITNandState),
+        VMSTATE_VALIDATE("prefetch size", itnand_prefetch_valid),
+        VMSTATE_VBUFFER_UINT32(prefetch_buf, ITNandState, 0, NULL, prefetch_bytes),
+        VMSTATE_BOOL(is_writing, ITNandState),
+        VMSTATE_BOOL(fmi_int_deferred, ITNandState),
+        VMSTATE_INT32(migrate_num_pages, ITNandState),
+        VMSTATE_VALIDATE("overlay page count", itnand_migrate_pages_valid),
+        VMSTATE_STRUCT_VARRAY_ALLOC(migrate_pages, ITNandState, migrate_num_pages, 0,
+                                    vmstate_itnand_overlay_page, ITNandOverlayPage),
+        VMSTATE_STRUCT(fmiss_vm, ITNandState, 1, vmstate_fmiss_vm, fmiss_vm),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void itnand_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
+    dc->realize = itnand_realize;
     dc->reset = itnand_reset;
+    dc->vmsd = &vmstate_itnand;
 }
 
 static const TypeInfo itnand_info = {
@@ -1,4 +1,6 @@
 #include "hw/arm/ipod_nano3g_nand_ecc.h"
+#include "qemu/log.h"
+#include "migration/vmstate.h"
 
 static uint64_t itnand_ecc_read(void *opaque, hwaddr addr, unsigned size)
 {
@@ -7,20 +9,52 @@ static uint64_t itnand_ecc_read(void *opaque, hwaddr addr, unsigned size)
 
     switch (addr) {
         case NANDECC_STATUS:
-            return 0; // TODO: for now, we assume that all ECC operations are successful
+            return s->status;
         default:
             break;
     }
     return 0;
 }
 
+// only completion is signalled, the parity layout of the real engine is unknown
+static void itnand_ecc_complete(ITNandECCState *s)
+{
+    qemu_irq_raise(s->irq);
+}
+
+static void itnand_ecc_nand_idle(Notifier *notifier, void *data)
+{
+    ITNandECCState *s = container_of(notifier, ITNandECCState, nand_idle);
+
+    notifier_remove(&s->nand_idle);
+    s->irq_deferred = false;
+    itnand_ecc_complete(s);
+}
+
 static void itnand_ecc_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
 {
     ITNandECCState *s = (ITNandECCState *) opaque;
 
     switch(addr) {
+        case NANDECC_DATA:
+            s->data_addr = val;
+            break;
+        case NANDECC_ECC:
+            s->ecc_addr = val;
+            break;
+        case NANDECC_SETUP:
+            s->setup = val;
+            break;
         case NANDECC_START:
-            qemu_irq_raise(s->irq);
+            if (s->nand_state && itnand_io_pending(s->nand_state)) {
+                // the page is still on its way, complete when the NAND goes idle
+                if (!s->irq_deferred) {
+                    s->irq_deferred = true;
+                    itnand_add_idle_notifier(s->nand_state, &s->nand_idle);
+                }
+                break;
+            }
+            itnand_ecc_complete(s);
             break;
         case NANDECC_CLEARINT:
             qemu_irq_lower(s->irq);
@@ -43,6 +77,7 @@ static void itnand_ecc_init(Object *obj)
 
     memory_region_init_io(&s->iomem, OBJECT(s), &nand_ecc_ops, s, "nandecc", 0x100);
     sysbus_init_irq(sbd, &s->irq);
+    s->nand_idle.notify = itnand_ecc_nand_idle;
 }
 
 static void itnand_ecc_reset(DeviceState *d)
@@ -55,10 +90,55 @@ static void itnand_ecc_reset(DeviceState *d)
     s->setup = 0;
 }
 
+static int itnand_ecc_pre_load(void *opaque)
+{
+    ITNandECCState *s = opaque;
+
+    // the incoming state decides whether a completion is still pending
+    if (s->irq_deferred) {
+        notifier_remove(&s->nand_idle);
+        s->irq_deferred = false;
+    }
+    return 0;
+}
+
+static int itnand_ecc_post_load(void *opaque, int version_id)
+{
+    ITNandECCState *s = opaque;
+
+    if (s->irq_deferred) {
+        if (s->nand_state && itnand_io_pending(s->nand_state)) {
+            itnand_add_idle_notifier(s->nand_state, &s->nand_idle);
+        } else {
+            // the page I/O it was waiting for finished before the state was saved
+            s->irq_deferred = false;
+            itnand_ecc_complete(s);
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_itnand_ecc = {
+    .name = TYPE_ITNANDECC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_load = itnand_ecc_pre_load,
+    .post_load = itnand_ecc_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(data_addr, ITNandECCState),
+        VMSTATE_UINT32(ecc_addr, ITNandECCState),
+        VMSTATE_UINT32(status, ITNandECCState),
+        VMSTATE_UINT32(setup, ITNandECCState),
+        VMSTATE_BOOL(irq_deferred, ITNandECCState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void itnand_ecc_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
     dc->reset = itnand_ecc_reset;
+    dc->vmsd = &vmstate_itnand_ecc;
 }
 
 static const TypeInfo itnand_ecc_info = {
@@ -1,16 +1,77 @@
 #include "hw/arm/ipod_nano3g_nor_spi.h"
+#include "hw/arm/ipod_nano3g_milestones.h"
+#include "qapi/error.h"
+#include "migration/vmstate.h"
+#include "trace.h"
+#include <sys/mman.h>
 
-static void initialize_nor(IPodNano3GNORSPIState *s)
+void ipod_nano3g_nor_spi_load(IPodNano3GNORSPIState *s, const char *nor_path,
+                              const char *bootloader_path, Error **errp)
 {
-    unsigned long fsize;
-    // TODO still hardcoded, string copy not working...
-    if (g_file_get_contents(s->bootloader_path, (char **)&s->bootloader_data, &fsize, NULL)) {
-        s->nor_initialized = true;
-    } else {
-        printf("Could not read bootloader\n");
-        exit(1);
+    if (nor_path && *nor_path) {
+        struct stat st;
+        void *image;
+        int fd;
+
+        fd = qemu_open(nor_path, O_RDONLY, errp);
+        if (fd < 0) {
+            return;
+        }
+
+        if (fstat(fd, &st) < 0) {
+            error_setg_errno(errp, errno, "Could not stat NOR image '%s'", nor_path);
+            qemu_close(fd);
+            return;
+        }
+
+        if (st.st_size == 0) {
+            error_setg(errp, "NOR image '%s' is empty", nor_path);
+            qemu_close(fd);
+            return;
+        }
+
+        // programming the NOR is not emulated, so the image is only ever read
+        image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        qemu_close(fd);
+        if (image == MAP_FAILED) {
+            error_setg_errno(errp, errno, "Could not map NOR image '%s'", nor_path);
+            return;
+        }
+
+        s->image = image;
+        s->image_size = st.st_size;
+    } else if (bootloader_path && *bootloader_path) {
+        // no full image - put the bootloader where the bootrom looks for it
+        g_autoptr(GError) gerr = NULL;
+        gchar *data;
+        gsize len;
+
+        if (!g_file_get_contents(bootloader_path, &data, &len, &gerr)) {
+            error_setg(errp, "Could not read bootloader '%s': %s", bootloader_path, gerr->message);
+            return;
+        }
+
+        s->image_size = NOR_BOOTLOADER_OFFSET + len;
+        s->image = g_malloc0(s->image_size);
+        memcpy(s->image + NOR_BOOTLOADER_OFFSET, data, len);
+        g_free(data);
     }
-    s->cur_data = s->bootloader_data;
+}
+
+/*
+ * Reads len bytes of the flash, starting at the current read address.
+ * Anything beyond the image reads back as erased.
+ */
+static void nor_read(IPodNano3GNORSPIState *s, uint8_t *buf, uint32_t len)
+{
+    uint32_t avail = 0;
+
+    if (s->nor_read_ind < s->image_size) {
+        avail = MIN(len, s->image_size - s->nor_read_ind);
+        memcpy(buf, s->image + s->nor_read_ind, avail);
+    }
+    memset(buf + avail, 0xFF, len - avail);
+    s->nor_read_ind += len;
 }
 
 static uint32_t ipod_nano3g_nor_spi_transfer(SSIPeripheral *dev, uint32_t value)
@@ -27,11 +88,11 @@ static uint32_t ipod_nano3g_nor_spi_transfer(SSIPeripheral *dev, uint32_t value)
     if(s->cur_cmd == 0) {
         // this is a new command -> set it
         s->cur_cmd = value;
-        s->out_buf = malloc(0x1000);
-        s->in_buf = malloc(0x100);
         s->in_buf[0] = value;
+        s->out_buf[0] = 0;
         s->in_buf_size = 0;
         s->in_buf_cur_ind = 1;
+        s->out_buf_size = 0;
         s->out_buf_cur_ind = 0;
 
         switch(value) {
@@ -42,8 +103,8 @@ static uint32_t ipod_nano3g_nor_spi_transfer(SSIPeripheral *dev, uint32_t value)
                 s->out_buf_size = 1;
                 break;
             case NOR_READ_DATA_CMD:
+                // the response is streamed from the image until the next command
                 s->in_buf_size = 4;
-                s->out_buf_size = 4096;
                 break;
             case NOR_RESET_CMD:
                 s->in_buf_size = 1;
@@ -73,17 +134,9 @@ static uint32_t ipod_nano3g_nor_spi_transfer(SSIPeripheral *dev, uint32_t value)
         } else if(s->cur_cmd == NOR_RESET_CMD && s->in_buf_cur_ind == s->in_buf_size) {
             s->out_buf[0] = 0x0;  // indicates that the NOR is reset
         } else if(s->cur_cmd == NOR_READ_DATA_CMD && s->in_buf_cur_ind == s->in_buf_size) {
-            if(!s->nor_initialized) { initialize_nor(s); }
             s->nor_read_ind = (s->in_buf[1] << 16) | (s->in_buf[2] << 8) | s->in_buf[3];
-            printf("NOR read of %08x... ", s->nor_read_ind);
-            if ((s->nor_read_ind >= 0x8000) && s->nor_read_ind < (256<<10)) {
-                s->nor_read_ind -= 0x8000;
-                s->cur_data = s->bootloader_data;
-                printf("-> bootloader @ 0x%08X\n", s->nor_read_ind);
-            } else {
-                printf("???\n");
-                s->cur_data = NULL;
-            }
+            ipod_nano3g_milestone(IPOD_NANO3G_MILESTONE_NOR_FIRST_READ);
+            trace_ipod_nano3g_nor_read(s->nor_read_ind);
         }
 
         return 0x0;
@@ -92,40 +145,84 @@ static uint32_t ipod_nano3g_nor_spi_transfer(SSIPeripheral *dev, uint32_t value)
         uint8_t ret_val;
         // otherwise, we're outputting the response
         if(s->cur_cmd == NOR_READ_DATA_CMD) {
-            if (s->cur_data == NULL ) {
-                return 0;
-            }
-            // TODO: don't allow reading past the currently mapped file.
-            uint8_t ret_val = s->cur_data[s->nor_read_ind];
-            s->nor_read_ind++;
-            return ret_val;
+            nor_read(s, &ret_val, 1);
         }
         else {
             ret_val = s->out_buf[s->out_buf_cur_ind];
             s->out_buf_cur_ind++;
 
-            if(s->cur_cmd != 0 && (s->out_buf_cur_ind == s->out_buf_size)) {
-                // the command is done - clean up
+            if(s->out_buf_cur_ind == s->out_buf_size) {
+                // the command is done
                 s->cur_cmd = 0;
-                free(s->in_buf);
-                free(s->out_buf);
             }
         }
         return ret_val;
     }
 }
 
+static uint32_t ipod_nano3g_nor_spi_transfer_bulk(SSIPeripheral *dev, const uint8_t *tx,
+                                                  uint8_t *rx, uint32_t len)
+{
+    IPodNano3GNORSPIState *s = IPOD_NANO3G_NOR_SPI(dev);
+    uint32_t n = len;
+
+    // only the data phase of a read is worth batching
+    if(s->cur_cmd != NOR_READ_DATA_CMD || s->in_buf_cur_ind != s->in_buf_size) {
+        return 0;
+    }
+
+    if(tx) {
+        // anything but the sentinel ends the read, leave that to the byte path
+        for(n = 0; n < len && tx[n] == 0xFF; n++) {
+        }
+    }
+
+    nor_read(s, rx, n);
+    return n;
+}
+
 static void ipod_nano3g_nor_spi_realize(SSIPeripheral *d, Error **errp)
 {
-    IPodNano3GNORSPIState *s = IPOD_NANO3G_NOR_SPI(d);
-    s->nor_initialized = 0;
 }
 
+static int ipod_nano3g_nor_spi_post_load(void *opaque, int version_id)
+{
+    IPodNano3GNORSPIState *s = opaque;
+
+    if (s->in_buf_size > NOR_MAX_CMD_LEN || s->in_buf_cur_ind > NOR_MAX_CMD_LEN ||
+        s->out_buf_size > NOR_MAX_RESPONSE_LEN || s->out_buf_cur_ind > NOR_MAX_RESPONSE_LEN) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_ipod_nano3g_nor_spi = {
+    .name = TYPE_IPOD_NANO3G_NOR_SPI,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = ipod_nano3g_nor_spi_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_SSI_PERIPHERAL(ssidev, IPodNano3GNORSPIState),
+        VMSTATE_UINT32(cur_cmd, IPodNano3GNORSPIState),
+        VMSTATE_UINT8_ARRAY(in_buf, IPodNano3GNORSPIState, NOR_MAX_CMD_LEN),
+        VMSTATE_UINT8_ARRAY(out_buf, IPodNano3GNORSPIState, NOR_MAX_RESPONSE_LEN),
+        VMSTATE_UINT32(in_buf_size, IPodNano3GNORSPIState),
+        VMSTATE_UINT32(out_buf_size, IPodNano3GNORSPIState),
+        VMSTATE_UINT32(in_buf_cur_ind, IPodNano3GNORSPIState),
+        VMSTATE_UINT32(out_buf_cur_ind, IPodNano3GNORSPIState),
+        VMSTATE_UINT32(nor_read_ind, IPodNano3GNORSPIState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void ipod_nano3g_nor_spi_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SSIPeripheralClass *k = SSI_PERIPHERAL_CLASS(klass);
+    dc->vmsd = &vmstate_ipod_nano3g_nor_spi;
     k->realize = ipod_nano3g_nor_spi_realize;
     k->transfer = ipod_nano3g_nor_spi_transfer;
+    k->transfer_bulk = ipod_nano3g_nor_spi_transfer_bulk;
 }
 
 static const TypeInfo ipod_nano3g_nor_spi_type_info = {
@@ -1,4 +1,5 @@
 #include "hw/arm/ipod_nano3g_pcf50633_pmu.h"
+#include "migration/vmstate.h"
 
 static int pcf50633_event(I2CSlave *i2c, enum i2c_event event) {
     return 0;
@@ -78,9 +79,22 @@ static int pcf50633_send(I2CSlave *i2c, uint8_t data) {
 
 static void pcf50633_init(Object *obj) {}
 
+static const VMStateDescription vmstate_pcf50633 = {
+    .name = TYPE_PCF50633,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_I2C_SLAVE(i2c, Pcf50633State),
+        VMSTATE_UINT32(cmd, Pcf50633State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void pcf50633_class_init(ObjectClass *klass, void *data) {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     I2CSlaveClass *k = I2C_SLAVE_CLASS(klass);
 
+    dc->vmsd = &vmstate_pcf50633;
     k->event = pcf50633_event;
     k->recv = pcf50633_recv;
     k->send = pcf50633_send;
@@ -1,4 +1,6 @@
 #include "hw/arm/ipod_nano3g_sdio.h"
+#include "migration/vmstate.h"
+#include "trace.h"
 
 void sdio_exec_cmd(IPodNano3GSDIOState *s)
 {
@@ -11,10 +13,10 @@ void sdio_exec_cmd(IPodNano3GSDIOState *s)
 
 static void ipod_nano3g_sdio_write(void *opaque, hwaddr addr, uint64_t value, unsigned size)
 {
-    fprintf(stderr, "%s: writing 0x%08x to 0x%08x\n", __func__, value, addr);
-    
     IPodNano3GSDIOState *s = (struct IPodNano3GSDIOState *) opaque;
 
+    trace_ipod_nano3g_sdio_write(addr, value);
+
     switch(addr) {
         case SDIO_CMD:
             s->cmd = value;
@@ -38,34 +40,43 @@ static void ipod_nano3g_sdio_write(void *opaque, hwaddr addr, uint64_t value, un
 
 static uint64_t ipod_nano3g_sdio_read(void *opaque, hwaddr addr, unsigned size)
 {
-    fprintf(stderr, "%s: offset = 0x%08x\n", __func__, addr);
-
     IPodNano3GSDIOState *s = (struct IPodNano3GSDIOState *) opaque;
+    uint64_t val = 0;
 
     switch (addr) {
         case SDIO_CMD:
-            return s->cmd;
+            val = s->cmd;
+            break;
         case SDIO_ARGU:
-            return s->arg;
+            val = s->arg;
+            break;
         case SDIO_DSTA:
-            return (1 << 0) | (1 << 4) ; // 0x1 indicates that the SDIO is ready for a CMD, (1 << 4) that the command is complete
+            val = (1 << 0) | (1 << 4) ; // 0x1 indicates that the SDIO is ready for a CMD, (1 << 4) that the command is complete
+            break;
         case SDIO_RESP0:
-            return s->resp0;
+            val = s->resp0;
+            break;
         case SDIO_RESP1:
-            return s->resp1;
+            val = s->resp1;
+            break;
         case SDIO_RESP2:
-            return s->resp2;
+            val = s->resp2;
+            break;
         case SDIO_RESP3:
-            return s->resp3;
+            val = s->resp3;
+            break;
         case SDIO_CSR:
-            return s->csr;
+            val = s->csr;
+            break;
         case SDIO_IRQMASK:
-            return s->irq_mask;
+            val = s->irq_mask;
+            break;
         default:
             break;
     }
 
-    return 0;
+    trace_ipod_nano3g_sdio_read(addr, val);
+    return val;
 }
 
 static const MemoryRegionOps ipod_nano3g_sdio_ops = {
@@ -84,9 +95,28 @@ static void ipod_nano3g_sdio_init(Object *obj)
     sysbus_init_mmio(sbd, &s->iomem);
 }
 
+static const VMStateDescription vmstate_ipod_nano3g_sdio = {
+    .name = TYPE_IPOD_NANO3G_SDIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(cmd, IPodNano3GSDIOState),
+        VMSTATE_UINT32(arg, IPodNano3GSDIOState),
+        VMSTATE_UINT32(csr, IPodNano3GSDIOState),
+        VMSTATE_UINT32(resp0, IPodNano3GSDIOState),
+        VMSTATE_UINT32(resp1, IPodNano3GSDIOState),
+        VMSTATE_UINT32(resp2, IPodNano3GSDIOState),
+        VMSTATE_UINT32(resp3, IPodNano3GSDIOState),
+        VMSTATE_UINT32(irq_mask, IPodNano3GSDIOState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void ipod_nano3g_sdio_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->vmsd = &vmstate_ipod_nano3g_sdio;
 }
 
 static const TypeInfo ipod_nano3g_sdio_type_info = {
@@ -1,19 +1,97 @@
 #include "hw/arm/ipod_nano3g_sha1.h"
+#include "qemu/bitops.h"
+#include "exec/address-spaces.h"
+#include "migration/vmstate.h"
 
-static uint64_t swapLong(void *X) {
-    uint64_t x = (uint64_t) X;
-    x = (x & 0x00000000FFFFFFFF) << 32 | (x & 0xFFFFFFFF00000000) >> 32;
-    x = (x & 0x0000FFFF0000FFFF) << 16 | (x & 0xFFFF0000FFFF0000) >> 16;
-    x = (x & 0x00FF00FF00FF00FF) << 8  | (x & 0xFF00FF00FF00FF00) >> 8;
-    return x;
+static const uint32_t sha1_init_state[SHA1_DIGEST_WORDS] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0,
+};
+
+// the SHA-1 compression function (FIPS 180-4, 6.1.2) over one 64-byte block
+static void sha1_transform(uint32_t *h, const uint8_t *block) {
+    uint32_t w[80];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+    for (int t = 0; t < 16; t++) {
+        w[t] = ldl_be_p(block + t * 4);
+    }
+    for (int t = 16; t < 80; t++) {
+        w[t] = rol32(w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16], 1);
+    }
+
+    for (int t = 0; t < 80; t++) {
+        uint32_t f, k;
+
+        if (t < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (t < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (t < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        uint32_t temp = rol32(a, 5) + f + e + k + w[t];
+        e = d;
+        d = c;
+        c = rol32(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+/*
+ * The guest pads the message itself and the engine only runs the SHA-1
+ * compression function, so every 64-byte block advances the state as soon
+ * as it is fed.
+ */
+static void sha1_process(S5L8702SHA1State *s, const uint8_t *data, size_t len) {
+    for (; len >= SHA1_BLOCK_SIZE; len -= SHA1_BLOCK_SIZE, data += SHA1_BLOCK_SIZE) {
+        sha1_transform(s->h, data);
+    }
 }
 
 static void flush_hw_buffer(S5L8702SHA1State *s) {
-    // Flush the hardware buffer to the state buffer and clear the buffer.
-    memcpy(s->buffer + s->buffer_ind, (uint8_t *)s->hw_buffer, 0x40);
-    memset(s->hw_buffer, 0, 0x40);
+    // Hash the hardware buffer and clear it.
+    sha1_process(s, (uint8_t *)s->hw_buffer, SHA1_BLOCK_SIZE);
+    memset(s->hw_buffer, 0, SHA1_BLOCK_SIZE);
     s->hw_buffer_dirty = false;
-    s->buffer_ind += 0x40;
+}
+
+// hashes a memory mode run, straight from guest RAM where possible
+static void sha1_process_memory(S5L8702SHA1State *s, hwaddr addr, uint32_t len) {
+    len &= ~(SHA1_BLOCK_SIZE - 1);
+    while (len) {
+        hwaddr plen = len;
+        void *p = address_space_map(&address_space_memory, addr, &plen, false, MEMTXATTRS_UNSPECIFIED);
+        if (!p || plen < SHA1_BLOCK_SIZE) {
+            // not RAM, or a block straddling two regions
+            uint8_t block[SHA1_BLOCK_SIZE];
+            if (p) {
+                address_space_unmap(&address_space_memory, p, plen, false, 0);
+            }
+            address_space_read(&address_space_memory, addr, MEMTXATTRS_UNSPECIFIED, block, SHA1_BLOCK_SIZE);
+            sha1_process(s, block, SHA1_BLOCK_SIZE);
+            plen = SHA1_BLOCK_SIZE;
+        } else {
+            plen &= ~(hwaddr)(SHA1_BLOCK_SIZE - 1);
+            sha1_process(s, p, plen);
+            address_space_unmap(&address_space_memory, p, plen, false, plen);
+        }
+        addr += plen;
+        len -= plen;
+    }
 }
 
 static void sha1_reset(S5L8702SHA1State *s)
@@ -22,12 +100,9 @@ static void sha1_reset(S5L8702SHA1State *s)
 	s->memory_start = 0;
 	s->memory_mode = 0;
 	s->insize = 0;
-	memset(&s->buffer, 0, SHA1_BUFFER_SIZE);
 	memset(&s->hw_buffer, 0, 0x10 * sizeof(uint32_t));
-	s->buffer_ind = 0;
-	memset(&s->hashout, 0, 0x14);
 	s->hw_buffer_dirty = false;
-	s->hash_computed = false;
+	memcpy(s->h, sha1_init_state, sizeof(s->h));
 }
 
 static uint64_t S5L8702_sha1_read(void *opaque, hwaddr offset, unsigned size)
@@ -48,20 +123,15 @@ static uint64_t S5L8702_sha1_read(void *opaque, hwaddr offset, unsigned size)
 		case SHA_INSIZE:
 			return s->insize;
 		/* Hash result ouput */
-		case 0x20 ... 0x34:
-			//fprintf(stderr, "Hash out %08x\n",  *(uint32_t *)&s->hashout[offset - 0x20]);
-            if(!s->hash_computed) {
-                // lazy compute the final hash by inspecting the last eight bytes of the buffer, which contains the length of the input data.
-                uint64_t data_length = swapLong(((uint64_t *)s->buffer)[s->buffer_ind / 8 - 1]) / 8;
-
-                SHA_CTX ctx;
-                SHA1_Init(&ctx);
-                SHA1_Update(&ctx, s->buffer, data_length);
-                SHA1_Final(s->hashout, &ctx);
-                s->hash_computed = true;
+		case 0x20 ... 0x30:
+            {
+                // the digest is the current chaining state, in big-endian byte order
+                uint8_t hashout[0x14];
+                for (int i = 0; i < SHA1_DIGEST_WORDS; i++) {
+                    stl_be_p(hashout + i * 4, s->h[i]);
+                }
+                return ldl_he_p(&hashout[offset - 0x20]);
             }
-
-			return *(uint32_t *)&s->hashout[offset - 0x20];
 	}
 
     return 0;
@@ -83,11 +153,8 @@ static void S5L8702_sha1_write(void *opaque, hwaddr offset, uint64_t value, unsi
 
 				if(s->memory_mode)
 				{
-					// we are in memory mode - gradually add the memory to the buffer
-					for(int i = 0; i < s->insize / 0x40; i++) {
-						cpu_physical_memory_read(s->memory_start + i * 0x40, s->buffer + s->buffer_ind, 0x40);
-						s->buffer_ind += 0x40;
-					}
+					// we are in memory mode - hash the memory range in one go
+					sha1_process_memory(s, s->memory_start, s->insize);
 				}
 			} else {
 				s->config = value;
@@ -103,7 +170,6 @@ static void S5L8702_sha1_write(void *opaque, hwaddr offset, uint64_t value, unsi
 			s->memory_mode = value;
 			break;
 		case SHA_INSIZE:
-            assert(value <= SHA1_BUFFER_SIZE);
 			s->insize = value;
 			break;
 		case 0x40 ... 0x7c:
@@ -132,9 +198,27 @@ static void S5L8702_sha1_init(Object *obj)
     sha1_reset(s);
 }
 
+static const VMStateDescription vmstate_S5L8702_sha1 = {
+    .name = TYPE_IPOD_NANO3G_SHA1,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(config, S5L8702SHA1State),
+        VMSTATE_UINT32(memory_start, S5L8702SHA1State),
+        VMSTATE_UINT32(memory_mode, S5L8702SHA1State),
+        VMSTATE_UINT32(insize, S5L8702SHA1State),
+        VMSTATE_UINT32_ARRAY(hw_buffer, S5L8702SHA1State, 0x10),
+        VMSTATE_BOOL(hw_buffer_dirty, S5L8702SHA1State),
+        VMSTATE_UINT32_ARRAY(h, S5L8702SHA1State, SHA1_DIGEST_WORDS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void S5L8702_sha1_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
 
+    dc->vmsd = &vmstate_S5L8702_sha1;
 }
 
 static const TypeInfo ipod_nano3g_sha1_info = {
@@ -5,6 +5,7 @@
  */
 
 #include "hw/arm/ipod_nano3g_spi.h"
+#include "migration/vmstate.h"
 
 static int apple_spi_word_size(S5L8702SPIState *s)
 {
@@ -80,10 +81,30 @@ static void apple_spi_cs_set(void *opaque, int pin, int level)
     apple_spi_update_cs(s);
 }
 
+/*
+ * Queues up to num received bytes, as far as the guest still expects any and
+ * the RX FIFO has room for them.
+ */
+static void apple_spi_push_rx(S5L8702SPIState *s, const uint8_t *buf, uint32_t num)
+{
+    uint32_t want = MIN(num, REG(s, R_RXCNT));
+    uint32_t fits = MIN(want, fifo8_num_free(&s->rx_fifo));
+
+    if (fits < want) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: rx overflow\n", __func__);
+        REG(s, R_STATUS) |= R_STATUS_RXOVERFLOW;
+    }
+    if (fits) {
+        fifo8_push_all(&s->rx_fifo, buf, fits);
+        REG(s, R_RXCNT) -= fits;
+    }
+}
+
 static void apple_spi_run(S5L8702SPIState *s)
 {
-    uint32_t tx;
-    uint32_t rx;
+    uint8_t rx[SPI_BURST_LEN];
+    const uint8_t *tx;
+    uint32_t num;
 
     // fprintf(stderr, "apple_spi_run\n");
 
@@ -92,38 +113,24 @@ static void apple_spi_run(S5L8702SPIState *s)
         return;
     }
 
-    apple_spi_update_xfer_tx(s);
-
+    // send what the guest queued, a contiguous run of the FIFO at a time.
     while (!fifo8_is_empty(&s->tx_fifo)) {
-        tx = (uint32_t)fifo8_pop(&s->tx_fifo);
-        rx = ssi_transfer(s->spi, tx);
-        // REG(s, R_TXCNT)--;
-        apple_spi_update_xfer_tx(s);
-        if (REG(s, R_RXCNT) > 0) {
-            if (fifo8_is_full(&s->rx_fifo)) {
-                qemu_log_mask(LOG_GUEST_ERROR, "%s: rx overflow\n", __func__);
-                REG(s, R_STATUS) |= R_STATUS_RXOVERFLOW;
-            } else {
-                fifo8_push(&s->rx_fifo, (uint8_t)rx);
-                REG(s, R_RXCNT)--;
-                apple_spi_update_xfer_rx(s);
-            }
-        }
+        tx = fifo8_pop_buf(&s->tx_fifo, MIN(fifo8_num_used(&s->tx_fifo), SPI_BURST_LEN), &num);
+        ssi_transfer_bulk(s->spi, tx, rx, num);
+        // REG(s, R_TXCNT) -= num;
+        apple_spi_push_rx(s, rx, num);
     }
 
     // fetch the remaining bytes by sending sentinel bytes.
     while (!fifo8_is_full(&s->rx_fifo) && (REG(s, R_RXCNT) > 0) && (REG(s, R_CFG) & R_CFG_AGD)) {
-        rx = ssi_transfer(s->spi, 0xff);
-        if (fifo8_is_full(&s->rx_fifo)) {
-            qemu_log_mask(LOG_GUEST_ERROR, "%s: rx overflow\n", __func__);
-            REG(s, R_STATUS) |= R_STATUS_RXOVERFLOW;
-            break;
-        } else {
-            fifo8_push(&s->rx_fifo, (uint8_t)rx);
-            REG(s, R_RXCNT)--;
-            apple_spi_update_xfer_rx(s);
-        }
+        num = MIN(MIN(fifo8_num_free(&s->rx_fifo), REG(s, R_RXCNT)), SPI_BURST_LEN);
+        ssi_transfer_bulk(s->spi, NULL, rx, num);
+        apple_spi_push_rx(s, rx, num);
     }
+
+    // the status only needs to reflect where the burst ended up.
+    apple_spi_update_xfer_tx(s);
+    apple_spi_update_xfer_rx(s);
     if (REG(s, R_RXCNT) == 0 && REG(s, R_TXCNT) == 0) {
         REG(s, R_STATUS) |= R_STATUS_COMPLETE;
     }
@@ -320,11 +327,25 @@ static void S5L8702_spi_realize(DeviceState *dev, struct Error **errp)
     }
 }
 
+static const VMStateDescription vmstate_S5L8702_spi = {
+    .name = TYPE_S5L8702SPI,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, S5L8702SPIState, MMIO_SIZE >> 2),
+        VMSTATE_UINT32(last_irq, S5L8702SPIState),
+        VMSTATE_FIFO8(rx_fifo, S5L8702SPIState),
+        VMSTATE_FIFO8(tx_fifo, S5L8702SPIState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void S5L8702_spi_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = S5L8702_spi_realize;
     dc->reset = S5L8702_spi_reset;
+    dc->vmsd = &vmstate_S5L8702_spi;
 }
 
 static const TypeInfo S5L8702_spi_info = {
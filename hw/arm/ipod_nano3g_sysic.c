@@ -1,4 +1,5 @@
 #include "hw/arm/ipod_nano3g_sysic.h"
+#include "migration/vmstate.h"
 
 static uint64_t ipod_nano3g_sysic_read(void *opaque, hwaddr addr, unsigned size)
 {
@@ -106,9 +107,25 @@ static void ipod_nano3g_sysic_init(Object *obj)
     }
 }
 
+static const VMStateDescription vmstate_ipod_nano3g_sysic = {
+    .name = TYPE_IPOD_NANO3G_SYSIC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(power_state, IPodNano3GSYSICState),
+        VMSTATE_UINT32_ARRAY(gpio_int_level, IPodNano3GSYSICState, GPIO_NUMINTGROUPS),
+        VMSTATE_UINT32_ARRAY(gpio_int_status, IPodNano3GSYSICState, GPIO_NUMINTGROUPS),
+        VMSTATE_UINT32_ARRAY(gpio_int_enabled, IPodNano3GSYSICState, GPIO_NUMINTGROUPS),
+        VMSTATE_UINT32_ARRAY(gpio_int_type, IPodNano3GSYSICState, GPIO_NUMINTGROUPS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void ipod_nano3g_sysic_class_init(ObjectClass *klass, void *data)
 {
-    
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->vmsd = &vmstate_ipod_nano3g_sysic;
 }
 
 static const TypeInfo ipod_nano3g_sysic_type_info = {
@@ -1,38 +1,135 @@
 #include "hw/arm/ipod_nano3g_timer.h"
+#include "hw/qdev-clock.h"
+#include "qemu/log.h"
+#include "migration/vmstate.h"
 
-static void S5L8702_st_update(IPodNano3GTimerState *s)
+// the divider select picks 1/2, 1/4, 1/16 or 1/64 of the input clock
+static const unsigned int timer_divider_shift[TIMER_CONFIG_DIVIDER_MASK + 1] = {
+    1, 2, 4, 6, 0, 0, 0, 0,
+};
+
+// channels 0-3 sit at 0x00-0x60 and 4-6 at 0xA0-0xE0, with the tick counter in between
+static IPodNano3GTimerChannel *S5L8702_timer_channel(IPodNano3GTimerState *s, hwaddr addr)
 {
-    s->freq_out = 1000000000 / 100; 
-    s->tick_interval = /* bcount1 * get_ticks / freq  + ((bcount2 * get_ticks / freq)*/
-    muldiv64((s->bcount1 < 1000) ? 1000 : s->bcount1, NANOSECONDS_PER_SECOND, s->freq_out);
-    s->next_planned_tick = 0;
+    int block = addr / TIMER_CHANNEL_SIZE;
+
+    if (block < 4) {
+        return &s->channels[block];
+    }
+    if (block > 4 && block <= NUM_TIMERS) {
+        return &s->channels[block - 1];
+    }
+    return NULL;
 }
 
-static void S5L8702_st_set_timer(IPodNano3GTimerState *s)
+static Clock *S5L8702_timer_channel_clock(IPodNano3GTimerChannel *ch)
 {
-    uint64_t last = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - s->base_time;
+    return (ch->config & TIMER_CONFIG_CLKSEL_ECLK) ? ch->s->eclk : ch->s->pclk;
+}
+
+// must be called within a ptimer transaction
+static void S5L8702_timer_update_freq(IPodNano3GTimerChannel *ch)
+{
+    Clock *clk = S5L8702_timer_channel_clock(ch);
+    uint32_t cs = (ch->config >> TIMER_CONFIG_DIVIDER_SHIFT) & TIMER_CONFIG_DIVIDER_MASK;
+    bool was_gated = ch->gated;
 
-    s->next_planned_tick = last + (s->tick_interval - last % s->tick_interval);
-    timer_mod(s->st_timer, s->next_planned_tick + s->base_time);
-    s->last_tick = last;
+    // a gated channel keeps its count but schedules nothing until its clock is back
+    ch->gated = !clock_is_enabled(clk);
+    if (ch->gated) {
+        ptimer_stop(ch->ptimer);
+        return;
+    }
+
+    ptimer_set_period_from_clock(ch->ptimer, clk, (ch->prescaler + 1) << timer_divider_shift[cs]);
+    if (was_gated && (ch->status & TIMER_STATE_START)) {
+        ptimer_run(ch->ptimer, !!(ch->status & TIMER_STATE_MANUALUPDATE));
+    }
+}
+
+static void S5L8702_timer_clk_update(void *opaque, ClockEvent event)
+{
+    IPodNano3GTimerState *s = (struct IPodNano3GTimerState *) opaque;
+
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        ptimer_transaction_begin(s->channels[i].ptimer);
+        S5L8702_timer_update_freq(&s->channels[i]);
+        ptimer_transaction_commit(s->channels[i].ptimer);
+    }
 }
 
 static void S5L8702_st_tick(void *opaque)
 {
-    IPodNano3GTimerState *s = (IPodNano3GTimerState *)opaque;
+    IPodNano3GTimerChannel *ch = opaque;
 
-    if (s->status & TIMER_STATE_START) {
-        //fprintf(stderr, "%s: Raising irq\n", __func__);
-        qemu_irq_raise(s->irq);
+    // the interrupt enable and status bits are unknown, the other channels count silently
+    if (ch == &ch->s->channels[TIMER_IRQ_CHANNEL]) {
+        qemu_irq_raise(ch->s->irq);
+    }
+}
+
+static void S5L8702_timer_channel_write(IPodNano3GTimerChannel *ch, hwaddr addr, uint32_t value)
+{
+    ptimer_transaction_begin(ch->ptimer);
+    switch (addr) {
+        case TIMER_CONFIG:
+            ch->config = value;
+            S5L8702_timer_update_freq(ch);
+            break;
+        case TIMER_STATE:
+            if (value & TIMER_STATE_MANUALUPDATE) {
+                ptimer_set_limit(ch->ptimer, ch->bcount1, 1);
+            }
+            if (value & TIMER_STATE_START) {
+                if (!(ch->status & TIMER_STATE_START)) {
+                    ptimer_set_limit(ch->ptimer, ch->bcount1, 1);
+                }
+                // started together with a manual update the channel fires only once, as it always has
+                if (!ch->gated) {
+                    ptimer_run(ch->ptimer, !!(value & TIMER_STATE_MANUALUPDATE));
+                }
+            } else {
+                ptimer_stop(ch->ptimer);
+            }
+            ch->status = value;
+            break;
+        case TIMER_COUNT_BUFFER:
+            ch->bcount1 = value;
+            // takes effect on the next reload
+            ptimer_set_limit(ch->ptimer, value, 0);
+            break;
+        case TIMER_COUNT_BUFFER2:
+            ch->bcount2 = value;
+            break;
+        case TIMER_PRESCALER:
+            ch->prescaler = value & TIMER_PRESCALER_MASK;
+            S5L8702_timer_update_freq(ch);
+            break;
+        default:
+            qemu_log_mask(LOG_GUEST_ERROR, "%s: write to read-only offset 0x%02x\n", __func__, (uint32_t)addr);
+            break;
+    }
+    ptimer_transaction_commit(ch->ptimer);
+}
 
-        /* schedule next interrupt */
-        if(!(s->status & TIMER_STATE_MANUALUPDATE)) {
-            S5L8702_st_set_timer(s);
-        }
-    } else {
-        s->next_planned_tick = 0;
-        s->last_tick = 0;
-        timer_del(s->st_timer);
+static uint32_t S5L8702_timer_channel_read(IPodNano3GTimerChannel *ch, hwaddr addr)
+{
+    switch (addr) {
+        case TIMER_CONFIG:
+            return ch->config;
+        case TIMER_STATE:
+            return ch->status;
+        case TIMER_COUNT_BUFFER:
+            return ch->bcount1;
+        case TIMER_COUNT_BUFFER2:
+            return ch->bcount2;
+        case TIMER_PRESCALER:
+            return ch->prescaler;
+        case TIMER_COUNT:
+            // computed from the virtual clock, no host timer involved
+            return ptimer_get_count(ch->ptimer);
+        default:
+            return 0;
     }
 }
 
@@ -40,6 +137,7 @@ static void S5L8702_timer1_write(void *opaque, hwaddr addr, uint64_t value, unsi
 {
     //fprintf(stderr, "%s: writing 0x%08x to 0x%08x\n", __func__, value, addr);
     IPodNano3GTimerState *s = (struct IPodNano3GTimerState *) opaque;
+    IPodNano3GTimerChannel *ch;
 
     switch(addr){
 
@@ -50,48 +148,35 @@ static void S5L8702_timer1_write(void *opaque, hwaddr addr, uint64_t value, unsi
             //fprintf(stderr, "%s: lowering irq\n", __func__);
             qemu_irq_lower(s->irq);     
             return;
-        case TIMER_4 + TIMER_CONFIG:
-            S5L8702_st_update(s);
-            s->config = value;
-            break;
-        case TIMER_4 + TIMER_STATE:
-            if (value & TIMER_STATE_START) {
-                s->base_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-                S5L8702_st_update(s);
-                S5L8702_st_set_timer(s);
-            } else if (value == TIMER_STATE_STOP) {
-                timer_del(s->st_timer);
-            }
-            s->status = value;
-            break;
-        case TIMER_4 + TIMER_COUNT_BUFFER:
-            s->bcount1 = s->bcreload = value;
-            break;
-        case TIMER_4 + TIMER_COUNT_BUFFER2:
-            s->bcount2 = value;
-            break;
       default:
         break;
     }
+
+    ch = S5L8702_timer_channel(s, addr);
+    if (ch) {
+        S5L8702_timer_channel_write(ch, addr % TIMER_CHANNEL_SIZE, value);
+    }
 }
 
 static uint64_t S5L8702_timer1_read(void *opaque, hwaddr addr, unsigned size)
 {
     // fprintf(stderr, "%s: read from location 0x%08x\n", __func__, addr);
     IPodNano3GTimerState *s = (struct IPodNano3GTimerState *) opaque;
+    IPodNano3GTimerChannel *ch;
     uint64_t elapsed_ns, ticks;
 
     switch (addr) {
-        case TIMER_TICKSLOW:    // needs to be fixed so that read from low first works as well
+        case TIMER_TICKSLOW:    // overlaps the count of channel 4, which the firmware never reads
 
             elapsed_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) / 2; // the timer ticks twice as slow as the CPU frequency in the kernel
-            ticks = clock_ns_to_ticks(s->sysclk, elapsed_ns);
+            ticks = clock_ns_to_ticks(s->eclk, elapsed_ns);
             // printf("TICKS: %lld\n", ticks);
             s->ticks_high = (ticks >> 32);
             s->ticks_low = (ticks & 0xFFFFFFFF);
             return s->ticks_low;
-        // case TIMER_TICKSLOW:
-        //     return s->ticks_low;
+        case TIMER_TICKSHIGH:
+            // latched by the last read of the low word
+            return s->ticks_high;
         case TIMER_IRQSTAT:
             return ~0; // s->irqstat;
         case TIMER_IRQLATCH:
@@ -100,6 +185,11 @@ static uint64_t S5L8702_timer1_read(void *opaque, hwaddr addr, unsigned size)
       default:
         break;
     }
+
+    ch = S5L8702_timer_channel(s, addr);
+    if (ch) {
+        return S5L8702_timer_channel_read(ch, addr % TIMER_CHANNEL_SIZE);
+    }
     return 0;
 }
 
@@ -118,13 +208,88 @@ static void S5L8702_timer_init(Object *obj)
     memory_region_init_io(&s->iomem, obj, &timer1_ops, s, "timer1", 0x10001);
     sysbus_init_irq(sbd, &s->irq);
 
-    s->base_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-    s->st_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, S5L8702_st_tick, s);
+    s->pclk = qdev_init_clock_in(dev, "pclk", S5L8702_timer_clk_update, s, ClockUpdate);
+    s->eclk = qdev_init_clock_in(dev, "eclk", S5L8702_timer_clk_update, s, ClockUpdate);
+
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        s->channels[i].s = s;
+        s->channels[i].ptimer = ptimer_init(S5L8702_st_tick, &s->channels[i],
+                                            PTIMER_POLICY_NO_IMMEDIATE_TRIGGER |
+                                            PTIMER_POLICY_NO_COUNTER_ROUND_DOWN);
+    }
 }
 
+static void S5L8702_timer_reset(DeviceState *dev)
+{
+    IPodNano3GTimerState *s = IPOD_NANO3G_TIMER(dev);
+
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        IPodNano3GTimerChannel *ch = &s->channels[i];
+
+        ch->config = 0;
+        ch->status = TIMER_STATE_STOP;
+        ch->bcount1 = 0;
+        ch->bcount2 = 0;
+        ch->prescaler = 0;
+        ptimer_transaction_begin(ch->ptimer);
+        ptimer_stop(ch->ptimer);
+        ptimer_set_limit(ch->ptimer, 0, 1);
+        S5L8702_timer_update_freq(ch);
+        ptimer_transaction_commit(ch->ptimer);
+    }
+    s->ticks_high = 0;
+    s->ticks_low = 0;
+    s->irqstat = 0;
+}
+
+static int S5L8702_timer_post_load(void *opaque, int version_id)
+{
+    IPodNano3GTimerState *s = opaque;
+
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        s->channels[i].gated = !clock_is_enabled(S5L8702_timer_channel_clock(&s->channels[i]));
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_ipod_nano3g_timer_channel = {
+    .name = TYPE_IPOD_NANO3G_TIMER "-channel",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_PTIMER(ptimer, IPodNano3GTimerChannel),
+        VMSTATE_UINT32(config, IPodNano3GTimerChannel),
+        VMSTATE_UINT32(status, IPodNano3GTimerChannel),
+        VMSTATE_UINT32(bcount1, IPodNano3GTimerChannel),
+        VMSTATE_UINT32(bcount2, IPodNano3GTimerChannel),
+        VMSTATE_UINT32(prescaler, IPodNano3GTimerChannel),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_ipod_nano3g_timer = {
+    .name = TYPE_IPOD_NANO3G_TIMER,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = S5L8702_timer_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(channels, IPodNano3GTimerState, NUM_TIMERS, 1,
+                             vmstate_ipod_nano3g_timer_channel, IPodNano3GTimerChannel),
+        VMSTATE_UINT32(ticks_high, IPodNano3GTimerState),
+        VMSTATE_UINT32(ticks_low, IPodNano3GTimerState),
+        VMSTATE_UINT32(irqstat, IPodNano3GTimerState),
+        VMSTATE_CLOCK(pclk, IPodNano3GTimerState),
+        VMSTATE_CLOCK(eclk, IPodNano3GTimerState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void S5L8702_timer_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
 
+    dc->reset = S5L8702_timer_reset;
+    dc->vmsd = &vmstate_ipod_nano3g_timer;
 }
 
 static const TypeInfo ipod_nano3g_timer_info = {
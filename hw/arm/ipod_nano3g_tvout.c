@@ -1,5 +1,6 @@
 #include "hw/arm/ipod_nano3g_tvout.h"
 #include "qapi/error.h"
+#include "migration/vmstate.h"
 
 static uint64_t ipod_nano3g_tvout_read(void *opaque, hwaddr offset, unsigned size)
 {
@@ -47,9 +48,21 @@ static void ipod_nano3g_tvout_init(Object *obj)
     sysbus_init_irq(sbd, &s->irq);
 }
 
+static const VMStateDescription vmstate_ipod_nano3g_tvout = {
+    .name = TYPE_IPOD_NANO3G_TVOUT,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(data, IPodNano3GTVOutState, 4096),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void ipod_nano3g_tvout_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
 
+    dc->vmsd = &vmstate_ipod_nano3g_tvout;
 }
 
 static const TypeInfo ipod_nano3g_tvout_type_info = {
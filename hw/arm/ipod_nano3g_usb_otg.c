@@ -21,7 +21,12 @@
 #include "hw/platform-bus.h"
 #include "qapi/error.h"
 #include "hw/hw.h"
+#include "migration/vmstate.h"
+#include "hw/qdev-properties.h"
+#include "hw/qdev-properties-system.h"
+#include "qemu/log.h"
 #include "hw/arm/ipod_nano3g_usb_otg.h"
+#include "trace.h"
 
 static inline size_t synopsys_usb_tx_fifo_start(synopsys_usb_state *_state, uint32_t _fifo)
 {
@@ -74,6 +79,291 @@ static void synopsys_usb_update_irq(synopsys_usb_state *_state)
 		qemu_irq_lower(_state->irq);
 }
 
+// Gadget bridge
+//
+// The host side of the bus lives behind the "chardev" backend and talks in
+// synopsys_usb_gadget_hdr frames. Only one frame is received at a time: it
+// waits in rx_buf until the guest arms the endpoint it is addressed to, and
+// the chardev is not read any further in the meantime. Data goes straight
+// between the frame and the endpoint's DMA buffer in guest memory, a whole
+// DIEPTSIZ/DOEPTSIZ transfer per copy; the FIFOs are not involved, so only
+// the DMA mode the firmware uses (GAHBCFG_DMAEN) is supported.
+
+static void synopsys_usb_gadget_send(synopsys_usb_state *_state, uint8_t _type, uint8_t _ep,
+		uint32_t _length, const uint8_t *_data, uint32_t _data_len)
+{
+	synopsys_usb_gadget_hdr hdr = {
+		.type = _type,
+		.ep = _ep,
+		.length = cpu_to_le32(_length),
+	};
+
+	trace_ipod_nano3g_usb_gadget_tx(_type, _ep, _length);
+	qemu_chr_fe_write_all(&_state->chr, (uint8_t *)&hdr, sizeof(hdr));
+	if(_data_len)
+		qemu_chr_fe_write_all(&_state->chr, _data, _data_len);
+}
+
+static uint32_t synopsys_usb_ep_mps(uint8_t _ep, uint32_t _control)
+{
+	// EP0 encodes 64, 32, 16 or 8 bytes in two bits
+	if(_ep == USB_CONTROLEP)
+		return 64 >> (_control & 3);
+
+	return MAX(_control & USB_EPCON_MPS_MASK, 1);
+}
+
+static uint32_t synopsys_usb_ep_xfersize(synopsys_usb_ep_state *_eps, uint8_t _ep)
+{
+	return _eps->tx_size & (_ep == USB_CONTROLEP ? DEPTSIZ0_XFERSIZ_MASK : DEPTSIZ_XFERSIZ_MASK);
+}
+
+// Account for _len bytes moved by DMA, returns true once the transfer is complete
+static bool synopsys_usb_ep_advance(synopsys_usb_ep_state *_eps, uint8_t _ep, uint32_t _len, bool _short)
+{
+	uint32_t xfermask = (_ep == USB_CONTROLEP) ? DEPTSIZ0_XFERSIZ_MASK : DEPTSIZ_XFERSIZ_MASK;
+	uint32_t xfersize = _eps->tx_size & xfermask;
+	uint32_t pktcnt = (_eps->tx_size >> DEPTSIZ_PKTCNT_SHIFT) & DEPTSIZ_PKTCNT_MASK;
+	uint32_t packets = _len ? DIV_ROUND_UP(_len, synopsys_usb_ep_mps(_ep, _eps->control)) : 1;
+
+	xfersize -= MIN(_len, xfersize);
+	pktcnt -= MIN(packets, pktcnt);
+	_eps->tx_size &=~ (xfermask | (DEPTSIZ_PKTCNT_MASK << DEPTSIZ_PKTCNT_SHIFT));
+	_eps->tx_size |= xfersize | (pktcnt << DEPTSIZ_PKTCNT_SHIFT);
+	_eps->dma_address += _len;
+
+	if(xfersize && !_short)
+		return false;
+
+	_eps->control &=~ USB_EPCON_ENABLE;
+	_eps->interrupt_status |= USB_EPINT_XferCompl;
+	return true;
+}
+
+static bool synopsys_usb_gadget_setup(synopsys_usb_state *_state, const uint8_t *_data, uint32_t _len)
+{
+	synopsys_usb_ep_state *eps = &_state->out_eps[USB_CONTROLEP];
+	uint32_t supcnt;
+
+	if(_len != 8)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "usb_synopsys: %u byte SETUP packet dropped\n", _len);
+		return true;
+	}
+
+	if(!(eps->control & USB_EPCON_ENABLE))
+		return false;
+
+	address_space_write(&_state->dma_as, eps->dma_address, MEMTXATTRS_UNSPECIFIED, _data, _len);
+	eps->dma_address += _len;
+
+	supcnt = (eps->tx_size >> DOEPTSIZ0_SUPCNT_SHIFT) & DOEPTSIZ0_SUPCNT_MASK;
+	if(supcnt)
+	{
+		eps->tx_size &=~ (DOEPTSIZ0_SUPCNT_MASK << DOEPTSIZ0_SUPCNT_SHIFT);
+		eps->tx_size |= (supcnt - 1) << DOEPTSIZ0_SUPCNT_SHIFT;
+	}
+
+	eps->control &=~ USB_EPCON_ENABLE;
+	eps->interrupt_status |= USB_EPINT_SetUp | USB_EPINT_XferCompl;
+	synopsys_usb_gadget_send(_state, USB_GADGET_OUT_DONE, USB_CONTROLEP, _len, NULL, 0);
+	return true;
+}
+
+static bool synopsys_usb_gadget_out(synopsys_usb_state *_state, uint8_t _ep, const uint8_t *_data, uint32_t _len)
+{
+	synopsys_usb_ep_state *eps = &_state->out_eps[_ep];
+	uint32_t left = _len - _state->rx_pos;
+	uint32_t chunk;
+
+	if(!(eps->control & USB_EPCON_ENABLE))
+		return false;
+
+	chunk = MIN(left, synopsys_usb_ep_xfersize(eps, _ep));
+	address_space_write(&_state->dma_as, eps->dma_address, MEMTXATTRS_UNSPECIFIED,
+			_data + _state->rx_pos, chunk);
+	_state->rx_pos += chunk;
+
+	// The end of the frame ends the host's transfer, like a short packet
+	synopsys_usb_ep_advance(eps, _ep, chunk, chunk == left);
+	if(chunk < left)
+		return false;
+
+	synopsys_usb_gadget_send(_state, USB_GADGET_OUT_DONE, _ep, _len, NULL, 0);
+	return true;
+}
+
+static bool synopsys_usb_gadget_in(synopsys_usb_state *_state, uint8_t _ep, uint32_t _len)
+{
+	synopsys_usb_ep_state *eps = &_state->in_eps[_ep];
+	uint32_t chunk;
+
+	if(!(eps->control & USB_EPCON_ENABLE))
+		return false;
+
+	// the frame buffer is free while an IN token is handled, it has no payload
+	chunk = MIN(MIN(_len, synopsys_usb_ep_xfersize(eps, _ep)), USB_GADGET_MAX_PAYLOAD);
+	address_space_read(&_state->dma_as, eps->dma_address, MEMTXATTRS_UNSPECIFIED,
+			_state->rx_buf + sizeof(synopsys_usb_gadget_hdr), chunk);
+	synopsys_usb_gadget_send(_state, USB_GADGET_IN_DATA, _ep, chunk,
+			_state->rx_buf + sizeof(synopsys_usb_gadget_hdr), chunk);
+	synopsys_usb_ep_advance(eps, _ep, chunk, false);
+	return true;
+}
+
+// Returns true when the frame in rx_buf is done with
+static bool synopsys_usb_gadget_process(synopsys_usb_state *_state)
+{
+	synopsys_usb_gadget_hdr *hdr = (synopsys_usb_gadget_hdr *)_state->rx_buf;
+	const uint8_t *data = _state->rx_buf + sizeof(*hdr);
+	uint32_t length = le32_to_cpu(hdr->length);
+	synopsys_usb_ep_state *eps;
+
+	if(hdr->type == USB_GADGET_RESET)
+	{
+		_state->dsts = USB_HIGHSPEED << 1;
+		_state->gotgctl |= GOTGCTL_BSESSIONVALID;
+		_state->gintsts |= GINTMSK_RESET | GINTMSK_ENUMDONE;
+		return true;
+	}
+
+	if(hdr->ep >= USB_NUM_ENDPOINTS)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "usb_synopsys: gadget frame for EP %d dropped\n", hdr->ep);
+		return true;
+	}
+
+	if(!(_state->gahbcfg & GAHBCFG_DMAEN))
+	{
+		qemu_log_mask(LOG_UNIMP, "usb_synopsys: gadget bridge needs DMA mode\n");
+		return false;
+	}
+
+	eps = (hdr->type == USB_GADGET_IN) ? &_state->in_eps[hdr->ep] : &_state->out_eps[hdr->ep];
+	if(hdr->type != USB_GADGET_SETUP && (eps->control & USB_EPCON_STALL))
+	{
+		synopsys_usb_gadget_send(_state, USB_GADGET_STALL, hdr->ep, 0, NULL, 0);
+		return true;
+	}
+
+	switch(hdr->type)
+	{
+	case USB_GADGET_SETUP:
+		return synopsys_usb_gadget_setup(_state, data, length);
+
+	case USB_GADGET_OUT:
+		return synopsys_usb_gadget_out(_state, hdr->ep, data, length);
+
+	case USB_GADGET_IN:
+		return synopsys_usb_gadget_in(_state, hdr->ep, length);
+
+	default:
+		qemu_log_mask(LOG_GUEST_ERROR, "usb_synopsys: unknown gadget frame type %d\n", hdr->type);
+		return true;
+	}
+}
+
+static bool synopsys_usb_gadget_has_payload(synopsys_usb_gadget_hdr *_hdr)
+{
+	return _hdr->type == USB_GADGET_OUT || _hdr->type == USB_GADGET_SETUP;
+}
+
+// The header's length must have been checked against USB_GADGET_MAX_PAYLOAD
+static uint32_t synopsys_usb_gadget_frame_len(synopsys_usb_state *_state)
+{
+	synopsys_usb_gadget_hdr *hdr = (synopsys_usb_gadget_hdr *)_state->rx_buf;
+
+	if(_state->rx_len < sizeof(*hdr))
+		return sizeof(*hdr);
+
+	if(synopsys_usb_gadget_has_payload(hdr))
+		return sizeof(*hdr) + le32_to_cpu(hdr->length);
+
+	return sizeof(*hdr);
+}
+
+static bool synopsys_usb_gadget_frame_complete(synopsys_usb_state *_state)
+{
+	return _state->rx_len >= sizeof(synopsys_usb_gadget_hdr)
+		&& _state->rx_len == synopsys_usb_gadget_frame_len(_state);
+}
+
+// Retry the pending frame, e.g. after the guest armed an endpoint
+static void synopsys_usb_gadget_kick(synopsys_usb_state *_state)
+{
+	if(!synopsys_usb_gadget_frame_complete(_state))
+		return;
+
+	if(synopsys_usb_gadget_process(_state))
+	{
+		_state->rx_len = 0;
+		_state->rx_pos = 0;
+		qemu_chr_fe_accept_input(&_state->chr);
+	}
+
+	synopsys_usb_update_irq(_state);
+}
+
+static int synopsys_usb_gadget_can_receive(void *opaque)
+{
+	synopsys_usb_state *state = (synopsys_usb_state *)opaque;
+
+	if(synopsys_usb_gadget_frame_complete(state))
+		return 0;
+
+	return synopsys_usb_gadget_frame_len(state) - state->rx_len;
+}
+
+static void synopsys_usb_gadget_receive(void *opaque, const uint8_t *_buf, int _size)
+{
+	synopsys_usb_state *state = (synopsys_usb_state *)opaque;
+	synopsys_usb_gadget_hdr *hdr = (synopsys_usb_gadget_hdr *)state->rx_buf;
+
+	memcpy(state->rx_buf + state->rx_len, _buf, _size);
+	state->rx_len += _size;
+
+	if(state->rx_len == sizeof(*hdr))
+	{
+		trace_ipod_nano3g_usb_gadget_rx(hdr->type, hdr->ep, le32_to_cpu(hdr->length));
+		// compared before adding the header, which could wrap around
+		if(synopsys_usb_gadget_has_payload(hdr) && le32_to_cpu(hdr->length) > USB_GADGET_MAX_PAYLOAD)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "usb_synopsys: %u byte gadget frame too large, disconnecting\n",
+					le32_to_cpu(hdr->length));
+			state->rx_len = 0;
+			qemu_chr_fe_disconnect(&state->chr);
+			return;
+		}
+	}
+
+	synopsys_usb_gadget_kick(state);
+}
+
+static void synopsys_usb_gadget_event(void *opaque, QEMUChrEvent _event)
+{
+	synopsys_usb_state *state = (synopsys_usb_state *)opaque;
+
+	switch(_event)
+	{
+	case CHR_EVENT_OPENED:
+		state->gotgctl |= GOTGCTL_BSESSIONVALID;
+		break;
+
+	case CHR_EVENT_CLOSED:
+		state->rx_len = 0;
+		state->rx_pos = 0;
+		state->gotgctl &=~ GOTGCTL_BSESSIONVALID;
+		state->gotgint |= GOTGINT_SESENDDET;
+		state->gintsts |= GINTMSK_DISCONNECT;
+		break;
+
+	default:
+		return;
+	}
+
+	synopsys_usb_update_irq(state);
+}
+
 static void synopsys_usb_update_ep(synopsys_usb_state *_state, synopsys_usb_ep_state *_ep)
 {
 	if(_ep->control & USB_EPCON_SETNAK)
@@ -96,7 +386,7 @@ static void synopsys_usb_update_in_ep(synopsys_usb_state *_state, uint8_t _ep)
 	synopsys_usb_update_ep(_state, eps);
 
 	if(eps->control & USB_EPCON_ENABLE)
-		;//printf("USB: IN transfer queued on %d.\n", _ep);
+		synopsys_usb_gadget_kick(_state);
 }
 
 static void synopsys_usb_update_out_ep(synopsys_usb_state *_state, uint8_t _ep)
@@ -105,7 +395,7 @@ static void synopsys_usb_update_out_ep(synopsys_usb_state *_state, uint8_t _ep)
 	synopsys_usb_update_ep(_state, eps);
 
 	if(eps->control & USB_EPCON_ENABLE)
-		;//printf("USB: OUT transfer queued on %d.\n", _ep);
+		synopsys_usb_gadget_kick(_state);
 }
 
 static uint32_t synopsys_usb_in_ep_read(synopsys_usb_state *_state, uint8_t _ep, hwaddr _addr)
@@ -379,21 +669,8 @@ static void synopsys_usb_write(void *opaque, hwaddr _addr, uint64_t _val, unsign
 		{
 			state->grstctl = GRSTCTL_CORESOFTRESET;
 
-			// Do reset stuff
-			// if(state->server_host)
-			// {
-			// 	tcp_usb_cleanup(&state->tcp_state);
-			// 	tcp_usb_init(&state->tcp_state, synopsys_usb_tcp_callback, NULL, state);
-
-			// 	printf("Connecting to USB server at %s:%d...\n",
-			// 			state->server_host, state->server_port);
-
-			// 	int ret = tcp_usb_connect(&state->tcp_state, state->server_host, state->server_port);
-			// 	if(ret < 0)
-			// 		hw_error("Failed to connect to USB server (%d).\n", ret);
-
-			// 	printf("Connected to USB server.\n");
-			// }
+			// The gadget connection outlives core resets, the host
+			// side sends USB_GADGET_RESET when it re-enumerates
 
 			state->grstctl &= ~GRSTCTL_CORESOFTRESET;
 			state->grstctl |= GRSTCTL_AHBIDLE;
@@ -567,6 +844,23 @@ static void S5L8702_usb_otg_reset(DeviceState *d)
 	synopsys_usb_update_irq(state);
 }
 
+static void S5L8702_usb_otg_realize(DeviceState *dev, Error **errp)
+{
+	synopsys_usb_state *state = S5L8702USBOTG(dev);
+
+	if(!state->downstream)
+	{
+		error_setg(errp, "usb_synopsys 'downstream' link not set");
+		return;
+	}
+
+	address_space_init(&state->dma_as, state->downstream, "usb_otg-dma");
+	state->rx_buf = g_malloc(sizeof(synopsys_usb_gadget_hdr) + USB_GADGET_MAX_PAYLOAD);
+	qemu_chr_fe_set_handlers(&state->chr, synopsys_usb_gadget_can_receive,
+			synopsys_usb_gadget_receive, synopsys_usb_gadget_event, NULL,
+			state, NULL, true);
+}
+
 static void S5L8702_usb_otg_init1(Object *obj)
 {
 	DeviceState *dev = DEVICE(obj);
@@ -579,11 +873,13 @@ static void S5L8702_usb_otg_init1(Object *obj)
 }
 
 // Helper for adding to a machine
-DeviceState *ipod_nano3g_init_usb_otg(qemu_irq _irq, uint32_t _hwcfg[4])
+DeviceState *ipod_nano3g_init_usb_otg(qemu_irq _irq, uint32_t _hwcfg[4], MemoryRegion *_downstream)
 {
 	DeviceState *dev = qdev_new(TYPE_S5L8702USBOTG);
 	synopsys_usb_state *state = S5L8702USBOTG(dev);
 
+	object_property_set_link(OBJECT(dev), "downstream", OBJECT(_downstream), &error_fatal);
+
 	state->ghwcfg1 = _hwcfg[0];
 	state->ghwcfg2 = _hwcfg[1];
 	state->ghwcfg3 = _hwcfg[2];
@@ -591,14 +887,107 @@ DeviceState *ipod_nano3g_init_usb_otg(qemu_irq _irq, uint32_t _hwcfg[4])
 
 	SysBusDevice *sdev = SYS_BUS_DEVICE(dev);
     sysbus_connect_irq(sdev, 0, _irq);
+    sysbus_realize(sdev, &error_fatal);
 
     return dev;
 }
 
+static const VMStateDescription vmstate_synopsys_usb_ep = {
+	.name = "synopsys_usb_ep",
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.fields = (VMStateField[]) {
+		VMSTATE_UINT32(control, synopsys_usb_ep_state),
+		VMSTATE_UINT32(tx_size, synopsys_usb_ep_state),
+		VMSTATE_UINT32(fifo, synopsys_usb_ep_state),
+		VMSTATE_UINT32(interrupt_status, synopsys_usb_ep_state),
+		VMSTATE_UINT64(dma_address, synopsys_usb_ep_state),
+		VMSTATE_UINT64(dma_buffer, synopsys_usb_ep_state),
+		VMSTATE_END_OF_LIST()
+	}
+};
+
+// rx_len sizes rx_buf on load, so it is checked before the buffer is read
+static bool S5L8702_usb_otg_rx_len_valid(void *opaque, int version_id)
+{
+	synopsys_usb_state *state = (synopsys_usb_state *)opaque;
+
+	return state->rx_len <= sizeof(synopsys_usb_gadget_hdr) + USB_GADGET_MAX_PAYLOAD
+		&& state->rx_pos <= state->rx_len;
+}
+
+static int S5L8702_usb_otg_post_load(void *opaque, int version_id)
+{
+	synopsys_usb_state *state = (synopsys_usb_state *)opaque;
+	synopsys_usb_gadget_hdr *hdr = (synopsys_usb_gadget_hdr *)state->rx_buf;
+
+	if(state->rx_len < sizeof(*hdr))
+		return 0;
+
+	if(synopsys_usb_gadget_has_payload(hdr) && le32_to_cpu(hdr->length) > USB_GADGET_MAX_PAYLOAD)
+		return -EINVAL;
+
+	if(state->rx_len > synopsys_usb_gadget_frame_len(state))
+		return -EINVAL;
+
+	return 0;
+}
+
+static const VMStateDescription vmstate_S5L8702_usb_otg = {
+	.name = TYPE_S5L8702USBOTG,
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.post_load = S5L8702_usb_otg_post_load,
+	.fields = (VMStateField[]) {
+		VMSTATE_UINT32(pcgcctl, synopsys_usb_state),
+		VMSTATE_UINT32(ghwcfg1, synopsys_usb_state),
+		VMSTATE_UINT32(ghwcfg2, synopsys_usb_state),
+		VMSTATE_UINT32(ghwcfg3, synopsys_usb_state),
+		VMSTATE_UINT32(ghwcfg4, synopsys_usb_state),
+		VMSTATE_UINT32(gahbcfg, synopsys_usb_state),
+		VMSTATE_UINT32(gusbcfg, synopsys_usb_state),
+		VMSTATE_UINT32(grxfsiz, synopsys_usb_state),
+		VMSTATE_UINT32(gnptxfsiz, synopsys_usb_state),
+		VMSTATE_UINT32(gotgctl, synopsys_usb_state),
+		VMSTATE_UINT32(gotgint, synopsys_usb_state),
+		VMSTATE_UINT32(grstctl, synopsys_usb_state),
+		VMSTATE_UINT32(gintmsk, synopsys_usb_state),
+		VMSTATE_UINT32(gintsts, synopsys_usb_state),
+		VMSTATE_UINT32_ARRAY(dptxfsiz, synopsys_usb_state, USB_NUM_FIFOS),
+		VMSTATE_UINT32(dctl, synopsys_usb_state),
+		VMSTATE_UINT32(dcfg, synopsys_usb_state),
+		VMSTATE_UINT32(dsts, synopsys_usb_state),
+		VMSTATE_UINT32(daintmsk, synopsys_usb_state),
+		VMSTATE_UINT32(daintsts, synopsys_usb_state),
+		VMSTATE_UINT32(diepmsk, synopsys_usb_state),
+		VMSTATE_UINT32(doepmsk, synopsys_usb_state),
+		VMSTATE_STRUCT_ARRAY(in_eps, synopsys_usb_state, USB_NUM_ENDPOINTS, 1,
+				vmstate_synopsys_usb_ep, synopsys_usb_ep_state),
+		VMSTATE_STRUCT_ARRAY(out_eps, synopsys_usb_state, USB_NUM_ENDPOINTS, 1,
+				vmstate_synopsys_usb_ep, synopsys_usb_ep_state),
+		VMSTATE_UINT8_ARRAY(fifos, synopsys_usb_state, 0x100 * (USB_NUM_FIFOS+1)),
+		VMSTATE_UINT32(rx_len, synopsys_usb_state),
+		VMSTATE_UINT32(rx_pos, synopsys_usb_state),
+		VMSTATE_VALIDATE("rx_len in range", S5L8702_usb_otg_rx_len_valid),
+		VMSTATE_VBUFFER_UINT32(rx_buf, synopsys_usb_state, 0, NULL, rx_len),
+		VMSTATE_END_OF_LIST()
+	}
+};
+
+static Property S5L8702_usb_otg_properties[] = {
+	DEFINE_PROP_CHR("chardev", synopsys_usb_state, chr),
+	DEFINE_PROP_LINK("downstream", synopsys_usb_state, downstream,
+			TYPE_MEMORY_REGION, MemoryRegion *),
+	DEFINE_PROP_END_OF_LIST(),
+};
+
 static void S5L8702_usb_otg_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
+    dc->realize = S5L8702_usb_otg_realize;
     dc->reset = S5L8702_usb_otg_reset;
+    device_class_set_props(dc, S5L8702_usb_otg_properties);
+    dc->vmsd = &vmstate_S5L8702_usb_otg;
 }
 
 static const TypeInfo S5L8702_usb_otg_info = {
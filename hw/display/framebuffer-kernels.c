@@ -0,0 +1,336 @@
+/*
+ * Framebuffer pixel format conversion line kernels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "ui/console.h"
+#include "ui/pixel_ops.h"
+#include "framebuffer.h"
+
+/* Pixel format conversion line kernels.
+ *
+ * The 16-bit formats are expanded the way the device models always have,
+ * by shifting each channel up without replicating its high bits.  Every
+ * kernel has a portable version, which also handles non-contiguous
+ * destinations and the tail of a line; the SIMD versions convert runs of
+ * contiguous 32-bit output pixels.
+ */
+
+#define FB_16BPP_FORMATS(X) \
+    X(565, 0xf800, 8, 0x07e0, 5, 0x001f, 3) \
+    X(555, 0x7c00, 9, 0x03e0, 6, 0x001f, 3)
+
+#define FB_DEFINE_C(name, rmask, rshift, gmask, gshift, bmask, bshift)  \
+static void draw_line_##name##_32_c(void *opaque, uint8_t *d,         \
+                                    const uint8_t *s, int width,        \
+                                    int deststep)                       \
+{                                                                       \
+    for (; width > 0; width--) {                                        \
+        uint32_t v = lduw_le_p(s);                                      \
+        *(uint32_t *)d = ((v & rmask) << rshift) |                      \
+                         ((v & gmask) << gshift) |                      \
+                         ((v & bmask) << bshift);                       \
+        s += 2;                                                         \
+        d += deststep;                                                  \
+    }                                                                   \
+}
+FB_16BPP_FORMATS(FB_DEFINE_C)
+
+static void draw_line_888_32_c(void *opaque, uint8_t *d, const uint8_t *s,
+                               int width, int deststep)
+{
+    for (; width > 0; width--) {
+        *(uint32_t *)d = rgb_to_pixel32(s[0], s[1], s[2]);
+        s += 3;
+        d += deststep;
+    }
+}
+
+static void draw_line_pal8_32_c(void *opaque, uint8_t *d, const uint8_t *s,
+                                int width, int deststep)
+{
+    const uint32_t *palette = opaque;
+
+    for (; width > 0; width--) {
+        *(uint32_t *)d = palette[*s++];
+        d += deststep;
+    }
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+#if defined(CONFIG_AVX2_OPT)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* Expands four zero-extended 16-bit pixels per 32-bit lane.  */
+#define FB_DEFINE_SSE2(name, rmask, rshift, gmask, gshift, bmask, bshift) \
+static inline __m128i expand_##name##_sse2(__m128i v)                   \
+{                                                                       \
+    __m128i r = _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(rmask)), rshift); \
+    __m128i g = _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(gmask)), gshift); \
+    __m128i b = _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(bmask)), bshift); \
+    return _mm_or_si128(_mm_or_si128(r, g), b);                         \
+}                                                                       \
+                                                                        \
+static void draw_line_##name##_32_sse2(void *opaque, uint8_t *d,      \
+                                       const uint8_t *s, int width,     \
+                                       int deststep)                    \
+{                                                                       \
+    __m128i zero = _mm_setzero_si128();                                 \
+                                                                        \
+    if (deststep == 4) {                                                \
+        for (; width >= 8; width -= 8) {                                \
+            __m128i v = _mm_loadu_si128((const __m128i *)s);            \
+            _mm_storeu_si128((__m128i *)d,                              \
+                             expand_##name##_sse2(_mm_unpacklo_epi16(v, zero))); \
+            _mm_storeu_si128((__m128i *)(d + 16),                       \
+                             expand_##name##_sse2(_mm_unpackhi_epi16(v, zero))); \
+            s += 16;                                                    \
+            d += 32;                                                    \
+        }                                                               \
+    }                                                                   \
+    draw_line_##name##_32_c(opaque, d, s, width, deststep);             \
+}
+FB_16BPP_FORMATS(FB_DEFINE_SSE2)
+
+#if defined(CONFIG_AVX2_OPT)
+#pragma GCC pop_options
+#endif
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+#define FB_DEFINE_AVX2(name, rmask, rshift, gmask, gshift, bmask, bshift) \
+static inline __m256i expand_##name##_avx2(__m256i v)                   \
+{                                                                       \
+    __m256i r = _mm256_slli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(rmask)), rshift); \
+    __m256i g = _mm256_slli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(gmask)), gshift); \
+    __m256i b = _mm256_slli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(bmask)), bshift); \
+    return _mm256_or_si256(_mm256_or_si256(r, g), b);                   \
+}                                                                       \
+                                                                        \
+static void draw_line_##name##_32_avx2(void *opaque, uint8_t *d,      \
+                                       const uint8_t *s, int width,     \
+                                       int deststep)                    \
+{                                                                       \
+    if (deststep == 4) {                                                \
+        for (; width >= 16; width -= 16) {                              \
+            __m256i lo = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)s)); \
+            __m256i hi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(s + 16))); \
+            _mm256_storeu_si256((__m256i *)d, expand_##name##_avx2(lo)); \
+            _mm256_storeu_si256((__m256i *)(d + 32), expand_##name##_avx2(hi)); \
+            s += 32;                                                    \
+            d += 64;                                                    \
+        }                                                               \
+    }                                                                   \
+    draw_line_##name##_32_sse2(opaque, d, s, width, deststep);          \
+}
+FB_16BPP_FORMATS(FB_DEFINE_AVX2)
+
+/* A gather of eight palette entries per step.  */
+static void draw_line_pal8_32_avx2(void *opaque, uint8_t *d,
+                                   const uint8_t *s, int width, int deststep)
+{
+    const int *palette = opaque;
+
+    if (deststep == 4) {
+        for (; width >= 8; width -= 8) {
+            __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)s));
+            _mm256_storeu_si256((__m256i *)d,
+                                _mm256_i32gather_epi32(palette, idx, 4));
+            s += 8;
+            d += 32;
+        }
+    }
+    draw_line_pal8_32_c(opaque, d, s, width, deststep);
+}
+
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(HOST_WORDS_BIGENDIAN)
+#include <arm_neon.h>
+
+#define FB_DEFINE_NEON(name, rmask, rshift, gmask, gshift, bmask, bshift) \
+static inline uint32x4_t expand_##name##_neon(uint32x4_t v)             \
+{                                                                       \
+    uint32x4_t r = vshlq_n_u32(vandq_u32(v, vdupq_n_u32(rmask)), rshift); \
+    uint32x4_t g = vshlq_n_u32(vandq_u32(v, vdupq_n_u32(gmask)), gshift); \
+    uint32x4_t b = vshlq_n_u32(vandq_u32(v, vdupq_n_u32(bmask)), bshift); \
+    return vorrq_u32(vorrq_u32(r, g), b);                               \
+}                                                                       \
+                                                                        \
+static void draw_line_##name##_32_neon(void *opaque, uint8_t *d,      \
+                                       const uint8_t *s, int width,     \
+                                       int deststep)                    \
+{                                                                       \
+    if (deststep == 4) {                                                \
+        for (; width >= 8; width -= 8) {                                \
+            uint16x8_t v = vld1q_u16((const uint16_t *)s);              \
+            vst1q_u32((uint32_t *)d,                                    \
+                      expand_##name##_neon(vmovl_u16(vget_low_u16(v)))); \
+            vst1q_u32((uint32_t *)(d + 16),                             \
+                      expand_##name##_neon(vmovl_u16(vget_high_u16(v)))); \
+            s += 16;                                                    \
+            d += 32;                                                    \
+        }                                                               \
+    }                                                                   \
+    draw_line_##name##_32_c(opaque, d, s, width, deststep);             \
+}
+FB_16BPP_FORMATS(FB_DEFINE_NEON)
+#endif
+
+typedef struct FramebufferKernels {
+    drawfn rgb565_32;
+    drawfn rgb555_32;
+    drawfn rgb888_32;
+    drawfn pal8_32;
+} FramebufferKernels;
+
+/* Each SIMD set only fills in the conversions it accelerates.  */
+static const FramebufferKernels fb_kernels_c = {
+    .rgb565_32 = draw_line_565_32_c,
+    .rgb555_32 = draw_line_555_32_c,
+    .rgb888_32 = draw_line_888_32_c,
+    .pal8_32 = draw_line_pal8_32_c,
+};
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+static const FramebufferKernels fb_kernels_sse2 = {
+    .rgb565_32 = draw_line_565_32_sse2,
+    .rgb555_32 = draw_line_555_32_sse2,
+};
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+static const FramebufferKernels fb_kernels_avx2 = {
+    .rgb565_32 = draw_line_565_32_avx2,
+    .rgb555_32 = draw_line_555_32_avx2,
+    .pal8_32 = draw_line_pal8_32_avx2,
+};
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(HOST_WORDS_BIGENDIAN)
+static const FramebufferKernels fb_kernels_neon = {
+    .rgb565_32 = draw_line_565_32_neon,
+    .rgb555_32 = draw_line_555_32_neon,
+};
+#endif
+
+#if defined(__SSE2__)
+static bool fb_have_sse2 = true;
+#elif defined(CONFIG_AVX2_OPT)
+static bool fb_have_sse2;
+#endif
+#ifdef CONFIG_AVX2_OPT
+static bool fb_have_avx2;
+#endif
+
+/* Start out with the best kernels the compiler baseline allows; with
+ * CONFIG_AVX2_OPT the cpuid check below may upgrade them.
+ */
+static FramebufferKernels fb_kernels = {
+#if defined(__SSE2__)
+    .rgb565_32 = draw_line_565_32_sse2,
+    .rgb555_32 = draw_line_555_32_sse2,
+#elif defined(__aarch64__) && defined(__ARM_NEON) && !defined(HOST_WORDS_BIGENDIAN)
+    .rgb565_32 = draw_line_565_32_neon,
+    .rgb555_32 = draw_line_555_32_neon,
+#else
+    .rgb565_32 = draw_line_565_32_c,
+    .rgb555_32 = draw_line_555_32_c,
+#endif
+    .rgb888_32 = draw_line_888_32_c,
+    .pal8_32 = draw_line_pal8_32_c,
+};
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_framebuffer_kernels(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            fb_have_sse2 = true;
+            fb_kernels.rgb565_32 = draw_line_565_32_sse2;
+            fb_kernels.rgb555_32 = draw_line_555_32_sse2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                fb_have_avx2 = true;
+                fb_kernels.rgb565_32 = draw_line_565_32_avx2;
+                fb_kernels.rgb555_32 = draw_line_555_32_avx2;
+                fb_kernels.pal8_32 = draw_line_pal8_32_avx2;
+            }
+        }
+    }
+}
+#endif /* CONFIG_AVX2_OPT */
+
+static drawfn fb_kernels_lookup(const FramebufferKernels *k,
+                                FramebufferFormat format, int dest_bpp)
+{
+    if (dest_bpp != 32) {
+        return NULL;
+    }
+
+    switch (format) {
+    case FRAMEBUFFER_FORMAT_RGB565:
+        return k->rgb565_32;
+    case FRAMEBUFFER_FORMAT_RGB555:
+        return k->rgb555_32;
+    case FRAMEBUFFER_FORMAT_RGB888:
+        return k->rgb888_32;
+    case FRAMEBUFFER_FORMAT_PAL8:
+        return k->pal8_32;
+    }
+    return NULL;
+}
+
+drawfn framebuffer_get_drawfn(FramebufferFormat format, int dest_bpp)
+{
+    return fb_kernels_lookup(&fb_kernels, format, dest_bpp);
+}
+
+drawfn framebuffer_get_drawfn_impl(FramebufferFormat format, int dest_bpp,
+                                   FramebufferImpl impl)
+{
+    switch (impl) {
+    case FRAMEBUFFER_IMPL_C:
+        return fb_kernels_lookup(&fb_kernels_c, format, dest_bpp);
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+    case FRAMEBUFFER_IMPL_SSE2:
+        return fb_have_sse2 ?
+            fb_kernels_lookup(&fb_kernels_sse2, format, dest_bpp) : NULL;
+#endif
+#ifdef CONFIG_AVX2_OPT
+    case FRAMEBUFFER_IMPL_AVX2:
+        return fb_have_avx2 ?
+            fb_kernels_lookup(&fb_kernels_avx2, format, dest_bpp) : NULL;
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(HOST_WORDS_BIGENDIAN)
+    case FRAMEBUFFER_IMPL_NEON:
+        return fb_kernels_lookup(&fb_kernels_neon, format, dest_bpp);
+#endif
+    default:
+        return NULL;
+    }
+}
@@ -62,4 +62,48 @@ void framebuffer_update_display(
     int *first_row,
     int *last_row);
 
+/* Source pixel formats with shared line conversion kernels.  The 16-bit
+ * formats are little-endian with red in the most significant bits; RGB888
+ * is three bytes per pixel in R, G, B order; PAL8 indexes a palette of 256
+ * host pixels.
+ */
+typedef enum {
+    FRAMEBUFFER_FORMAT_RGB565,
+    FRAMEBUFFER_FORMAT_RGB555,
+    FRAMEBUFFER_FORMAT_RGB888,
+    FRAMEBUFFER_FORMAT_PAL8,
+} FramebufferFormat;
+
+/* framebuffer_get_drawfn: Get a line conversion function for
+ * framebuffer_update_display().
+ *
+ * The fastest implementation the host CPU supports is picked at startup.
+ *
+ * @format: Pixel format of the framebuffer memory.
+ * @dest_bpp: Bits per pixel of the destination surface.
+ *
+ * Returns NULL if the conversion is not supported.  For
+ * %FRAMEBUFFER_FORMAT_PAL8 the opaque pointer passed to
+ * framebuffer_update_display() must point to the 256 palette entries,
+ * already converted to host pixels.
+ */
+drawfn framebuffer_get_drawfn(FramebufferFormat format, int dest_bpp);
+
+typedef enum {
+    FRAMEBUFFER_IMPL_C,
+    FRAMEBUFFER_IMPL_SSE2,
+    FRAMEBUFFER_IMPL_AVX2,
+    FRAMEBUFFER_IMPL_NEON,
+} FramebufferImpl;
+
+/* framebuffer_get_drawfn_impl: Get one specific implementation of a line
+ * conversion function, for testing the SIMD kernels against the portable
+ * ones.
+ *
+ * Returns NULL if @impl has no kernel for the conversion, was not built
+ * in, or cannot run on the host CPU.
+ */
+drawfn framebuffer_get_drawfn_impl(FramebufferFormat format, int dest_bpp,
+                                   FramebufferImpl impl);
+
 #endif
@@ -90,6 +90,107 @@ static void pl080_update(PL080State *s)
     qemu_set_irq(s->irq, errlevel || tclevel);
 }
 
+/* Whether [addr, addr + len) is RAM that can be mapped without side effects.  */
+static bool pl080_is_direct(PL080State *s, hwaddr addr, hwaddr len,
+                            bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr xlat;
+    hwaddr l = len;
+
+    RCU_READ_LOCK_GUARD();
+    mr = address_space_translate(&s->downstream_as, addr, &xlat, &l, is_write,
+                                 MEMTXATTRS_UNSPECIFIED);
+    return l >= len && memory_access_is_direct(mr, is_write);
+}
+
+static void *pl080_map(PL080State *s, hwaddr addr, hwaddr len, bool is_write)
+{
+    hwaddr l = len;
+    void *p;
+
+    if (!pl080_is_direct(s, addr, len, is_write)) {
+        return NULL;
+    }
+    p = address_space_map(&s->downstream_as, addr, &l, is_write,
+                          MEMTXATTRS_UNSPECIFIED);
+    if (p && l < len) {
+        address_space_unmap(&s->downstream_as, p, l, is_write, 0);
+        return NULL;
+    }
+    return p;
+}
+
+/*
+ * Move the remaining SIZE elements of the current LLI at once.  The RAM side
+ * of the transfer is mapped and copied in one go, a peripheral side is still
+ * accessed once per element.  Returns false, having done nothing, when
+ * neither side is RAM or when the copy would differ from the per-element one.
+ */
+static bool pl080_run_lli(PL080State *s, pl080_channel *ch, int size,
+                          int width)
+{
+    hwaddr len = (hwaddr)size * width;
+    bool src_inc = ch->ctrl & PL080_CCTRL_SI;
+    bool dest_inc = ch->ctrl & PL080_CCTRL_DI;
+    uint8_t *src = NULL;
+    uint8_t *dest = NULL;
+    hwaddr src_end = ch->src + (src_inc ? len : width);
+    hwaddr dest_end = ch->dest + (dest_inc ? len : width);
+    int n;
+
+    /*
+     * Element by element, a destination that overlaps the source from above
+     * sees data written earlier in the same LLI; a bulk copy would not.
+     */
+    if (ch->src < dest_end && ch->dest < src_end &&
+        !(src_inc && dest_inc && ch->dest <= ch->src)) {
+        return false;
+    }
+
+    if (src_inc) {
+        src = pl080_map(s, ch->src, len, false);
+    }
+    if (dest_inc) {
+        dest = pl080_map(s, ch->dest, len, true);
+    }
+    if (!src && !dest) {
+        return false;
+    }
+
+    if (src && dest) {
+        memmove(dest, src, len);
+    } else if (src) {
+        for (n = 0; n < size; n++) {
+            address_space_write(&s->downstream_as,
+                                ch->dest + (dest_inc ? n * width : 0),
+                                MEMTXATTRS_UNSPECIFIED, src + n * width,
+                                width);
+        }
+    } else {
+        for (n = 0; n < size; n++) {
+            address_space_read(&s->downstream_as,
+                               ch->src + (src_inc ? n * width : 0),
+                               MEMTXATTRS_UNSPECIFIED, dest + n * width,
+                               width);
+        }
+    }
+
+    if (src) {
+        address_space_unmap(&s->downstream_as, src, len, false, len);
+    }
+    if (dest) {
+        address_space_unmap(&s->downstream_as, dest, len, true, len);
+    }
+    if (src_inc) {
+        ch->src += len;
+    }
+    if (dest_inc) {
+        ch->dest += len;
+    }
+    return true;
+}
+
 static void pl080_run(PL080State *s)
 {
     int c;
@@ -161,29 +262,39 @@ again:
                 continue;
             }
 
-            /* Transfer one element.  */
-            /* ??? Should transfer multiple elements for a burst request.  */
-            /* ??? Unclear what the proper behavior is when source and
-               destination widths are different.  */
             swidth = 1 << ((ch->ctrl >> 18) & 7);
             dwidth = 1 << ((ch->ctrl >> 21) & 7);
-            for (n = 0; n < dwidth; n+= swidth) {
-                address_space_read(&s->downstream_as, ch->src,
-                                   MEMTXATTRS_UNSPECIFIED, buff + n, swidth);
-                if (ch->ctrl & PL080_CCTRL_SI)
-                    ch->src += swidth;
-            }
-            xsize = (dwidth < swidth) ? swidth : dwidth;
-            /* ??? This may pad the value incorrectly for dwidth < 32.  */
-            for (n = 0; n < xsize; n += dwidth) {
-                address_space_write(&s->downstream_as, ch->dest + n,
-                                    MEMTXATTRS_UNSPECIFIED, buff + n, dwidth);
-                if (ch->ctrl & PL080_CCTRL_DI)
-                    ch->dest += swidth;
-            }
+            /*
+             * Requests are not modelled for flow control 0 to 2, so the whole
+             * LLI can go at once.  Peripheral-to-peripheral transfers wait
+             * for both requests on every element.
+             */
+            if (flow != 3 && swidth == dwidth &&
+                pl080_run_lli(s, ch, size, swidth)) {
+                size = 0;
+            } else {
+                /* Transfer one element.  */
+                /* ??? Should transfer multiple elements for a burst request.  */
+                /* ??? Unclear what the proper behavior is when source and
+                   destination widths are different.  */
+                for (n = 0; n < dwidth; n+= swidth) {
+                    address_space_read(&s->downstream_as, ch->src,
+                                       MEMTXATTRS_UNSPECIFIED, buff + n, swidth);
+                    if (ch->ctrl & PL080_CCTRL_SI)
+                        ch->src += swidth;
+                }
+                xsize = (dwidth < swidth) ? swidth : dwidth;
+                /* ??? This may pad the value incorrectly for dwidth < 32.  */
+                for (n = 0; n < xsize; n += dwidth) {
+                    address_space_write(&s->downstream_as, ch->dest + n,
+                                        MEMTXATTRS_UNSPECIFIED, buff + n, dwidth);
+                    if (ch->ctrl & PL080_CCTRL_DI)
+                        ch->dest += swidth;
+                }
 
-            //printf("Transfer size: %d, destination: 0x%08x\n", size, ch->dest);
-            size--;
+                //printf("Transfer size: %d, destination: 0x%08x\n", size, ch->dest);
+                size--;
+            }
             ch->ctrl = (ch->ctrl & 0xfffff000) | size;
             if (size == 0) {
                 /* Transfer complete.  */
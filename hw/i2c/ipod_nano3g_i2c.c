@@ -21,6 +21,7 @@
  */
 
 #include "hw/i2c/ipod_nano3g_i2c.h"
+#include "migration/vmstate.h"
 
 static void S5L8702_i2c_update(IPodNano3GI2CState *s)
 {
@@ -229,10 +230,29 @@ static void ipod_nano3g_i2c_reset(DeviceState *d)
     
 }
 
+static const VMStateDescription vmstate_ipod_nano3g_i2c = {
+    .name = TYPE_IPOD_NANO3G_I2C,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(control, IPodNano3GI2CState),
+        VMSTATE_UINT8(status, IPodNano3GI2CState),
+        VMSTATE_UINT8(address, IPodNano3GI2CState),
+        VMSTATE_UINT8(datashift, IPodNano3GI2CState),
+        VMSTATE_UINT8(line_ctrl, IPodNano3GI2CState),
+        VMSTATE_UINT32(iicreg20, IPodNano3GI2CState),
+        VMSTATE_UINT8(active, IPodNano3GI2CState),
+        VMSTATE_UINT8(ibmr, IPodNano3GI2CState),
+        VMSTATE_UINT8(data, IPodNano3GI2CState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void ipod_nano3g_i2c_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->reset = ipod_nano3g_i2c_reset;
+    dc->vmsd = &vmstate_ipod_nano3g_i2c;
 }
 
 static const TypeInfo ipod_nano3g_i2c_type_info = {
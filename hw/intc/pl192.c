@@ -10,7 +10,9 @@
 #include "hw/irq.h"
 #include "hw/hw.h"
 #include "qapi/error.h"
+#include "qemu/host-utils.h"
 #include "hw/intc/pl192.h"
+#include "migration/vmstate.h"
 
 extern CPUState *getMainCpuEnv(void);
 
@@ -39,11 +41,16 @@ static void pl192_raise(PL192State *s, int is_fiq)
         } else {
             if (s->daisy) {
                 /* Setup daisy input of the next chained contorller and force
-                   it to update it's state */
-                s->daisy->daisy_vectaddr = s->address;
-                s->daisy->daisy_callback = s;
-                s->daisy->daisy_input = 1;
-                pl192_update(s->daisy);
+                   it to update it's state, unless it already sees this
+                   request */
+                if (!s->daisy->daisy_input ||
+                    s->daisy->daisy_vectaddr != s->address ||
+                    s->daisy->daisy_callback != s) {
+                    s->daisy->daisy_vectaddr = s->address;
+                    s->daisy->daisy_callback = s;
+                    s->daisy->daisy_input = 1;
+                    pl192_update(s->daisy);
+                }
             } else {
                 // TODO Needs urgent fixing!
                 hw_error("pl192: cannot raise IRQ. This usually means that initialization was done incorrectly.\n");
@@ -64,44 +71,73 @@ static void pl192_lower(PL192State *s, int is_fiq)
     /* Propagate to the previous controller in chain if needed */
     if (s->daisy) {
         if (!is_fiq) {
-            s->daisy->daisy_input = 0;
-            pl192_update(s->daisy);
+            if (s->daisy->daisy_input) {
+                s->daisy->daisy_input = 0;
+                pl192_update(s->daisy);
+            }
         } else {
             pl192_lower(s->daisy, is_fiq);
         }
     }
 }
 
-/* Find interrupt of the highest priority */
-static uint32_t pl192_priority_sorter(PL192State *s)
+/* Recompute whether any source of the given priority level is pending */
+static inline void pl192_update_level(PL192State *s, uint32_t prio)
+{
+    if (s->irq_status & s->prio_sources[prio]) {
+        s->prio_pending |= 1U << prio;
+    } else {
+        s->prio_pending &= ~(1U << prio);
+    }
+}
+
+/* Update the pending levels for the sources whose status changed */
+static void pl192_update_pending(PL192State *s, uint32_t changed)
+{
+    while (changed) {
+        pl192_update_level(s, s->vect_priority[ctz32(changed)]);
+        changed &= changed - 1;
+    }
+}
+
+/* Rebuild the per-level bitmaps from the vector priority registers */
+static void pl192_rebuild_priorities(PL192State *s)
 {
     int i;
-    uint32_t prio_irq[PL192_PRIO_LEVELS];
 
-    for (i = 0; i < PL192_PRIO_LEVELS; i++) {
-        prio_irq[i] = PL192_NO_IRQ;
+    memset(s->prio_sources, 0, sizeof(s->prio_sources));
+    for (i = 0; i < PL192_INT_SOURCES; i++) {
+        s->prio_sources[s->vect_priority[i]] |= 1U << i;
     }
-    if (s->daisy_input) {
-        prio_irq[s->daisy_priority] = PL192_DAISY_IRQ;
+    s->prio_pending = 0;
+    for (i = 0; i < PL192_PRIO_LEVELS; i++) {
+        pl192_update_level(s, i);
     }
-    for (i = PL192_INT_SOURCES - 1; i >= 0; i--) {
-        if (s->irq_status & (1 << i)) {
-            prio_irq[s->vect_priority[i]] = i;
-        }
+}
+
+/* Find interrupt of the highest priority. Within a level the lowest
+   numbered source wins, and any source wins over the daisy input. */
+static uint32_t pl192_priority_sorter(PL192State *s)
+{
+    uint32_t prio = ctz32(s->prio_pending & s->sw_priority_mask);
+
+    if (s->daisy_input && s->daisy_priority < prio &&
+        (s->sw_priority_mask & (1U << s->daisy_priority))) {
+        return PL192_DAISY_IRQ;
     }
-    for (i = 0; i < PL192_PRIO_LEVELS; i++) {
-        if ((s->sw_priority_mask & (1 << i)) &&
-            prio_irq[i] <= PL192_DAISY_IRQ) {
-            return prio_irq[i];
-        }
+    if (prio >= PL192_PRIO_LEVELS) {
+        return PL192_NO_IRQ;
     }
-    return PL192_NO_IRQ;
+    return ctz32(s->irq_status & s->prio_sources[prio]);
 }
 
 static void pl192_update(PL192State *s)
 {
+    uint32_t irq_status = s->irq_status;
+
     /* TODO: does SOFTINT affects IRQ_STATUS??? */
     s->irq_status = (s->rawintr | s->softint) & s->intenable & ~s->intselect;
+    pl192_update_pending(s, irq_status ^ s->irq_status);
     s->fiq_status = (s->rawintr | s->softint) & s->intenable & s->intselect;
     if (s->fiq_status) {
         pl192_raise(s, 1);
@@ -143,7 +179,7 @@ static void pl192_update(PL192State *s)
    lately. */
 static inline void pl192_mask_priority(PL192State *s)
 {
-    if (s->stack_i >= PL192_INT_SOURCES) {
+    if (s->stack_i >= PL192_PRIO_LEVELS) {
         hw_error("pl192: internal error (trying to mask when there are no more sources)\n");
     }
     s->stack_i++;
@@ -279,7 +315,14 @@ static void pl192_write(void *opaque, hwaddr offset, uint64_t value, unsigned si
         return;
     }
     if (offset >= 0x200 && offset < 0x280) {
-        s->vect_priority[(offset - 0x200) >> 2] = value & 0xf;
+        int i = (offset - 0x200) >> 2;
+        uint32_t prio = s->vect_priority[i];
+
+        s->prio_sources[prio] &= ~(1U << i);
+        pl192_update_level(s, prio);
+        s->vect_priority[i] = prio = value & 0xf;
+        s->prio_sources[prio] |= 1U << i;
+        pl192_update_level(s, prio);
         pl192_update(s);
         return;
     }
@@ -339,13 +382,17 @@ static void pl192_write(void *opaque, hwaddr offset, uint64_t value, unsigned si
 static void pl192_irq_handler(void *opaque, int irq, int level)
 {
     PL192State *s = (PL192State *) opaque;
+    uint32_t rawintr = s->rawintr;
 
     if (level) {
-        s->rawintr |= 1 << irq;
+        s->rawintr |= 1U << irq;
     } else {
-        s->rawintr &= ~(1 << irq);
+        s->rawintr &= ~(1U << irq);
+    }
+    /* Nothing to do if the line did not actually change */
+    if (s->rawintr != rawintr) {
+        pl192_update(opaque);
     }
-    pl192_update(opaque);
 }
 
 static void pl192_reset(DeviceState *d)
@@ -364,6 +411,7 @@ static void pl192_reset(DeviceState *d)
     s->priority_stack[0] = 0x10;
     s->irq_stack[0] = PL192_NO_IRQ;
     s->priority = 0x10;
+    pl192_rebuild_priorities(s);
 }
 
 static const MemoryRegionOps pl192_ops = {
@@ -414,13 +462,71 @@ static void pl192_init(Object *obj)
     //sysbus_init_irq(sbd, s->fiq);
 }
 
+static int pl192_post_load(void *opaque, int version_id)
+{
+    PL192State *s = PL192(opaque);
+    int i;
+
+    for (i = 0; i < PL192_INT_SOURCES; i++) {
+        if (s->vect_priority[i] >= PL192_PRIO_LEVELS) {
+            return -EINVAL;
+        }
+    }
+    if (s->daisy_priority >= PL192_PRIO_LEVELS) {
+        return -EINVAL;
+    }
+    /* the priority stack has one slot per level on top of the base entry */
+    if (s->stack_i < 0 || s->stack_i > PL192_PRIO_LEVELS) {
+        return -EINVAL;
+    }
+    for (i = 0; i <= s->stack_i; i++) {
+        if (s->irq_stack[i] > PL192_NO_IRQ) {
+            return -EINVAL;
+        }
+    }
+    if (s->current > PL192_NO_IRQ || s->current_highest > PL192_NO_IRQ) {
+        return -EINVAL;
+    }
+    pl192_rebuild_priorities(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_pl192 = {
+    .name = "pl192",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = pl192_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(irq_status, PL192State),
+        VMSTATE_UINT32(fiq_status, PL192State),
+        VMSTATE_UINT32(rawintr, PL192State),
+        VMSTATE_UINT32(intselect, PL192State),
+        VMSTATE_UINT32(intenable, PL192State),
+        VMSTATE_UINT32(softint, PL192State),
+        VMSTATE_UINT32(protection, PL192State),
+        VMSTATE_UINT32(sw_priority_mask, PL192State),
+        VMSTATE_UINT32_ARRAY(vect_addr, PL192State, PL192_INT_SOURCES),
+        VMSTATE_UINT32_ARRAY(vect_priority, PL192State, PL192_INT_SOURCES),
+        VMSTATE_UINT32(address, PL192State),
+        VMSTATE_UINT32(current, PL192State),
+        VMSTATE_UINT32(current_highest, PL192State),
+        VMSTATE_INT32(stack_i, PL192State),
+        VMSTATE_UINT32_ARRAY(priority_stack, PL192State, PL192_PRIO_LEVELS + 1),
+        VMSTATE_UINT8_ARRAY(irq_stack, PL192State, PL192_PRIO_LEVELS + 1),
+        VMSTATE_UINT32(priority, PL192State),
+        VMSTATE_UINT32(daisy_vectaddr, PL192State),
+        VMSTATE_UINT32(daisy_priority, PL192State),
+        VMSTATE_UINT8(daisy_input, PL192State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void pl192_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->reset = pl192_reset;
-    //dc->vmsd = &vmstate_pl192;
-    // TODO save VM
+    dc->vmsd = &vmstate_pl192;
 }
 
 static const TypeInfo pl192_info = {
@@ -127,6 +127,32 @@ uint32_t ssi_transfer(SSIBus *bus, uint32_t val)
     return r;
 }
 
+void ssi_transfer_bulk(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                       uint32_t len)
+{
+    BusState *b = BUS(bus);
+    BusChild *kid = QTAILQ_FIRST(&b->children);
+    uint32_t done = 0;
+
+    /* results of several peripherals are ORed, only a lone one can go bulk */
+    if (kid && !QTAILQ_NEXT(kid, sibling)) {
+        SSIPeripheral *peripheral = SSI_PERIPHERAL(kid->child);
+        SSIPeripheralClass *ssc = SSI_PERIPHERAL_GET_CLASS(peripheral);
+
+        if (ssc->transfer_bulk &&
+                ssc->transfer_raw == ssi_transfer_raw_default &&
+                ((peripheral->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
+                 (!peripheral->cs && ssc->cs_polarity == SSI_CS_LOW) ||
+                 ssc->cs_polarity == SSI_CS_NONE)) {
+            done = ssc->transfer_bulk(peripheral, tx, rx, len);
+        }
+    }
+
+    for (; done < len; done++) {
+        rx[done] = ssi_transfer(bus, tx ? tx[done] : 0xff);
+    }
+}
+
 const VMStateDescription vmstate_ssi_peripheral = {
     .name = "SSISlave",
     .version_id = 1,
@@ -21,12 +21,14 @@
 #include "exec/memattrs.h"
 #include "exec/memop.h"
 #include "exec/ramlist.h"
+#include "qemu/bitops.h"
 #include "qemu/bswap.h"
 #include "qemu/queue.h"
 #include "qemu/int128.h"
 #include "qemu/notify.h"
 #include "qom/object.h"
 #include "qemu/rcu.h"
+#include "qemu/stats64.h"
 
 #define RAM_ADDR_INVALID (~(ram_addr_t)0)
 
@@ -712,6 +714,7 @@ void ram_discard_manager_unregister_listener(RamDiscardManager *rdm,
 
 typedef struct CoalescedMemoryRange CoalescedMemoryRange;
 typedef struct MemoryRegionIoeventfd MemoryRegionIoeventfd;
+typedef struct MemoryRegionProfile MemoryRegionProfile;
 
 /** MemoryRegion:
  *
@@ -757,6 +760,53 @@ struct MemoryRegion {
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
     RamDiscardManager *rdm; /* Only for RAM */
+    MemoryRegionProfile *profile; /* Only while MMIO accounting is enabled */
+    Stat64 count_reads; /* See memory_region_set_counting() */
+    Stat64 count_writes;
+    unsigned long *pollable; /* See memory_region_set_pollable() */
+};
+
+/* Granularity of the pollable register bitmap */
+#define MEMORY_REGION_POLLABLE_GRANULE 4
+
+/* Granularity of the per-offset MMIO accounting, one bucket per register */
+#define MEMORY_REGION_PROFILE_BUCKET_SIZE 4
+
+/**
+ * MemoryRegionProfileStats: MMIO accounting for a region or part of it
+ *
+ * @offset: start of the bucket within the region, 0 for region totals
+ * @reads: number of read dispatches
+ * @writes: number of write dispatches
+ * @bytes_read: bytes read
+ * @bytes_written: bytes written
+ * @ns: host time spent in the region's accessors
+ */
+typedef struct MemoryRegionProfileStats {
+    hwaddr offset;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t ns;
+} MemoryRegionProfileStats;
+
+/**
+ * MemoryRegionProfile: MMIO accesses dispatched to one #MemoryRegion
+ *
+ * Allocated on the first access after memory_region_set_profiling()
+ * enabled accounting.
+ *
+ * @mr: the region being accounted
+ * @total: accesses to the whole region
+ * @buckets: #MemoryRegionProfileStats per %MEMORY_REGION_PROFILE_BUCKET_SIZE
+ *           bytes of the region that saw accesses, keyed by their offset
+ */
+struct MemoryRegionProfile {
+    MemoryRegion *mr;
+    MemoryRegionProfileStats total;
+    GHashTable *buckets;
+    QTAILQ_ENTRY(MemoryRegionProfile) next;
 };
 
 struct IOMMUMemoryRegion {
@@ -1927,6 +1977,35 @@ void memory_region_writeback(MemoryRegion *mr, hwaddr addr, hwaddr size);
  */
 void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client);
 
+/**
+ * memory_region_set_pollable: Mark MMIO registers as free of read side effects
+ *
+ * Devices call this for status registers that guests typically spin on
+ * while they wait for the device.  Reading such a register must not change
+ * the device state, so the TCG idle-poll detector may put a vCPU that
+ * keeps reading the same value to sleep (see tcg_idle_poll_enable()).
+ * Only mark registers whose value can change, and call tcg_idle_poll_wake()
+ * when it does.  Only meaningful for regions with MMIO ops.
+ *
+ * @mr: the memory region holding the registers.
+ * @offset: offset of the first register within @mr.
+ * @size: number of bytes covered, in %MEMORY_REGION_POLLABLE_GRANULE units.
+ */
+void memory_region_set_pollable(MemoryRegion *mr, hwaddr offset, hwaddr size);
+
+/**
+ * memory_region_is_pollable: Check whether reading an MMIO offset is
+ * free of side effects, as declared by memory_region_set_pollable()
+ *
+ * @mr: the memory region being read.
+ * @offset: the offset within @mr.
+ */
+static inline bool memory_region_is_pollable(MemoryRegion *mr, hwaddr offset)
+{
+    return mr->pollable &&
+           test_bit(offset / MEMORY_REGION_POLLABLE_GRANULE, mr->pollable);
+}
+
 /**
  * memory_region_set_dirty: Mark a range of bytes as dirty in a memory region.
  *
@@ -2433,6 +2512,15 @@ void memory_global_dirty_log_stop(unsigned int flags);
 
 void mtree_info(bool flatview, bool dispatch_tree, bool owner, bool disabled);
 
+/**
+ * mtree_profile_info: print the MMIO accounting collected so far
+ *
+ * @max: number of regions to show, the busiest first
+ * @by_count: rank by number of accesses instead of time spent
+ * @buckets: also show the busiest offsets within each region
+ */
+void mtree_profile_info(int64_t max, bool by_count, bool buckets);
+
 /**
  * memory_region_dispatch_read: perform a read directly to the specified
  * MemoryRegion.
@@ -2464,6 +2552,66 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
                                          MemOp op,
                                          MemTxAttrs attrs);
 
+/**
+ * memory_region_set_profiling: enable or disable MMIO accounting
+ *
+ * While enabled, every access dispatched to a #MemoryRegion's ops is
+ * counted and timed in its #MemoryRegionProfile.  Disabling keeps the
+ * counts collected so far.
+ *
+ * @enable: whether to account accesses
+ */
+void memory_region_set_profiling(bool enable);
+
+/**
+ * memory_region_profiling_enabled: whether MMIO accounting is enabled
+ */
+bool memory_region_profiling_enabled(void);
+
+/**
+ * memory_region_profile_reset: drop the MMIO accounting collected so far
+ */
+void memory_region_profile_reset(void);
+
+typedef void (*MemoryRegionProfileFunc)(MemoryRegionProfile *profile,
+                                        void *opaque);
+
+/**
+ * memory_region_profile_foreach: call @fn for every region that has seen
+ * MMIO accesses since accounting was first enabled
+ *
+ * @fn: the function to call
+ * @opaque: passed through to @fn
+ */
+void memory_region_profile_foreach(MemoryRegionProfileFunc fn, void *opaque);
+
+/**
+ * memory_region_set_counting: enable or disable MMIO access counting
+ *
+ * A lightweight alternative to memory_region_set_profiling() for callers
+ * that only need the number of accesses: while enabled, every access
+ * dispatched to a #MemoryRegion's ops increments one of two counters in
+ * the region itself, without taking a lock or reading the host clock.
+ * Disabling keeps the counts collected so far.
+ *
+ * @enable: whether to count accesses
+ */
+void memory_region_set_counting(bool enable);
+
+typedef void (*MemoryRegionCountFunc)(MemoryRegion *mr, uint64_t reads,
+                                      uint64_t writes, void *opaque);
+
+/**
+ * memory_region_count_foreach: call @fn for every region mapped into @as
+ * that has counted MMIO accesses
+ *
+ * @as: the address space whose regions are reported, each one once
+ * @fn: the function to call
+ * @opaque: passed through to @fn
+ */
+void memory_region_count_foreach(AddressSpace *as, MemoryRegionCountFunc fn,
+                                 void *opaque);
+
 /**
  * address_space_init: initializes an address space
  *
@@ -71,6 +71,11 @@
 
 const int S5L8702_GPIO_IRQS[7] = { S5L8702_GPIO_G0_IRQ, S5L8702_GPIO_G1_IRQ, S5L8702_GPIO_G2_IRQ, S5L8702_GPIO_G3_IRQ, S5L8702_GPIO_G4_IRQ, S5L8702_GPIO_G5_IRQ, S5L8702_GPIO_G6_IRQ };
 
+// a status register read back unchanged this many times in a row means the firmware idles
+#define IPOD_NANO3G_IDLE_POLL_THRESHOLD 64
+// bounds how late an event no device reports through tcg_idle_poll_wake() is noticed
+#define IPOD_NANO3G_IDLE_POLL_MAX_SLEEP_NS (10 * SCALE_MS)
+
 // memory addresses
 #define IPOD_NANO3G_PHYS_BASE (0xc0000000)
 #define IBOOT_BASE 0x18000000
@@ -175,6 +180,12 @@ typedef struct {
 	ARMCPU *cpu;
 	char bootrom_path[1024];
 	char bootloader_path[1024];
+	char nor_path[1024];
+	char nand_path[1024];
+	char nand_overlay_path[1024];
+	bool nand_pristine;
+	char milestone_log_path[1024];
+	bool idle_poll;
 } IPodNano3GMachineState;
 
 #endif
\ No newline at end of file
@@ -7,7 +7,8 @@
 #include "hw/hw.h"
 #include "exec/hwaddr.h"
 #include "exec/memory.h"
-#include <openssl/aes.h>
+#include "hw/sysbus.h"
+#include "crypto/cipher.h"
 
 #define TYPE_IPOD_NANO3G_AES                "ipodnano3g.aes"
 OBJECT_DECLARE_SIMPLE_TYPE(S5L8702AESState, IPOD_NANO3G_AES)
@@ -34,6 +35,12 @@ OBJECT_DECLARE_SIMPLE_TYPE(S5L8702AESState, IPOD_NANO3G_AES)
 #define AES_KEYSIZE 0x20
 #define AES_IVSIZE 0x10
 
+#define AES_BLOCK_LEN 16
+#define AES_STATUS_DONE 0xf
+
+// the operation is selected by the second write to AES_KEYLEN
+#define AES_OP_DECRYPT 0
+
 typedef enum AESKeyType {
     AESCustom = 0,
     AESGID = 1,
@@ -50,7 +57,17 @@ typedef struct S5L8702AESState
 {
     SysBusDevice busdev;
     MemoryRegion iomem;
-    AES_KEY decryptKey;
+    qemu_irq irq;
+    QEMUBH *done_bh;
+    bool async;
+    bool pending; // AES_GO was written, done_bh has not run yet
+
+    // cipher for the last key used, kept while the key stays the same
+    QCryptoCipher *cipher;
+    uint8_t cipher_key[32];
+    size_t cipher_nkey;
+    uint8_t keylenop;
+
 	uint32_t ivec[4];
 	uint32_t insize;
 	uint32_t inaddr;
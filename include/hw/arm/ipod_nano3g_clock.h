@@ -21,6 +21,24 @@ OBJECT_DECLARE_SIMPLE_TYPE(IPodNano3GClockState, IPOD_NANO3G_CLOCK)
 #define CLOCK1_PLLLOCK 0x40
 #define CLOCK1_PLLMODE 0x44
 
+// PLLnCON holds the P, M and S dividers: Fout = Fin * M / (P << S)
+#define CLOCK1_PLL_P_SHIFT 24
+#define CLOCK1_PLL_P_MASK 0x3F
+#define CLOCK1_PLL_M_SHIFT 8
+#define CLOCK1_PLL_M_MASK 0xFF
+#define CLOCK1_PLL_S_MASK 0x7
+#define CLOCK1_NUM_PLLS 3
+
+// each half of CONFIGn is a clock generator picking a source and dividing it down.
+// The layout is inferred from the boot values, so the gate only stops the
+// outputs with the "gating" property set.
+#define CLOCK1_CG_DISABLE (1 << 15)
+#define CLOCK1_CG_SRC_SHIFT 12
+#define CLOCK1_CG_SRC_MASK 0x3
+#define CLOCK1_CG_SRC_OSC 3
+#define CLOCK1_CG_DIV_SHIFT 8
+#define CLOCK1_CG_DIV_MASK 0xF
+
 typedef struct IPodNano3GClockState
 {
     SysBusDevice busdev;
@@ -34,7 +52,13 @@ typedef struct IPodNano3GClockState
     uint32_t    pll3con;
     uint32_t    plllock;
     uint32_t    pllmode;
+    bool        gating;
 
+    Clock *osc;
+    Clock *pll[CLOCK1_NUM_PLLS];
+    Clock *fclk;
+    Clock *pclk;
+    Clock *lcdclk;
 } IPodNano3GClockState;
 
 #endif
\ No newline at end of file
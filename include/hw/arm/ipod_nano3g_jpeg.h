@@ -28,26 +28,54 @@ Deduced JPEG decoding registers:
 
 #define JPEG_REG_CTRL     0x5000C
 
+// the region keeps the size it always had, even though it overlaps the H264 block
+#define JPEG_MMIO_SIZE (4 * (0x396fffff - 0x39600000))
+
+// only this window holds registers the engine reads back, everything else is write-only
+#define JPEG_REG_WINDOW 0x60000
+#define JPEG_NUM_REGS   0x20
+#define JPEG_REG(addr)  (((addr) - JPEG_REG_WINDOW) / 4)
+
+// reads as all ones while idle, a write acknowledges the frame interrupt
+#define JPEG_REG_STATUS       0x60000
 #define JPEG_REG_COEFF_BLOCKS 0x60018
 #define JPEG_REG_OUT_YPLANE   0x6002c
 #define JPEG_REG_OUT_CBPLANE  0x6003c
 #define JPEG_REG_OUT_CRPLANE  0x6004c
 
+// chroma subsampling, selected through the "subsampling" property
+#define JPEG_FORMAT_420 0
+#define JPEG_FORMAT_422 1
+#define JPEG_FORMAT_444 2
+
+#define JPEG_MAX_DIMENSION 2048
+// frames up to the size of the boot splash are decoded on the spot
+#define JPEG_SYNC_MAX_MCUS 300
+
+// the coefficients are laid out per MCU, the luminance blocks followed by Cb and Cr
 typedef struct {
     uint32_t coeff[0x40];
 } Block;
 
 typedef struct {
-    Block lum[4];
-    Block chromb;
-    Block chromr;
-} EncodedMCU;
+    // MCU grid and the number of luminance blocks in every MCU
+    unsigned mcus_x, mcus_y;
+    unsigned lum_cols, lum_rows;
+    unsigned y_stride, c_stride;
+    size_t y_size, c_size;
+    size_t num_blocks;
+    uint32_t qtable1[64];
+    uint32_t qtable2[64];
+    hwaddr out_addr;
+} S5L8702JPEGFrame;
 
-typedef struct {
-    double yplane[16][16];
-    double crplane[16][16];
-    double cbplane[16][16];
-} DecodedMCU;
+typedef struct S5L8702JPEGRowTask {
+    struct S5L8702JPEGState *s;
+    unsigned mcu_y;
+} S5L8702JPEGRowTask;
+
+// one row of eight IDCT samples, processed as a single SIMD vector
+typedef double JPEGVec __attribute__((vector_size(8 * sizeof(double))));
 
 typedef struct S5L8702JPEGState {
 	SysBusDevice busdev;
@@ -56,9 +84,25 @@ typedef struct S5L8702JPEGState {
     MemoryRegion *sysmem;
     qemu_irq irq;
 
-    uint32_t regs[0x396fffff - 0x39600000];
+    uint32_t regs[JPEG_NUM_REGS];
     uint32_t qtable1[64];
     uint32_t qtable2[64];
+
+    // nothing is known about the geometry registers, the layout is configured
+    uint32_t width;
+    uint32_t height;
+    uint8_t subsampling;
+
+    // the frame being decoded and its scratch buffers, sized at realize
+    S5L8702JPEGFrame frame;
+    Block *blocks;
+    uint8_t *yplane;
+    uint8_t *cbplane;
+    uint8_t *crplane;
+    unsigned rows_pending;
+    bool discard_frame;
+    bool start_queued;
+    bool irq_pending;
 } S5L8702JPEGState;
 
 #endif
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include "qemu/timer.h"
 #include "hw/sysbus.h"
 #include "hw/irq.h"
+#include "hw/clock.h"
 #include "hw/arm/ipod_nano3g_multitouch.h"
 
 #define TYPE_IPOD_NANO3G_LCD                "ipodnano3g.lcd"
@@ -25,6 +26,10 @@ OBJECT_DECLARE_SIMPLE_TYPE(IPodNano3GLCDState, IPOD_NANO3G_LCD)
 #define LCD_PHTIME (0x020)
 #define LCD_WDATA  (0x040)
 
+#define LCD_WIDTH  240
+#define LCD_HEIGHT 376
+#define LCD_FRAMEBUFFER_BASE 0xfe00000
+
 typedef struct IPodNano3GLCDState
 {
     SysBusDevice parent_obj;
@@ -37,7 +42,7 @@ typedef struct IPodNano3GLCDState
     MemoryRegionSection fbsection;
     qemu_irq irq;
 
-    Fifo8* dbuff_buf;
+    Fifo8 dbuff_buf;
 
     uint32_t lcd_config;
     uint32_t lcd_wcmd;
@@ -49,10 +54,23 @@ typedef struct IPodNano3GLCDState
     uint32_t lcd_phtime;
     uint32_t lcd_wdata;
 
-    uint64_t* lcd_regs; // internal registers in case we ever need to access them in the future
+    uint64_t lcd_regs[0x100]; // internal registers in case we ever need to access them in the future
     
     uint16_t* framebuffer;
-    uint64_t memcnt;
+
+    // column (0x2A) and row (0x2B) window for GRAM writes, and the 0x2C cursor
+    uint8_t window_params[4];
+    uint8_t window_param_count;
+    uint16_t col_start, col_end;
+    uint16_t row_start, row_end;
+    uint16_t cur_col, cur_row;
+
+    // direct view of the framebuffer RAM, and the range written since the last flush
+    MemoryRegionSection gram_section;
+    uint8_t *gram;
+    hwaddr gram_dirty_start, gram_dirty_end;
+    // GRAM changed since the last Red-X check
+    bool red_x_check;
 
     uint32_t unknown1;
     uint32_t unknown2;
@@ -80,6 +98,9 @@ typedef struct IPodNano3GLCDState
     uint32_t w2_qlen;
 
     QEMUTimer *refresh_timer;
+    // refresh interrupts are counted in LCD clock cycles, latched at the boot frequency
+    uint64_t refresh_cycles;
+    Clock *clk;
 } IPodNano3GLCDState;
 
 #endif
\ No newline at end of file
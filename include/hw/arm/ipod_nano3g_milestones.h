@@ -0,0 +1,38 @@
+#ifndef IPOD_NANO3G_MILESTONES_H
+#define IPOD_NANO3G_MILESTONES_H
+
+#include "qemu/osdep.h"
+
+// boot phases worth timing, each one is recorded the first time it is reached
+typedef enum IPodNano3GMilestone {
+    IPOD_NANO3G_MILESTONE_NOR_FIRST_READ,
+    IPOD_NANO3G_MILESTONE_LCD_FIRST_CMD,
+    IPOD_NANO3G_MILESTONE_NAND_FIRST_READ,
+    IPOD_NANO3G_MILESTONE_RED_X,
+    IPOD_NANO3G_MILESTONE__MAX,
+} IPodNano3GMilestone;
+
+// bit per milestone that has not been reached yet, always 0 unless recording
+extern uint32_t ipod_nano3g_milestones_pending;
+
+static inline bool ipod_nano3g_milestone_pending(IPodNano3GMilestone m)
+{
+    return unlikely(ipod_nano3g_milestones_pending & (1U << m));
+}
+
+/*
+ * Starts recording milestones as JSON lines to log_path, along with the
+ * wall time, guest instruction count (with -icount) and MMIO accesses per
+ * memory region at each of them.
+ */
+void ipod_nano3g_milestones_init(const char *log_path, Error **errp);
+void ipod_nano3g_milestone_record(IPodNano3GMilestone m);
+
+static inline void ipod_nano3g_milestone(IPodNano3GMilestone m)
+{
+    if (ipod_nano3g_milestone_pending(m)) {
+        ipod_nano3g_milestone_record(m);
+    }
+}
+
+#endif
@@ -23,6 +23,10 @@ OBJECT_DECLARE_SIMPLE_TYPE(IPodNano3GMultitouchState, IPOD_NANO3G_MULTITOUCH)
 #define MT_SENSOR_REGION_DESC    0x0
 #define MT_SENSOR_REGION_PARAM   0x0
 #define MT_MAX_PACKET_SIZE       0x294 // 660
+
+// only the command header is ever looked at, the rest of the input is dropped
+#define MT_CMD_HEADER_LEN        16
+#define MT_RESPONSE_LEN          0x100
 #define MT_SENSOR_SURFACE_WIDTH  5000
 #define MT_SENSOR_SURFACE_HEIGHT 7500
 
@@ -136,7 +140,9 @@ typedef struct IPodNano3GMultitouchState {
     SSIPeripheral ssidev;
     uint8_t cur_cmd;
     uint8_t *out_buffer;
-    uint8_t *in_buffer;
+    uint8_t *out_storage;
+    uint32_t out_storage_size;
+    uint8_t in_buffer[MT_CMD_HEADER_LEN];
     uint32_t buf_size;
     uint32_t buf_ind;
     uint32_t in_buffer_ind;
@@ -7,10 +7,20 @@
 #include "hw/hw.h"
 #include "hw/irq.h"
 #include "qemu/lockable.h"
+#include "qemu/notify.h"
+#include "qemu/iov.h"
 
 #define NAND_NUM_BANKS 8
 #define NAND_BYTES_PER_PAGE 2048
 #define NAND_BYTES_PER_SPARE 512
+// a page record in the backing image is the page data followed by its spare area
+#define NAND_BYTES_PER_RECORD (NAND_BYTES_PER_PAGE + NAND_BYTES_PER_SPARE)
+
+// geometry without a backing image, covers every page the FTL addresses
+#define NAND_DEFAULT_PAGES_PER_BANK 0x10000
+
+// most pages a single multi-page read can cover
+#define NAND_MAX_BULK_PAGES 512
 
 #define NAND_CHIP_ID 0x7294D7EC
 //#define NAND_CHIP_ID 0xecd79472
@@ -24,6 +34,9 @@
 #define NAND_FMDNUM   0x30
 #define NAND_DMADEST  0x34
 #define NAND_FMCSTAT  0x48
+// bits 1-12 report ready, the banks are assumed to use the FMCTRL0 bank select layout
+#define NAND_FMCSTAT_READY 0x1FFE
+#define NAND_FMCSTAT_BANK_READY(bank) (1 << ((bank) + 1))
 #define NAND_MEMFIFO_STAT  0x40
 #define NAND_MEMFIFO  0x60
 #define NAND_FMFIFO   0x80
@@ -59,17 +72,56 @@
 OBJECT_DECLARE_SIMPLE_TYPE(ITNandState, ITNAND)
 
 #define FMIVSS_DMEM_SIZE 32
+#define FMISS_MAX_OPS 512
+// instructions a program runs before it yields to the main loop
+#define FMISS_SLICE_STEPS 4096
+
+// a pre-decoded FMISS instruction
+typedef struct {
+    uint32_t imm;
+    uint16_t src;
+    uint8_t opcode;
+    uint8_t dst;    // register index, already reduced modulo 8
+    uint8_t sreg;   // src as a register index
+} fmiss_op;
+
 typedef struct {
     uint32_t regs[8];
     // Address _inside_ the main device's DMA memory!
     uint32_t pc;
     uint32_t start_pc;
+    bool running; // started and not terminated yet, resumed from fmiss_bh
 
     uint32_t dmem[FMIVSS_DMEM_SIZE];
 
     AddressSpace *iomem;
+
+    // decoded program, valid for cached_pc as long as its code is unchanged
+    fmiss_op ops[FMISS_MAX_OPS];
+    uint64_t raw[FMISS_MAX_OPS];
+    uint32_t num_ops;
+    uint32_t used_ops;
+    uint32_t cached_pc;
 } fmiss_vm;
 
+// a programmed page, kept in the copy-on-write overlay on top of the base image
+typedef struct ITNandOverlayPage {
+    uint32_t bank;
+    uint32_t page;
+    bool unflushed;
+    uint8_t record[NAND_BYTES_PER_RECORD];
+} ITNandOverlayPage;
+
+// a page write to the overlay image in flight
+typedef struct ITNandPageIO {
+    struct ITNandState *s;
+    uint32_t bank;
+    uint32_t page;
+    uint8_t *record;
+    QEMUIOVector qiov;
+    bool mark_written; // a program's second write, its bit in the overlay bitmap
+} ITNandPageIO;
+
 #define NAND_MEMFIFO_SIZE 8
 typedef struct ITNandState {
     SysBusDevice busdev;
@@ -94,18 +146,52 @@ typedef struct ITNandState {
     uint32_t buffered_page;
     bool reading_multiple_pages;
     uint32_t cur_bank_reading;
-    uint32_t banks_to_read[512]; // used when in multiple page read mode
-    uint32_t pages_to_read[512]; // used when in multiple page read mode
+    uint32_t banks_to_read[NAND_MAX_BULK_PAGES]; // used when in multiple page read mode
+    uint32_t pages_to_read[NAND_MAX_BULK_PAGES]; // used when in multiple page read mode
+    uint8_t *prefetch_buf; // pooled, holds the data of all pages of a multi-page read
+    uint32_t prefetch_pages;
+    uint32_t prefetch_bytes; // migrated size of prefetch_buf
     bool is_writing;
     QemuMutex lock;
     char *nand_path;
 
+    // flat backing image: NAND_NUM_BANKS banks of pages_per_bank records each
+    uint8_t *image;
+    uint64_t image_size;
+    uint32_t pages_per_bank;
+    uint8_t *blank_record;
+
+    // copy-on-write overlay, indexed by page * NAND_NUM_BANKS + bank of a page inside the geometry
+    GHashTable *overlay;
+    bool buffered_in_overlay;
+    bool pristine_on_reset;
+    char *overlay_path;
+    BlockBackend *overlay_blk;
+    // records of the overlay image that hold a programmed page, stored after the records
+    unsigned long *written;
+    bool written_dirty;
+    uint64_t num_records;
+    // flat copy of the overlay, only valid while it is being migrated
+    ITNandOverlayPage *migrate_pages;
+    int32_t migrate_num_pages;
+
+    // asynchronous programs, at most one request per bank is tracked for FMCSTAT
+    ITNandPageIO *inflight[NAND_NUM_BANKS];
+    uint32_t io_pending;
+    bool fmi_int_deferred;
+    NotifierList idle_notifiers;
+
     MemoryRegion *downstream;
     AddressSpace *downstream_as;
 
     fmiss_vm fmiss_vm;
+    QEMUBH *fmiss_bh;
 } ITNandState;
 
 void nand_set_buffered_page(ITNandState *s, uint32_t page);
+void itnand_prefetch_pages(ITNandState *s, uint32_t count);
+bool itnand_io_pending(ITNandState *s);
+// notifiers run once all outstanding page I/O has completed
+void itnand_add_idle_notifier(ITNandState *s, Notifier *notifier);
 
 #endif
\ No newline at end of file
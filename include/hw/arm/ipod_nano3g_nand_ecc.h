@@ -6,6 +6,7 @@
 #include "hw/platform-bus.h"
 #include "hw/hw.h"
 #include "hw/irq.h"
+#include "hw/arm/ipod_nano3g_nand.h"
 
 #define NANDECC_DATA 0x4
 #define NANDECC_ECC 0x8
@@ -25,6 +26,11 @@ typedef struct ITNandECCState {
     uint32_t status;
     uint32_t setup;
     qemu_irq irq;
+
+    // the ECC operation completes only after the NAND page I/O it covers
+    ITNandState *nand_state;
+    Notifier nand_idle;
+    bool irq_deferred;
 } ITNandECCState;
 
 #endif
\ No newline at end of file
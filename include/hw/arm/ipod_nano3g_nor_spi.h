@@ -16,20 +16,30 @@ OBJECT_DECLARE_SIMPLE_TYPE(IPodNano3GNORSPIState, IPOD_NANO3G_NOR_SPI)
 #define NOR_WRITE_STATUS_CMD 0x1
 #define NOR_RESET_CMD 0xFF
 
+// longest command we decode: opcode plus a 24-bit address
+#define NOR_MAX_CMD_LEN 4
+#define NOR_MAX_RESPONSE_LEN 1
+
+// without a full image, the bootloader is served from this offset
+#define NOR_BOOTLOADER_OFFSET 0x8000
+
 typedef struct IPodNano3GNORSPIState {
     SSIPeripheral ssidev;
     uint32_t cur_cmd;
-    uint8_t *in_buf;
-    uint8_t *out_buf;
+    uint8_t in_buf[NOR_MAX_CMD_LEN];
+    uint8_t out_buf[NOR_MAX_RESPONSE_LEN];
     uint32_t in_buf_size;
     uint32_t out_buf_size;
     uint32_t in_buf_cur_ind;
     uint32_t out_buf_cur_ind;
-    uint8_t *bootloader_data;
-    char *bootloader_path;
-    uint8_t *cur_data;
     uint32_t nor_read_ind;
-    bool nor_initialized;
+
+    // contents of the flash, either a mapped image or a synthesized one
+    uint8_t *image;
+    uint64_t image_size;
 } IPodNano3GNORSPIState;
 
+void ipod_nano3g_nor_spi_load(IPodNano3GNORSPIState *s, const char *nor_path,
+                              const char *bootloader_path, Error **errp);
+
 #endif
\ No newline at end of file
@@ -7,12 +7,12 @@
 #include "hw/hw.h"
 #include "exec/hwaddr.h"
 #include "exec/memory.h"
-#include <openssl/sha.h>
 
 #define TYPE_IPOD_NANO3G_SHA1                "ipodnano3g.sha1"
 OBJECT_DECLARE_SIMPLE_TYPE(S5L8702SHA1State, IPOD_NANO3G_SHA1)
 
-#define SHA1_BUFFER_SIZE 1024 * 1024
+#define SHA1_BLOCK_SIZE 0x40
+#define SHA1_DIGEST_WORDS 5
 
 #define SHA_CONFIG         0x0
 #define SHA_RESET          0x4
@@ -27,13 +27,9 @@ typedef struct S5L8702SHA1State {
     uint32_t memory_start;
     uint32_t memory_mode;
     uint32_t insize;
-    uint8_t buffer[SHA1_BUFFER_SIZE];
     uint32_t hw_buffer[0x10]; // hardware buffer
-    uint32_t buffer_ind;
-    uint8_t hashout[0x14];
     bool hw_buffer_dirty;
-    bool hash_computed;
-    SHA_CTX ctx;
+    uint32_t h[SHA1_DIGEST_WORDS]; // running hash state, advanced block by block
 } S5L8702SHA1State;
 
 #endif
\ No newline at end of file
@@ -59,6 +59,7 @@ OBJECT_DECLARE_SIMPLE_TYPE(S5L8702SPIState, S5L8702SPI)
 #define R_TXCNT                 0x04c
 
 #define R_FIFO_DEPTH            50000
+#define SPI_BURST_LEN           4096
 
 #define REG(_s,_v)             ((_s)->regs[(_v)>>2])
 #define MMIO_SIZE              (0x4000)
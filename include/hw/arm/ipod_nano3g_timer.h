@@ -7,6 +7,7 @@
 #include "hw/sysbus.h"
 #include "hw/irq.h"
 #include "hw/clock.h"
+#include "hw/ptimer.h"
 
 #define TYPE_IPOD_NANO3G_TIMER                "ipodnano3g.timer"
 OBJECT_DECLARE_SIMPLE_TYPE(IPodNano3GTimerState, IPOD_NANO3G_TIMER)
@@ -20,31 +21,45 @@ OBJECT_DECLARE_SIMPLE_TYPE(IPodNano3GTimerState, IPOD_NANO3G_TIMER)
 #define TIMER_STATE_MANUALUPDATE 2
 #define NUM_TIMERS 7
 #define TIMER_4 0xA0
+// the channel at TIMER_4, the only one whose ticks reach the interrupt line
+#define TIMER_IRQ_CHANNEL 4
+#define TIMER_CHANNEL_SIZE 0x20
 #define TIMER_CONFIG 0 
 #define TIMER_STATE 0x4
 #define TIMER_COUNT_BUFFER 0x8
 #define TIMER_COUNT_BUFFER2 0xC
+#define TIMER_PRESCALER 0x10
+#define TIMER_COUNT 0x14
+
+#define TIMER_CONFIG_CLKSEL_ECLK (1 << 6)
+#define TIMER_CONFIG_DIVIDER_SHIFT 8
+#define TIMER_CONFIG_DIVIDER_MASK 0x7
+#define TIMER_PRESCALER_MASK 0x3FF
+
+struct IPodNano3GTimerState;
+
+typedef struct IPodNano3GTimerChannel
+{
+    struct IPodNano3GTimerState *s;
+    ptimer_state *ptimer;
+    uint32_t    config;
+    uint32_t    status;
+    uint32_t    bcount1;
+    uint32_t    bcount2;
+    uint32_t    prescaler;
+    bool        gated; // the selected input clock is stopped
+} IPodNano3GTimerChannel;
 
 typedef struct IPodNano3GTimerState
 {
     SysBusDevice busdev;
     MemoryRegion iomem;
+    IPodNano3GTimerChannel channels[NUM_TIMERS];
     uint32_t    ticks_high;
     uint32_t    ticks_low;
-    uint32_t    status;
-    uint32_t    config;
-    uint32_t    bcount1;
-    uint32_t    bcount2;
-    uint32_t    prescaler;
     uint32_t    irqstat;
-    QEMUTimer *st_timer;
-    Clock *sysclk;
-    uint32_t bcreload;
-    uint32_t freq_out;
-    uint64_t tick_interval;
-    uint64_t last_tick;
-    uint64_t next_planned_tick;
-    uint64_t base_time;
+    Clock *pclk;
+    Clock *eclk;
     qemu_irq    irq;
 
 } IPodNano3GTimerState;
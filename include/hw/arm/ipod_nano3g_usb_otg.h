@@ -3,6 +3,8 @@
 
 #include "hw/irq.h"
 #include "hw/usb.h"
+#include "hw/sysbus.h"
+#include "chardev/char-fe.h"
 
 #define DEVICE_NAME		"usb_synopsys"
 
@@ -203,6 +205,31 @@ OBJECT_DECLARE_SIMPLE_TYPE(synopsys_usb_state, S5L8702USBOTG)
 
 #define USB_CONTROLEP 0
 
+// Gadget bridge framing on the "chardev" backend. Every frame starts with
+// this header, all fields little endian, followed by the payload.
+typedef struct QEMU_PACKED _synopsys_usb_gadget_hdr
+{
+	uint8_t type;
+	uint8_t ep;
+	uint16_t reserved;
+	uint32_t length;
+
+} synopsys_usb_gadget_hdr;
+
+// host -> device
+#define USB_GADGET_RESET	0	// bus reset, no payload
+#define USB_GADGET_SETUP	1	// 8 byte SETUP packet for EP0
+#define USB_GADGET_OUT		2	// OUT transfer, length bytes of payload
+#define USB_GADGET_IN		3	// IN token, asks for up to length bytes, no payload
+
+// device -> host
+#define USB_GADGET_IN_DATA	4	// answer to USB_GADGET_IN, may be short
+#define USB_GADGET_OUT_DONE	5	// OUT or SETUP frame consumed, no payload
+#define USB_GADGET_STALL	6	// the endpoint is stalled, frame dropped
+
+// One transfer of the largest DIEPTSIZ/DOEPTSIZ programming
+#define USB_GADGET_MAX_PAYLOAD	(DEPTSIZ_XFERSIZ_MASK + 1)
+
 typedef struct _synopsys_usb_ep_state
 {
 	uint32_t control;
@@ -221,9 +248,15 @@ typedef struct synopsys_usb_state
 	MemoryRegion iomem;
 	qemu_irq irq;
 
-	char *server_host;
-	uint32_t server_port;
-	//tcp_usb_state_t tcp_state;
+	// Gadget bridge: the frame being received, held until an endpoint
+	// is armed for it
+	CharBackend chr;
+	uint8_t *rx_buf;
+	uint32_t rx_len;
+	uint32_t rx_pos;
+
+	MemoryRegion *downstream;
+	AddressSpace dma_as;
 
 	uint32_t pcgcctl;
 
@@ -262,6 +295,6 @@ typedef struct synopsys_usb_state
 
 } synopsys_usb_state;
 
-DeviceState *ipod_nano3g_init_usb_otg(qemu_irq _irq, uint32_t _hwcfg[4]);
+DeviceState *ipod_nano3g_init_usb_otg(qemu_irq _irq, uint32_t _hwcfg[4], MemoryRegion *_downstream);
 
 #endif
\ No newline at end of file
@@ -220,6 +220,8 @@ typedef struct SavedIOTLB {
 struct KVMState;
 struct kvm_run;
 
+struct IdlePollState;
+
 struct hax_vcpu_state;
 struct hvf_vcpu_state;
 
@@ -284,6 +286,7 @@ struct qemu_work_item;
  *      only have a single AddressSpace
  * @env_ptr: Pointer to subclass-specific CPUArchState field.
  * @icount_decr_ptr: Pointer to IcountDecr field within subclass.
+ * @idle_poll: TCG idle-poll detector state, NULL unless it is enabled.
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
@@ -353,6 +356,7 @@ struct CPUState {
 
     void *env_ptr; /* CPUArchState */
     IcountDecr *icount_decr_ptr;
+    struct IdlePollState *idle_poll;
 
     /* Accessed in parallel; all accesses must be atomic */
     TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
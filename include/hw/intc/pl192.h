@@ -50,6 +50,11 @@ struct PL192State {
     uint32_t vect_priority[PL192_INT_SOURCES];
     uint32_t address;
 
+    /* Sources assigned to each priority level, and the levels
+       that have at least one of their sources pending */
+    uint32_t prio_sources[PL192_PRIO_LEVELS];
+    uint32_t prio_pending;
+
     /* Currently processed interrupt and
        highest priority interrupt */
     uint32_t current;
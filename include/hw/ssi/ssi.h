@@ -54,6 +54,16 @@ struct SSIPeripheralClass {
      * always be called for the device for every txrx access to the parent bus
      */
     uint32_t (*transfer_raw)(SSIPeripheral *dev, uint32_t val);
+
+    /* Optional, for 8-bit peripherals that can move a run of bytes at once.
+     * Clocks out @len bytes from @tx (or 0xff filler bytes if @tx is NULL)
+     * and stores what the device shifts back in @rx. Returns the number of
+     * bytes handled, which may be short of @len; ssi_transfer_bulk() moves
+     * the rest one ssi_transfer() at a time. Only used with standard CS
+     * behaviour, i.e. when transfer_raw is not overridden.
+     */
+    uint32_t (*transfer_bulk)(SSIPeripheral *dev, const uint8_t *tx,
+                              uint8_t *rx, uint32_t len);
 };
 
 struct SSIPeripheral {
@@ -106,4 +116,17 @@ SSIBus *ssi_create_bus(DeviceState *parent, const char *name);
 
 uint32_t ssi_transfer(SSIBus *bus, uint32_t val);
 
+/**
+ * ssi_transfer_bulk: transfer a run of 8-bit words
+ * @bus: SSI bus to transfer on
+ * @tx: words to send, or NULL to send 0xff filler words
+ * @rx: buffer receiving @len words
+ * @len: number of words
+ *
+ * Equivalent to calling ssi_transfer() once per word, but lets a single
+ * peripheral that implements transfer_bulk move the whole run at once.
+ */
+void ssi_transfer_bulk(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                       uint32_t len);
+
 #endif
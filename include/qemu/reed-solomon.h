@@ -0,0 +1,74 @@
+/*
+ * Reed-Solomon codes over GF(2^m)
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_REED_SOLOMON_H
+#define QEMU_REED_SOLOMON_H
+
+#define REED_SOLOMON_MAX_SYMSIZE 16
+#define REED_SOLOMON_MAX_ROOTS   64
+
+typedef struct ReedSolomon ReedSolomon;
+
+/**
+ * reed_solomon_new:
+ * @symsize: symbol size in bits, the code works over GF(2^@symsize)
+ * @gfpoly: primitive polynomial generating the field, including the
+ *          x^@symsize term
+ * @fcr: first consecutive root of the generator polynomial, as a power of
+ *       the primitive element
+ * @nroots: number of roots, i.e. parity symbols; up to @nroots / 2 symbol
+ *          errors can be corrected
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Sets up the tables for a (shortened) Reed-Solomon code. Codewords hold
+ * at most 2^@symsize - 1 symbols, parity included.
+ *
+ * Returns: the new code, or NULL if the parameters are invalid.
+ */
+ReedSolomon *reed_solomon_new(unsigned int symsize, unsigned int gfpoly,
+                              unsigned int fcr, unsigned int nroots,
+                              Error **errp);
+
+void reed_solomon_free(ReedSolomon *rs);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(ReedSolomon, reed_solomon_free)
+
+/**
+ * reed_solomon_max_len:
+ * @rs: the code
+ *
+ * Returns: the largest number of data symbols a codeword can hold.
+ */
+unsigned int reed_solomon_max_len(const ReedSolomon *rs);
+
+/**
+ * reed_solomon_encode:
+ * @rs: the code
+ * @data: @len data symbols, only their low symsize bits are used
+ * @len: number of data symbols, at most reed_solomon_max_len()
+ * @parity: receives nroots parity symbols
+ */
+void reed_solomon_encode(const ReedSolomon *rs, const uint16_t *data,
+                         size_t len, uint16_t *parity);
+
+/**
+ * reed_solomon_decode:
+ * @rs: the code
+ * @data: @len data symbols
+ * @len: number of data symbols, at most reed_solomon_max_len()
+ * @parity: the nroots parity symbols stored with @data
+ *
+ * Checks @data against @parity and corrects errors in either of them in
+ * place. Codewords without errors only cost an encode and a comparison.
+ *
+ * Returns: the number of corrected symbols, or -EBADMSG if the codeword
+ * has more errors than the code can correct.
+ */
+int reed_solomon_decode(const ReedSolomon *rs, uint16_t *data, size_t len,
+                        uint16_t *parity);
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * TCG idle-poll detector
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_IDLE_POLL_H
+#define SYSEMU_IDLE_POLL_H
+
+/**
+ * tcg_idle_poll_enable: Let vCPUs that spin on device status registers sleep
+ * @threshold: number of identical reads after which a vCPU is considered idle
+ * @max_sleep_ns: upper bound for a single sleep
+ *
+ * Machines call this once their devices have declared their pollable
+ * registers with memory_region_set_pollable().  A vCPU that keeps reading
+ * the same value from such a register at the same guest instruction, with
+ * no other MMIO access in between, is put to sleep until the next
+ * QEMU_CLOCK_VIRTUAL deadline, an interrupt or tcg_idle_poll_wake(),
+ * whichever comes first.
+ *
+ * The detector only runs with multi-threaded TCG: under icount guest time
+ * follows the instruction count, so sleeping would not let it advance.
+ *
+ * Returns: true if the detector is now enabled.
+ */
+bool tcg_idle_poll_enable(unsigned int threshold, int64_t max_sleep_ns);
+
+/**
+ * tcg_idle_poll_wake: Wake up vCPUs sleeping on a pollable register
+ *
+ * Devices call this, with the BQL held, when a pollable register changes
+ * outside of a QEMU_CLOCK_VIRTUAL timer or an interrupt, e.g. from an AIO
+ * completion.
+ */
+void tcg_idle_poll_wake(void);
+
+#endif
@@ -940,6 +940,15 @@ static void hmp_info_mtree(Monitor *mon, const QDict *qdict)
     mtree_info(flatview, dispatch_tree, owner, disabled);
 }
 
+static void hmp_info_mtree_profile(Monitor *mon, const QDict *qdict)
+{
+    int64_t max = qdict_get_try_int(qdict, "max", 10);
+    bool by_count = qdict_get_try_bool(qdict, "by_count", false);
+    bool buckets = qdict_get_try_bool(qdict, "buckets", false);
+
+    mtree_profile_info(max, by_count, buckets);
+}
+
 /* Capture support */
 static QLIST_HEAD (capture_list_head, CaptureState) capture_head;
 
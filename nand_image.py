@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+
+# Converts between the per-page NAND directory layout (<dir>/bankN/P.page, each
+# file holding 2048 bytes of page data followed by 512 bytes of spare) and the
+# flat NAND image used by the emulator (-M iPod-Nano3G,nand=<image>).
+#
+# The flat image holds 8 banks, one after another, of pages_per_bank records.
+# Every record is the page data followed by its spare area. Pages that have no
+# file in the directory layout are stored as empty pages carrying the FTL mark
+# at spare offset 0xA, which is what the emulator used to synthesize for them.
+#
+# Usage: ./nand_image.py import <page dir> <output image> [--pages-per-bank N]
+#        ./nand_image.py export <image> <output page dir>
+
+import argparse
+import os
+import re
+import sys
+
+NUM_BANKS = 8
+BYTES_PER_PAGE = 2048
+BYTES_PER_SPARE = 512
+BYTES_PER_RECORD = BYTES_PER_PAGE + BYTES_PER_SPARE
+
+EMPTY_RECORD = bytearray(BYTES_PER_RECORD)
+EMPTY_RECORD[BYTES_PER_PAGE + 0xA] = 0xFF
+EMPTY_RECORD = bytes(EMPTY_RECORD)
+
+PAGE_FILE = re.compile(r'^(\d+)\.page$')
+
+
+def list_pages(bank_dir):
+    if not os.path.isdir(bank_dir):
+        return {}
+    pages = {}
+    for name in os.listdir(bank_dir):
+        m = PAGE_FILE.match(name)
+        if m:
+            pages[int(m.group(1))] = os.path.join(bank_dir, name)
+    return pages
+
+
+def do_import(args):
+    banks = [list_pages(os.path.join(args.dir, 'bank%d' % bank)) for bank in range(NUM_BANKS)]
+
+    pages_per_bank = args.pages_per_bank
+    if pages_per_bank is None:
+        pages_per_bank = max([max(pages) + 1 for pages in banks if pages] or [1])
+
+    with open(args.image, 'wb') as out:
+        for bank, pages in enumerate(banks):
+            for page in range(pages_per_bank):
+                path = pages.get(page)
+                if path is None:
+                    out.write(EMPTY_RECORD)
+                    continue
+                with open(path, 'rb') as f:
+                    record = f.read(BYTES_PER_RECORD)
+                out.write(record.ljust(BYTES_PER_RECORD, b'\0'))
+            skipped = [page for page in pages if page >= pages_per_bank]
+            if skipped:
+                print('bank%d: dropped %d pages beyond --pages-per-bank' % (bank, len(skipped)),
+                      file=sys.stderr)
+
+    print('%s: %d banks x %d pages' % (args.image, NUM_BANKS, pages_per_bank))
+
+
+def do_export(args):
+    size = os.path.getsize(args.image)
+    if size == 0 or size % (NUM_BANKS * BYTES_PER_RECORD) != 0:
+        sys.exit('%s is not a flat NAND image' % args.image)
+    pages_per_bank = size // (NUM_BANKS * BYTES_PER_RECORD)
+
+    written = 0
+    with open(args.image, 'rb') as f:
+        for bank in range(NUM_BANKS):
+            bank_dir = os.path.join(args.dir, 'bank%d' % bank)
+            os.makedirs(bank_dir, exist_ok=True)
+            for page in range(pages_per_bank):
+                record = f.read(BYTES_PER_RECORD)
+                if record == EMPTY_RECORD:
+                    continue
+                with open(os.path.join(bank_dir, '%d.page' % page), 'wb') as out:
+                    out.write(record)
+                written += 1
+
+    print('%s: wrote %d non-empty pages' % (args.dir, written))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Convert between NAND page directories and flat NAND images')
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    p = sub.add_parser('import', help='build a flat image from a page directory')
+    p.add_argument('dir')
+    p.add_argument('image')
+    p.add_argument('--pages-per-bank', type=int, default=None,
+                   help='pages per bank (default: highest page number found + 1)')
+    p.set_defaults(func=do_import)
+
+    p = sub.add_parser('export', help='split a flat image into a page directory')
+    p.add_argument('image')
+    p.add_argument('dir')
+    p.set_defaults(func=do_export)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
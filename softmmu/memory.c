@@ -18,10 +18,14 @@
 #include "qapi/error.h"
 #include "exec/memory.h"
 #include "qapi/visitor.h"
+#include "qapi/qapi-commands-machine.h"
+#include "qapi/util.h"
 #include "qemu/bitops.h"
+#include "qemu/bitmap.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/qemu-print.h"
+#include "qemu/lockable.h"
 #include "qom/object.h"
 #include "trace.h"
 
@@ -1435,6 +1439,145 @@ static MemTxResult memory_region_dispatch_read1(MemoryRegion *mr,
     }
 }
 
+static bool memory_region_profiling;
+static bool memory_region_counting;
+static QemuMutex memory_region_profile_lock;
+static QTAILQ_HEAD(, MemoryRegionProfile) memory_region_profiles =
+    QTAILQ_HEAD_INITIALIZER(memory_region_profiles);
+
+static void memory_region_profile_init(void)
+{
+    static bool initialized;
+
+    if (!initialized) {
+        qemu_mutex_init(&memory_region_profile_lock);
+        initialized = true;
+    }
+}
+
+static void memory_region_profile_stats_add(MemoryRegionProfileStats *stats,
+                                            unsigned size, bool is_write,
+                                            int64_t ns)
+{
+    if (is_write) {
+        stats->writes++;
+        stats->bytes_written += size;
+    } else {
+        stats->reads++;
+        stats->bytes_read += size;
+    }
+    stats->ns += ns;
+}
+
+/*
+ * Accounting takes a lock of its own so that regions dispatched without
+ * the BQL are counted exactly too; it is only ever taken while profiling.
+ */
+static void memory_region_profile_access(MemoryRegion *mr, hwaddr addr,
+                                         unsigned size, bool is_write,
+                                         int64_t ns)
+{
+    hwaddr offset = QEMU_ALIGN_DOWN(addr, MEMORY_REGION_PROFILE_BUCKET_SIZE);
+    MemoryRegionProfile *profile;
+    MemoryRegionProfileStats *bucket;
+
+    QEMU_LOCK_GUARD(&memory_region_profile_lock);
+    profile = mr->profile;
+    if (!profile) {
+        profile = g_new0(MemoryRegionProfile, 1);
+        profile->mr = mr;
+        profile->buckets = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                                 NULL, g_free);
+        QTAILQ_INSERT_TAIL(&memory_region_profiles, profile, next);
+        mr->profile = profile;
+    }
+
+    bucket = g_hash_table_lookup(profile->buckets, &offset);
+    if (!bucket) {
+        bucket = g_new0(MemoryRegionProfileStats, 1);
+        bucket->offset = offset;
+        g_hash_table_insert(profile->buckets, &bucket->offset, bucket);
+    }
+
+    memory_region_profile_stats_add(&profile->total, size, is_write, ns);
+    memory_region_profile_stats_add(bucket, size, is_write, ns);
+}
+
+static void memory_region_profile_free(MemoryRegionProfile *profile)
+{
+    QTAILQ_REMOVE(&memory_region_profiles, profile, next);
+    profile->mr->profile = NULL;
+    g_hash_table_destroy(profile->buckets);
+    g_free(profile);
+}
+
+static void memory_region_profile_release(MemoryRegion *mr)
+{
+    if (!mr->profile) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&memory_region_profile_lock);
+    memory_region_profile_free(mr->profile);
+}
+
+void memory_region_set_profiling(bool enable)
+{
+    memory_region_profile_init();
+    qatomic_set(&memory_region_profiling, enable);
+}
+
+bool memory_region_profiling_enabled(void)
+{
+    return qatomic_read(&memory_region_profiling);
+}
+
+void memory_region_profile_reset(void)
+{
+    MemoryRegionProfile *profile, *next;
+
+    memory_region_profile_init();
+    QEMU_LOCK_GUARD(&memory_region_profile_lock);
+    QTAILQ_FOREACH_SAFE(profile, &memory_region_profiles, next, next) {
+        memory_region_profile_free(profile);
+    }
+}
+
+void memory_region_profile_foreach(MemoryRegionProfileFunc fn, void *opaque)
+{
+    MemoryRegionProfile *profile;
+
+    memory_region_profile_init();
+    QEMU_LOCK_GUARD(&memory_region_profile_lock);
+    QTAILQ_FOREACH(profile, &memory_region_profiles, next) {
+        fn(profile, opaque);
+    }
+}
+
+void memory_region_set_counting(bool enable)
+{
+    qatomic_set(&memory_region_counting, enable);
+}
+
+void memory_region_count_foreach(AddressSpace *as, MemoryRegionCountFunc fn,
+                                 void *opaque)
+{
+    g_autoptr(GHashTable) seen = g_hash_table_new(NULL, NULL);
+    FlatView *view = address_space_get_flatview(as);
+    FlatRange *fr;
+
+    /* A region split into several ranges is reported once */
+    FOR_EACH_FLAT_RANGE(fr, view) {
+        uint64_t reads = stat64_get(&fr->mr->count_reads);
+        uint64_t writes = stat64_get(&fr->mr->count_writes);
+
+        if ((reads || writes) && g_hash_table_add(seen, fr->mr)) {
+            fn(fr->mr, reads, writes, opaque);
+        }
+    }
+    flatview_unref(view);
+}
+
 MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
                                         hwaddr addr,
                                         uint64_t *pval,
@@ -1449,7 +1592,18 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
         return MEMTX_DECODE_ERROR;
     }
 
-    r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
+    if (unlikely(qatomic_read(&memory_region_counting))) {
+        stat64_add(&mr->count_reads, 1);
+    }
+    if (unlikely(qatomic_read(&memory_region_profiling))) {
+        int64_t start = get_clock();
+
+        r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
+        memory_region_profile_access(mr, addr, size, false,
+                                     get_clock() - start);
+    } else {
+        r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
+    }
     adjust_endianness(mr, pval, op);
     return r;
 }
@@ -1480,21 +1634,12 @@ static bool memory_region_dispatch_write_eventfds(MemoryRegion *mr,
     return false;
 }
 
-MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
-                                         hwaddr addr,
-                                         uint64_t data,
-                                         MemOp op,
-                                         MemTxAttrs attrs)
+static MemTxResult memory_region_dispatch_write1(MemoryRegion *mr,
+                                                 hwaddr addr,
+                                                 uint64_t data,
+                                                 unsigned size,
+                                                 MemTxAttrs attrs)
 {
-    unsigned size = memop_size(op);
-
-    if (!memory_region_access_valid(mr, addr, size, true, attrs)) {
-        unassigned_mem_write(mr, addr, data, size);
-        return MEMTX_DECODE_ERROR;
-    }
-
-    adjust_endianness(mr, &data, op);
-
     if ((!kvm_eventfds_enabled()) &&
         memory_region_dispatch_write_eventfds(mr, addr, data, size, attrs)) {
         return MEMTX_OK;
@@ -1516,6 +1661,37 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
     }
 }
 
+MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
+                                         hwaddr addr,
+                                         uint64_t data,
+                                         MemOp op,
+                                         MemTxAttrs attrs)
+{
+    unsigned size = memop_size(op);
+    MemTxResult r;
+
+    if (!memory_region_access_valid(mr, addr, size, true, attrs)) {
+        unassigned_mem_write(mr, addr, data, size);
+        return MEMTX_DECODE_ERROR;
+    }
+
+    adjust_endianness(mr, &data, op);
+
+    if (unlikely(qatomic_read(&memory_region_counting))) {
+        stat64_add(&mr->count_writes, 1);
+    }
+    if (unlikely(qatomic_read(&memory_region_profiling))) {
+        int64_t start = get_clock();
+
+        r = memory_region_dispatch_write1(mr, addr, data, size, attrs);
+        memory_region_profile_access(mr, addr, size, true,
+                                     get_clock() - start);
+        return r;
+    }
+
+    return memory_region_dispatch_write1(mr, addr, data, size, attrs);
+}
+
 void memory_region_init_io(MemoryRegion *mr,
                            Object *owner,
                            const MemoryRegionOps *ops,
@@ -1755,6 +1931,8 @@ static void memory_region_finalize(Object *obj)
 
     mr->destructor(mr);
     memory_region_clear_coalescing(mr);
+    memory_region_profile_release(mr);
+    g_free(mr->pollable);
     g_free((char *)mr->name);
     g_free(mr->ioeventfds);
 }
@@ -2129,6 +2307,23 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
     memory_region_transaction_commit();
 }
 
+void memory_region_set_pollable(MemoryRegion *mr, hwaddr offset, hwaddr size)
+{
+    uint64_t nbits = DIV_ROUND_UP(memory_region_size(mr),
+                                  MEMORY_REGION_POLLABLE_GRANULE);
+
+    assert(!memory_region_is_ram(mr) && mr->ops);
+    assert(offset % MEMORY_REGION_POLLABLE_GRANULE == 0 && size &&
+           size % MEMORY_REGION_POLLABLE_GRANULE == 0);
+    assert(offset + size <= memory_region_size(mr));
+
+    if (!mr->pollable) {
+        mr->pollable = bitmap_new(nbits);
+    }
+    bitmap_set(mr->pollable, offset / MEMORY_REGION_POLLABLE_GRANULE,
+               size / MEMORY_REGION_POLLABLE_GRANULE);
+}
+
 void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size)
 {
@@ -3338,6 +3533,161 @@ void mtree_info(bool flatview, bool dispatch_tree, bool owner, bool disabled)
     }
 }
 
+/* MMIO profile reporting */
+
+#define MTREE_PROFILE_MAX_BUCKETS 8
+
+static hwaddr mtree_profile_address(MemoryRegion *mr)
+{
+    hwaddr addr = 0;
+
+    for (; mr; mr = mr->container) {
+        addr += mr->addr;
+    }
+    return addr;
+}
+
+static uint64_t mtree_profile_key(const MemoryRegionProfileStats *stats,
+                                  bool by_count)
+{
+    return by_count ? stats->reads + stats->writes : stats->ns;
+}
+
+static gint mtree_profile_cmp(gconstpointer a, gconstpointer b,
+                              gpointer by_count)
+{
+    const MemoryRegionProfileStats *sa = *(MemoryRegionProfileStats **)a;
+    const MemoryRegionProfileStats *sb = *(MemoryRegionProfileStats **)b;
+    uint64_t ka = mtree_profile_key(sa, GPOINTER_TO_INT(by_count));
+    uint64_t kb = mtree_profile_key(sb, GPOINTER_TO_INT(by_count));
+
+    return ka < kb ? 1 : ka > kb ? -1 : 0;
+}
+
+static void mtree_profile_print_stats(const char *indent, const char *name,
+                                      hwaddr addr,
+                                      const MemoryRegionProfileStats *stats)
+{
+    uint64_t accesses = stats->reads + stats->writes;
+
+    qemu_printf("%s%-*s " TARGET_FMT_plx " %12" PRIu64 " %12" PRIu64
+                " %14" PRIu64 " %12.3f %8" PRIu64 "\n",
+                indent, (int)(32 - strlen(indent)), name, addr,
+                stats->reads, stats->writes,
+                stats->bytes_read + stats->bytes_written,
+                stats->ns / 1e6, accesses ? stats->ns / accesses : 0);
+}
+
+void mtree_profile_info(int64_t max, bool by_count, bool buckets)
+{
+    g_autoptr(GPtrArray) profiles = g_ptr_array_new();
+    MemoryRegionProfile *profile;
+
+    memory_region_profile_init();
+    QEMU_LOCK_GUARD(&memory_region_profile_lock);
+
+    qemu_printf("MMIO profiling is %s\n",
+                memory_region_profiling_enabled() ? "on" : "off");
+    if (QTAILQ_EMPTY(&memory_region_profiles)) {
+        return;
+    }
+
+    QTAILQ_FOREACH(profile, &memory_region_profiles, next) {
+        g_ptr_array_add(profiles, &profile->total);
+    }
+    g_ptr_array_sort_with_data(profiles, mtree_profile_cmp,
+                               GINT_TO_POINTER(by_count));
+
+    qemu_printf("%-32s %-16s %12s %12s %14s %12s %8s\n", "Region", "Address",
+                "Reads", "Writes", "Bytes", "Time (ms)", "ns/acc");
+    for (guint i = 0; i < profiles->len && i < max; i++) {
+        profile = container_of(g_ptr_array_index(profiles, i),
+                               MemoryRegionProfile, total);
+        mtree_profile_print_stats("", memory_region_name(profile->mr),
+                                  mtree_profile_address(profile->mr),
+                                  &profile->total);
+
+        if (buckets) {
+            g_autoptr(GPtrArray) sorted = g_ptr_array_new();
+            GHashTableIter iter;
+            gpointer value;
+
+            g_hash_table_iter_init(&iter, profile->buckets);
+            while (g_hash_table_iter_next(&iter, NULL, &value)) {
+                g_ptr_array_add(sorted, value);
+            }
+            g_ptr_array_sort_with_data(sorted, mtree_profile_cmp,
+                                       GINT_TO_POINTER(by_count));
+            for (guint j = 0; j < sorted->len && j < MTREE_PROFILE_MAX_BUCKETS;
+                 j++) {
+                MemoryRegionProfileStats *bucket = g_ptr_array_index(sorted, j);
+                g_autofree char *offset = g_strdup_printf("+0x%" HWADDR_PRIx,
+                                                          bucket->offset);
+
+                mtree_profile_print_stats("  ", offset,
+                                          mtree_profile_address(profile->mr) +
+                                          bucket->offset, bucket);
+            }
+        }
+    }
+}
+
+static void mtree_profile_fill(MtreeProfileStats *dst,
+                               const MemoryRegionProfileStats *src)
+{
+    dst->reads = src->reads;
+    dst->writes = src->writes;
+    dst->bytes_read = src->bytes_read;
+    dst->bytes_written = src->bytes_written;
+    dst->ns = src->ns;
+}
+
+static void mtree_profile_add_region(MemoryRegionProfile *profile, void *opaque)
+{
+    MtreeProfileRegionList ***tail = opaque;
+    MtreeProfileRegion *region = g_new0(MtreeProfileRegion, 1);
+    MtreeProfileBucketList **bucket_tail = &region->buckets;
+    GHashTableIter iter;
+    gpointer value;
+
+    mtree_profile_fill(qapi_MtreeProfileRegion_base(region), &profile->total);
+    region->name = g_strdup(memory_region_name(profile->mr));
+    if (profile->mr->owner) {
+        region->owner = object_get_canonical_path(profile->mr->owner);
+        region->has_owner = region->owner != NULL;
+    }
+    region->address = mtree_profile_address(profile->mr);
+
+    g_hash_table_iter_init(&iter, profile->buckets);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        MemoryRegionProfileStats *stats = value;
+        MtreeProfileBucket *bucket = g_new0(MtreeProfileBucket, 1);
+
+        mtree_profile_fill(qapi_MtreeProfileBucket_base(bucket), stats);
+        bucket->offset = stats->offset;
+        QAPI_LIST_APPEND(bucket_tail, bucket);
+    }
+
+    QAPI_LIST_APPEND(*tail, region);
+}
+
+void qmp_x_mtree_profile_enable(bool enable, Error **errp)
+{
+    memory_region_set_profiling(enable);
+}
+
+MtreeProfileRegionList *qmp_x_query_mtree_profile(bool has_reset, bool reset,
+                                                  Error **errp)
+{
+    MtreeProfileRegionList *head = NULL, **tail = &head;
+
+    memory_region_profile_foreach(mtree_profile_add_region, &tail);
+    if (has_reset && reset) {
+        memory_region_profile_reset();
+    }
+    return head;
+}
+
 void memory_region_init_ram(MemoryRegion *mr,
                             Object *owner,
                             const char *name,
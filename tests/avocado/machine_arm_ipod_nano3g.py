@@ -0,0 +1,180 @@
+# Boot-phase benchmark for the iPod-Nano3G machine
+#
+# Boots the machine headless and collects the milestones it logs (see
+# hw/arm/ipod_nano3g_milestones.c): wall time, guest instructions and MMIO
+# accesses per memory region at the first NOR read, first LCD command, first
+# NAND read and the Red-X screen. The records are kept as milestones.json in
+# the test's output directory, so runs can be compared over time.
+#
+# The synthetic tests need no firmware: a tiny bootrom loads a Red-X picture
+# from a generated NAND image and streams it to the LCD. To time a real boot,
+# point IPOD_NANO3G_BOOTROM at the bootrom and IPOD_NANO3G_NOR (or
+# IPOD_NANO3G_BOOTLOADER) and optionally IPOD_NANO3G_NAND at the images.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or
+# later.  See the COPYING file in the top-level directory.
+
+import json
+import os
+import struct
+import time
+
+from avocado import skipUnless
+from avocado_qemu import QemuSystemTest
+
+# the bootrom is mapped at 0 and patched at 0x58c and 0x6c0 on load
+BOOTROM_SIZE = 0x10000
+
+LCD_WIDTH = 240
+LCD_HEIGHT = 376
+
+# NAND geometry of the synthetic image, the picture sits in the first pages of bank 0
+NAND_BANKS = 8
+NAND_PAGES_PER_BANK = 128
+NAND_PAGE_SIZE = 2048
+NAND_SPARE_SIZE = 512
+SPLASH_PAGES = 89               # two RGB565 pixels per word, rounded up to whole pages
+
+# loads the boot picture from NAND through the FMI FIFO and streams it to the LCD, then spins
+SYNTHETIC_BOOTROM = [
+    0xe3a0030e,     # mov   r0, #0x38000000
+    0xe380460a,     # orr   r4, r0, #0xa00000       @ NAND controller
+    0xe3800603,     # orr   r0, r0, #0x300000       @ LCD controller
+    0xe3a0102c,     # mov   r1, #0x2c               @ memory write
+    0xe5801004,     # str   r1, [r0, #4]            @ LCD_WCMD
+    0xe3a01002,     # mov   r1, #2
+    0xe5841000,     # str   r1, [r4]                @ FMCTRL0, bank 0
+    0xe3a05000,     # mov   r5, #0                  @ page
+    0xe3a01b02,     # 1: mov r1, #0x800
+    0xe2411001,     # sub   r1, r1, #1
+    0xe5841030,     # str   r1, [r4, #0x30]         @ FMDNUM, one page
+    0xe1a01805,     # lsl   r1, r5, #16
+    0xe584100c,     # str   r1, [r4, #0xc]          @ FMADDR0
+    0xe3a01000,     # mov   r1, #0
+    0xe5841010,     # str   r1, [r4, #0x10]         @ FMADDR1
+    0xe3a01030,     # mov   r1, #0x30
+    0xe5841008,     # str   r1, [r4, #8]            @ CMD, read
+    0xe3a01000,     # mov   r1, #0
+    0xe5841008,     # str   r1, [r4, #8]            @ CMD, read page
+    0xe3a03c02,     # mov   r3, #0x200              @ words per page
+    0xe5942080,     # 2: ldr r2, [r4, #0x80]        @ FMFIFO
+    0xe5802040,     # str   r2, [r0, #0x40]         @ LCD_WDATA, low pixel
+    0xe1a02822,     # lsr   r2, r2, #16
+    0xe5802040,     # str   r2, [r0, #0x40]         @ LCD_WDATA, high pixel
+    0xe2533001,     # subs  r3, r3, #1
+    0x1afffff9,     # bne   2b
+    0xe2855001,     # add   r5, r5, #1
+    0xe3550059,     # cmp   r5, #SPLASH_PAGES
+    0x1affffea,     # bne   1b
+    0xe3a01029,     # mov   r1, #0x29               @ display on
+    0xe5801004,     # str   r1, [r0, #4]            @ LCD_WCMD
+    0xeafffffe,     # b     .
+]
+
+
+def red_x_pixel(i):
+    # the pixels past the end of the screen wrap around to the top again
+    y, x = divmod(i % (LCD_WIDTH * LCD_HEIGHT), LCD_WIDTH)
+    d1 = abs(x * LCD_HEIGHT - y * LCD_WIDTH)
+    d2 = abs((LCD_WIDTH - 1 - x) * LCD_HEIGHT - y * LCD_WIDTH)
+    return 0xf800 if min(d1, d2) < 8 * LCD_HEIGHT else 0
+
+
+class IPodNano3GBoot(QemuSystemTest):
+    """
+    :avocado: tags=arch:arm
+    :avocado: tags=machine:iPod-Nano3G
+    """
+
+    timeout = 120
+
+    def read_milestones(self, path):
+        if not os.path.exists(path):
+            return []
+        with open(path) as f:
+            return [json.loads(line) for line in f if line.endswith('\n')]
+
+    def wait_for_milestones(self, path, names, timeout):
+        deadline = time.monotonic() + timeout
+        seen = set()
+        while time.monotonic() < deadline:
+            seen = {r['milestone'] for r in self.read_milestones(path)}
+            if names <= seen:
+                return
+            time.sleep(0.1)
+        self.fail('milestones %s not reached within %ds' %
+                  (sorted(names - seen), timeout))
+
+    def run_boot(self, machine_opts, milestones, timeout, extra_args=(), settle=0):
+        log = os.path.join(self.workdir, 'milestones.jsonl')
+        self.vm.add_args('-M', ','.join(['iPod-Nano3G'] + machine_opts +
+                                        ['milestone-log=' + log]))
+        self.vm.add_args(*extra_args)
+        self.vm.launch()
+        self.wait_for_milestones(log, set(milestones), timeout)
+        time.sleep(settle)
+        self.vm.shutdown()
+
+        records = self.read_milestones(log)
+        self.assertEqual(records[-1]['milestone'], 'exit')
+        wall = [r['wall-ns'] for r in records]
+        self.assertEqual(wall, sorted(wall))
+
+        with open(os.path.join(self.outputdir, 'milestones.json'), 'w') as f:
+            json.dump(records, f, indent=2)
+        for r in records:
+            mmio = sum(m['reads'] + m['writes'] for m in r['mmio'])
+            self.log.info('%-16s %8.3f ms %12s insns %10d mmio', r['milestone'],
+                          r['wall-ns'] / 1e6, r.get('insns', '-'), mmio)
+        return records
+
+    def write_synthetic_images(self, picture):
+        bootrom = os.path.join(self.workdir, 'bootrom.bin')
+        with open(bootrom, 'wb') as f:
+            code = struct.pack('<%dI' % len(SYNTHETIC_BOOTROM), *SYNTHETIC_BOOTROM)
+            f.write(code.ljust(BOOTROM_SIZE, b'\0'))
+
+        nand = os.path.join(self.workdir, 'nand.bin')
+        record = NAND_PAGE_SIZE + NAND_SPARE_SIZE
+        with open(nand, 'wb') as f:
+            f.truncate(NAND_BANKS * NAND_PAGES_PER_BANK * record)
+            if picture:
+                pixels = SPLASH_PAGES * NAND_PAGE_SIZE // 2
+                data = struct.pack('<%dH' % pixels, *map(red_x_pixel, range(pixels)))
+                for page in range(SPLASH_PAGES):
+                    f.seek(page * record)
+                    f.write(data[page * NAND_PAGE_SIZE:(page + 1) * NAND_PAGE_SIZE])
+        return ['bootrom=' + bootrom, 'nand=' + nand]
+
+    def test_synthetic(self):
+        records = self.run_boot(self.write_synthetic_images(True),
+                                ['lcd-first-cmd', 'nand-first-read', 'red-x'], 30,
+                                ['-icount', 'shift=0,sleep=off'], settle=1)
+
+        # the Red-X screen only shows up once the picture made it from NAND to the LCD
+        by_name = {r['milestone']: r for r in records}
+        self.assertLess(by_name['lcd-first-cmd']['insns'], by_name['nand-first-read']['insns'])
+        self.assertLess(by_name['nand-first-read']['insns'], by_name['red-x']['insns'])
+        mmio = {m['region']: m for m in by_name['exit']['mmio']}
+        self.assertGreaterEqual(mmio['nand']['reads'], SPLASH_PAGES * NAND_PAGE_SIZE // 4)
+        self.assertGreaterEqual(mmio['lcd']['writes'], SPLASH_PAGES * NAND_PAGE_SIZE // 2)
+
+    def test_synthetic_blank_nand(self):
+        records = self.run_boot(self.write_synthetic_images(False),
+                                ['lcd-first-cmd', 'nand-first-read'], 30,
+                                ['-icount', 'shift=0,sleep=off'], settle=2)
+
+        # the same boot path with an empty NAND draws nothing red
+        self.assertNotIn('red-x', {r['milestone'] for r in records})
+
+    @skipUnless(os.getenv('IPOD_NANO3G_BOOTROM'), 'no iPod Nano 3G bootrom')
+    def test_firmware(self):
+        opts = ['bootrom=' + os.getenv('IPOD_NANO3G_BOOTROM')]
+        for prop, var in (('nor', 'IPOD_NANO3G_NOR'),
+                          ('bootloader', 'IPOD_NANO3G_BOOTLOADER'),
+                          ('nand', 'IPOD_NANO3G_NAND')):
+            if os.getenv(var):
+                opts.append('%s=%s' % (prop, os.getenv(var)))
+
+        self.run_boot(opts, ['nor-first-read', 'lcd-first-cmd', 'red-x'],
+                      self.timeout - 10)
@@ -0,0 +1,421 @@
+/*
+ * QTest testcase for the iPod Nano 3G machine
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "libqos/libqtest.h"
+
+/* the machine only needs a bootrom, the CPU does not run under qtest */
+#define BOOTROM_SIZE 0x10000
+
+#define RAM_BASE 0x08000000
+#define NAND_BASE 0x38A00000
+#define ADM_BASE 0x38800000
+
+#define NAND_FMCTRL0 0x0
+#define NAND_CMD 0x8
+#define NAND_FMADDR0 0xC
+#define NAND_FMADDR1 0x10
+#define NAND_FMDNUM 0x30
+#define NAND_DMADEST 0x34
+#define NAND_FMFIFO 0x80
+#define NAND_CMD_READ_PAGE 0
+#define NAND_CMD_READ 0x30
+
+#define NAND_FMI_PROGRAM 0xc04
+#define NAND_FMI_INT 0xc0c
+#define NAND_FMI_START 0xc6c
+#define FMISS_PROGRAM_ADDR (RAM_BASE + 0x40000)
+#define FMISS_RESULT_ADDR (RAM_BASE + 0x41000)
+#define FMISS_INS(op, dst, src, imm) \
+    ((uint64_t)(imm) << 32 | (uint64_t)(op) << 24 | (dst) << 16 | (src))
+
+#define ADM_CTRL2 0x4
+#define ADM_DATA2_SEC_ADDR 0x88
+#define ADM_DATA3_SEC_ADDR 0x8C
+#define ADM_CMD_BLOCK (RAM_BASE + 0x1104)
+#define ADM_CMD_READ_STRIPED 0x200
+#define ADM_CMD_READ_PAGES 0x300
+#define ADM_CMD_WRITE_PAGE 0x500
+#define ADM_META_ADDR (RAM_BASE + 0x10000)
+#define DMA_DEST_ADDR (RAM_BASE + 0x20000)
+
+#define USB_BASE 0x38400000
+#define USB_GAHBCFG 0x8
+#define USB_GINTSTS 0x14
+#define USB_DIEP(ep, reg) (USB_BASE + 0x900 + (ep) * 0x20 + (reg))
+#define USB_DOEP(ep, reg) (USB_BASE + 0xB00 + (ep) * 0x20 + (reg))
+#define USB_EPCTL 0x0
+#define USB_EPINT 0x8
+#define USB_EPTSIZ 0x10
+#define USB_EPDMA 0x14
+#define USB_GAHBCFG_DMAEN (1 << 5)
+#define USB_GINTSTS_DISCONNECT (1 << 29)
+#define USB_EPCTL_ENABLE (1u << 31)
+#define USB_EPINT_XFERCOMPL 0x1
+#define USB_GADGET_OUT 2
+#define USB_GADGET_IN 3
+#define USB_GADGET_IN_DATA 4
+#define USB_GADGET_OUT_DONE 5
+#define USB_OUT_ADDR (RAM_BASE + 0x30000)
+#define USB_IN_ADDR (RAM_BASE + 0x31000)
+
+#define NAND_NUM_BANKS 8
+#define NAND_PAGES_PER_BANK 4
+#define NAND_BYTES_PER_PAGE 2048
+#define NAND_BYTES_PER_RECORD (NAND_BYTES_PER_PAGE + 512)
+#define NAND_IMAGE_SIZE (NAND_NUM_BANKS * NAND_PAGES_PER_BANK * NAND_BYTES_PER_RECORD)
+
+static char *create_file(const char *tmpl, size_t size)
+{
+    g_autofree uint8_t *zeros = g_malloc0(size);
+    char *path;
+    int fd;
+
+    fd = g_file_open_tmp(tmpl, &path, NULL);
+    g_assert(fd >= 0);
+    g_assert_cmpint(write(fd, zeros, size), ==, size);
+    close(fd);
+    return path;
+}
+
+static void adm_command(QTestState *qts, uint32_t cmd, uint16_t num_pages, int bank,
+                        uint32_t page)
+{
+    uint16_t num_pages_be = cpu_to_be16(num_pages);
+    uint32_t page_be = cpu_to_be32(page);
+
+    qtest_writel(qts, ADM_BASE + ADM_DATA2_SEC_ADDR, RAM_BASE);
+    qtest_writel(qts, ADM_BASE + ADM_DATA3_SEC_ADDR, ADM_META_ADDR);
+    qtest_writel(qts, ADM_CMD_BLOCK + 0x24, cmd);
+    qtest_memwrite(qts, ADM_CMD_BLOCK + 0x28, &num_pages_be, sizeof(num_pages_be));
+    qtest_writeb(qts, ADM_CMD_BLOCK + 0x44, bank);
+    qtest_memwrite(qts, ADM_CMD_BLOCK + 0x244, &page_be, sizeof(page_be));
+    qtest_writel(qts, ADM_BASE + ADM_CTRL2, 2);
+    qtest_writel(qts, ADM_BASE + ADM_CTRL2, 0);
+}
+
+/* Programs a page the way the firmware does, through the ADM */
+static void nand_program(QTestState *qts, int bank, uint32_t page, uint32_t seed)
+{
+    int i;
+
+    adm_command(qts, ADM_CMD_WRITE_PAGE, 1, bank, page);
+
+    for (i = 0; i < NAND_BYTES_PER_PAGE / 4; i++) {
+        qtest_writel(qts, NAND_BASE + NAND_FMFIFO, seed + i);
+    }
+}
+
+static void nand_check_page(QTestState *qts, int bank, uint32_t page, bool programmed,
+                            uint32_t seed)
+{
+    int i;
+
+    qtest_writel(qts, NAND_BASE + NAND_FMCTRL0, 1 << (bank + 1));
+    qtest_writel(qts, NAND_BASE + NAND_FMDNUM, NAND_BYTES_PER_PAGE - 1);
+    qtest_writel(qts, NAND_BASE + NAND_FMADDR0, page << 16);
+    qtest_writel(qts, NAND_BASE + NAND_FMADDR1, page >> 16);
+    qtest_writel(qts, NAND_BASE + NAND_CMD, NAND_CMD_READ);
+    qtest_writel(qts, NAND_BASE + NAND_CMD, NAND_CMD_READ_PAGE);
+
+    for (i = 0; i < NAND_BYTES_PER_PAGE / 4; i++) {
+        g_assert_cmphex(qtest_readl(qts, NAND_BASE + NAND_FMFIFO), ==,
+                        programmed ? seed + i : 0);
+    }
+}
+
+/* Programmed pages survive a restart through the overlay, the base image stays untouched */
+static void test_nand_overlay(void)
+{
+    g_autofree char *bootrom = create_file("ipod-bootrom-XXXXXX", BOOTROM_SIZE);
+    g_autofree char *base = create_file("ipod-nand-XXXXXX", NAND_IMAGE_SIZE);
+    g_autofree char *overlay = create_file("ipod-overlay-XXXXXX", NAND_IMAGE_SIZE);
+    g_autofree uint8_t *contents = NULL;
+    gsize len;
+    QTestState *qts;
+    int run;
+
+    for (run = 0; run < 2; run++) {
+        qts = qtest_initf("-M iPod-Nano3G,bootrom=%s,nand=%s,nand-overlay=%s",
+                          bootrom, base, overlay);
+        if (run == 0) {
+            nand_check_page(qts, 1, 2, false, 0);
+            nand_program(qts, 1, 2, 0x12345678);
+        }
+        nand_check_page(qts, 1, 2, true, 0x12345678);
+        nand_check_page(qts, 1, 3, false, 0);
+        nand_check_page(qts, 2, 2, false, 0);
+        qtest_quit(qts);
+    }
+
+    g_assert(g_file_get_contents(base, (char **)&contents, &len, NULL));
+    g_assert_cmpuint(len, ==, NAND_IMAGE_SIZE);
+    g_assert(buffer_is_zero(contents, len));
+
+    unlink(bootrom);
+    unlink(base);
+    unlink(overlay);
+}
+
+/* Pages past the end of the image cannot be programmed */
+static void test_nand_out_of_range(void)
+{
+    g_autofree char *bootrom = create_file("ipod-bootrom-XXXXXX", BOOTROM_SIZE);
+    g_autofree char *base = create_file("ipod-nand-XXXXXX", NAND_IMAGE_SIZE);
+    QTestState *qts;
+
+    qts = qtest_initf("-M iPod-Nano3G,bootrom=%s,nand=%s", bootrom, base);
+    nand_program(qts, 0, NAND_PAGES_PER_BANK, 0x11111111);
+    nand_check_page(qts, 0, NAND_PAGES_PER_BANK, false, 0);
+    nand_check_page(qts, 0, 0, false, 0);
+    nand_check_page(qts, 1, 0, false, 0);
+    qtest_quit(qts);
+
+    unlink(bootrom);
+    unlink(base);
+}
+
+/* A pristine start drops the pages an earlier run left in the overlay */
+static void test_nand_pristine(void)
+{
+    g_autofree char *bootrom = create_file("ipod-bootrom-XXXXXX", BOOTROM_SIZE);
+    g_autofree char *base = create_file("ipod-nand-XXXXXX", NAND_IMAGE_SIZE);
+    g_autofree char *overlay = create_file("ipod-overlay-XXXXXX", NAND_IMAGE_SIZE);
+    QTestState *qts;
+
+    qts = qtest_initf("-M iPod-Nano3G,bootrom=%s,nand=%s,nand-overlay=%s",
+                      bootrom, base, overlay);
+    nand_program(qts, 3, 1, 0x87654321);
+    qtest_quit(qts);
+
+    qts = qtest_initf("-M iPod-Nano3G,bootrom=%s,nand=%s,nand-overlay=%s,nand-pristine=on",
+                      bootrom, base, overlay);
+    nand_check_page(qts, 3, 1, false, 0);
+    qtest_quit(qts);
+
+    qts = qtest_initf("-M iPod-Nano3G,bootrom=%s,nand=%s,nand-overlay=%s",
+                      bootrom, base, overlay);
+    nand_check_page(qts, 3, 1, false, 0);
+    qtest_quit(qts);
+
+    unlink(bootrom);
+    unlink(base);
+    unlink(overlay);
+}
+
+/* A striped read streams its pages through the FIFO and never writes DMADEST */
+static void test_nand_bulk_read(void)
+{
+    g_autofree char *bootrom = create_file("ipod-bootrom-XXXXXX", BOOTROM_SIZE);
+    g_autofree char *base = create_file("ipod-nand-XXXXXX", NAND_IMAGE_SIZE);
+    QTestState *qts;
+    int bank, i;
+
+    qts = qtest_initf("-M iPod-Nano3G,bootrom=%s,nand=%s", bootrom, base);
+    nand_program(qts, 0, 1, 0xcafe0000);
+    nand_program(qts, 1, 1, 0xbeef0000);
+
+    qtest_memset(qts, DMA_DEST_ADDR, 0xff, NAND_BYTES_PER_PAGE);
+    qtest_writel(qts, NAND_BASE + NAND_DMADEST, DMA_DEST_ADDR);
+    adm_command(qts, ADM_CMD_READ_STRIPED, NAND_NUM_BANKS, 0, 1);
+    qtest_writel(qts, NAND_BASE + NAND_CMD, NAND_CMD_READ_PAGE);
+
+    for (bank = 0; bank < NAND_NUM_BANKS; bank++) {
+        for (i = 0; i < NAND_BYTES_PER_PAGE / 4; i++) {
+            uint32_t expect = bank == 0 ? 0xcafe0000 + i : bank == 1 ? 0xbeef0000 + i : 0;
+
+            g_assert_cmphex(qtest_readl(qts, NAND_BASE + NAND_FMFIFO), ==, expect);
+        }
+    }
+    for (i = 0; i < NAND_BYTES_PER_PAGE / 4; i++) {
+        g_assert_cmphex(qtest_readl(qts, DMA_DEST_ADDR + i * 4), ==, 0xffffffff);
+    }
+
+    qtest_quit(qts);
+    unlink(bootrom);
+    unlink(base);
+}
+
+/* A long running FMISS program yields to the main loop and still completes */
+static void test_fmiss_long_program(void)
+{
+    g_autofree char *bootrom = create_file("ipod-bootrom-XXXXXX", BOOTROM_SIZE);
+    static const uint64_t program[] = {
+        FMISS_INS(5, 0, 0, 0),                  /* r0 = 0 */
+        FMISS_INS(12, 0, 0, 1),                 /* r0 = r0 + 1 */
+        FMISS_INS(14, 0, 10000, 8),             /* loop while r0 != 10000 */
+        FMISS_INS(5, 1, 0, FMISS_RESULT_ADDR),  /* r1 = result address */
+        FMISS_INS(17, 0, 1, 0),                 /* [r1] = r0 */
+        FMISS_INS(0, 0, 0, 0),
+    };
+    gint64 end = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+    QTestState *qts;
+    int i;
+
+    qts = qtest_initf("-M iPod-Nano3G,bootrom=%s", bootrom);
+    for (i = 0; i < ARRAY_SIZE(program); i++) {
+        qtest_writeq(qts, FMISS_PROGRAM_ADDR + i * 8, program[i]);
+    }
+    qtest_writel(qts, NAND_BASE + NAND_FMI_PROGRAM, FMISS_PROGRAM_ADDR);
+    qtest_writel(qts, NAND_BASE + NAND_FMI_START, 0);
+
+    while (!(qtest_readl(qts, NAND_BASE + NAND_FMI_INT) & 1)) {
+        g_assert(g_get_monotonic_time() < end);
+        g_usleep(1000);
+    }
+    g_assert_cmpuint(qtest_readl(qts, FMISS_RESULT_ADDR), ==, 10000);
+
+    qtest_quit(qts);
+    unlink(bootrom);
+}
+
+/* An unaligned jump target ends the program instead of landing mid-instruction */
+static void test_fmiss_unaligned_jump(void)
+{
+    g_autofree char *bootrom = create_file("ipod-bootrom-XXXXXX", BOOTROM_SIZE);
+    static const uint64_t program[] = {
+        FMISS_INS(5, 1, 0, FMISS_RESULT_ADDR),  /* r1 = result address */
+        FMISS_INS(5, 0, 0, 0x1234),             /* r0 = 0x1234 */
+        FMISS_INS(14, 0, 0, 28),                /* r0 != 0, jump into the store */
+        FMISS_INS(17, 0, 1, 0),                 /* [r1] = r0 */
+        FMISS_INS(0, 0, 0, 0),
+    };
+    QTestState *qts;
+    int i;
+
+    qts = qtest_initf("-M iPod-Nano3G,bootrom=%s", bootrom);
+    for (i = 0; i < ARRAY_SIZE(program); i++) {
+        qtest_writeq(qts, FMISS_PROGRAM_ADDR + i * 8, program[i]);
+    }
+    qtest_writel(qts, FMISS_RESULT_ADDR, 0);
+    qtest_writel(qts, NAND_BASE + NAND_FMI_PROGRAM, FMISS_PROGRAM_ADDR);
+    qtest_writel(qts, NAND_BASE + NAND_FMI_START, 0);
+
+    g_assert_cmphex(qtest_readl(qts, NAND_BASE + NAND_FMI_INT) & 1, ==, 1);
+    g_assert_cmphex(qtest_readl(qts, FMISS_RESULT_ADDR), ==, 0);
+
+    qtest_quit(qts);
+    unlink(bootrom);
+}
+
+static void usb_send(int fd, uint8_t type, uint8_t ep, uint32_t length,
+                     const void *data, size_t data_len)
+{
+    uint8_t hdr[8] = { type, ep };
+
+    stl_le_p(hdr + 4, length);
+    g_assert_cmpint(write(fd, hdr, sizeof(hdr)), ==, sizeof(hdr));
+    if (data_len) {
+        g_assert_cmpint(write(fd, data, data_len), ==, data_len);
+    }
+}
+
+static void usb_recv(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t r;
+
+    while (done < len) {
+        r = read(fd, (uint8_t *)buf + done, len - done);
+        g_assert_cmpint(r, >, 0);
+        done += r;
+    }
+}
+
+static void usb_expect(int fd, uint8_t type, uint8_t ep, uint32_t length)
+{
+    uint8_t hdr[8];
+
+    usb_recv(fd, hdr, sizeof(hdr));
+    g_assert_cmpint(hdr[0], ==, type);
+    g_assert_cmpint(hdr[1], ==, ep);
+    g_assert_cmpuint(ldl_le_p(hdr + 4), ==, length);
+}
+
+/* The chardev is read in the background, poll until the transfer went through */
+static void usb_wait_xfer(QTestState *qts, uint32_t epint)
+{
+    gint64 end = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+
+    while (!(qtest_readl(qts, epint) & USB_EPINT_XFERCOMPL)) {
+        g_assert(g_get_monotonic_time() < end);
+        g_usleep(1000);
+    }
+}
+
+/* OUT and IN transfers through the gadget bridge, then a bogus frame length */
+static void test_usb_gadget(void)
+{
+    g_autofree char *bootrom = create_file("ipod-bootrom-XXXXXX", BOOTROM_SIZE);
+    uint8_t out[16], in[8], buf[8];
+    QTestState *qts;
+    int sv[2];
+    int i;
+
+    for (i = 0; i < sizeof(out); i++) {
+        out[i] = 0xa0 + i;
+    }
+    for (i = 0; i < sizeof(in); i++) {
+        in[i] = 0x50 + i;
+    }
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    qts = qtest_initf("-M iPod-Nano3G,bootrom=%s -chardev socket,id=usb,fd=%d "
+                      "-global S5L8702usbotg.chardev=usb", bootrom, sv[1]);
+    close(sv[1]);
+    qtest_writel(qts, USB_BASE + USB_GAHBCFG, USB_GAHBCFG_DMAEN);
+
+    /* the frame waits for the firmware to arm the endpoint */
+    usb_send(sv[0], USB_GADGET_OUT, 1, sizeof(out), out, sizeof(out));
+    qtest_writel(qts, USB_DOEP(1, USB_EPTSIZ), (1 << 19) | 64);
+    qtest_writel(qts, USB_DOEP(1, USB_EPDMA), USB_OUT_ADDR);
+    qtest_writel(qts, USB_DOEP(1, USB_EPCTL), USB_EPCTL_ENABLE | 64);
+    usb_wait_xfer(qts, USB_DOEP(1, USB_EPINT));
+    usb_expect(sv[0], USB_GADGET_OUT_DONE, 1, sizeof(out));
+    for (i = 0; i < sizeof(out); i++) {
+        g_assert_cmphex(qtest_readb(qts, USB_OUT_ADDR + i), ==, out[i]);
+    }
+    g_assert_cmphex(qtest_readl(qts, USB_DOEP(1, USB_EPCTL)) & USB_EPCTL_ENABLE, ==, 0);
+    g_assert_cmphex(qtest_readl(qts, USB_DOEP(1, USB_EPDMA)), ==, USB_OUT_ADDR + sizeof(out));
+
+    /* an IN token takes no more than the endpoint was armed for */
+    qtest_memwrite(qts, USB_IN_ADDR, in, sizeof(in));
+    qtest_writel(qts, USB_DIEP(1, USB_EPTSIZ), (1 << 19) | sizeof(in));
+    qtest_writel(qts, USB_DIEP(1, USB_EPDMA), USB_IN_ADDR);
+    qtest_writel(qts, USB_DIEP(1, USB_EPCTL), USB_EPCTL_ENABLE | 64);
+    usb_send(sv[0], USB_GADGET_IN, 1, 64, NULL, 0);
+    usb_expect(sv[0], USB_GADGET_IN_DATA, 1, sizeof(in));
+    usb_recv(sv[0], buf, sizeof(buf));
+    g_assert(memcmp(buf, in, sizeof(in)) == 0);
+    usb_wait_xfer(qts, USB_DIEP(1, USB_EPINT));
+
+    /* the header length plus the header wraps around, the host gets dropped */
+    usb_send(sv[0], USB_GADGET_OUT, 1, 0xfffffff8, NULL, 0);
+    g_assert_cmpint(read(sv[0], buf, sizeof(buf)), ==, 0);
+    g_assert(qtest_readl(qts, USB_BASE + USB_GINTSTS) & USB_GINTSTS_DISCONNECT);
+
+    close(sv[0]);
+    qtest_quit(qts);
+    unlink(bootrom);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/ipod-nano3g/nand/overlay", test_nand_overlay);
+    qtest_add_func("/ipod-nano3g/nand/out-of-range", test_nand_out_of_range);
+    qtest_add_func("/ipod-nano3g/nand/pristine", test_nand_pristine);
+    qtest_add_func("/ipod-nano3g/nand/bulk-read", test_nand_bulk_read);
+    qtest_add_func("/ipod-nano3g/nand/fmiss-long-program", test_fmiss_long_program);
+    qtest_add_func("/ipod-nano3g/nand/fmiss-unaligned-jump", test_fmiss_unaligned_jump);
+    qtest_add_func("/ipod-nano3g/usb/gadget", test_usb_gadget);
+
+    return g_test_run();
+}
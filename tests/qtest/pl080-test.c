@@ -0,0 +1,134 @@
+/*
+ * QTest testcase for the PL080 DMA controller
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest-single.h"
+
+/* versatilepb DMAC, RAM starts at 0 */
+#define DMAC_BASE 0x10130000
+
+#define INT_TC_STATUS 0x004
+#define INT_TC_CLEAR 0x008
+#define CONFIGURATION 0x030
+#define CH_SRC(c) (0x100 + (c) * 0x20)
+#define CH_DEST(c) (0x104 + (c) * 0x20)
+#define CH_LLI(c) (0x108 + (c) * 0x20)
+#define CH_CTRL(c) (0x10c + (c) * 0x20)
+#define CH_CONF(c) (0x110 + (c) * 0x20)
+
+#define CTRL_WORDS (2 << 18 | 2 << 21)
+#define CTRL_SI (1 << 26)
+#define CTRL_DI (1 << 27)
+#define CTRL_I (1u << 31)
+
+#define CONF_E 0x1
+#define CONF_ITC 0x8000
+
+#define SRC_ADDR 0x100000
+#define DEST_ADDR 0x180000
+#define LLI_ADDR 0x200000
+
+static void fill(uint32_t addr, uint32_t words, uint32_t seed)
+{
+    uint32_t i;
+
+    for (i = 0; i < words; i++) {
+        writel(addr + i * 4, seed + i * 0x01010101);
+    }
+}
+
+static void start(int c, uint32_t src, uint32_t dest, uint32_t lli,
+                  uint32_t ctrl)
+{
+    writel(DMAC_BASE + CONFIGURATION, 1);
+    writel(DMAC_BASE + INT_TC_CLEAR, 0xff);
+    writel(DMAC_BASE + CH_SRC(c), src);
+    writel(DMAC_BASE + CH_DEST(c), dest);
+    writel(DMAC_BASE + CH_LLI(c), lli);
+    writel(DMAC_BASE + CH_CTRL(c), ctrl);
+    writel(DMAC_BASE + CH_CONF(c), CONF_ITC | CONF_E);
+}
+
+/* Two chained memory-to-memory LLIs, the channel stops after the last one */
+static void test_mem_to_mem_lli(void)
+{
+    uint32_t i;
+
+    fill(SRC_ADDR, 96, 0x10203040);
+    fill(DEST_ADDR, 96, 0);
+
+    writel(LLI_ADDR, SRC_ADDR + 64 * 4);
+    writel(LLI_ADDR + 4, DEST_ADDR + 64 * 4);
+    writel(LLI_ADDR + 8, 0);
+    writel(LLI_ADDR + 12, 32 | CTRL_WORDS | CTRL_SI | CTRL_DI | CTRL_I);
+
+    start(0, SRC_ADDR, DEST_ADDR, LLI_ADDR, 64 | CTRL_WORDS | CTRL_SI | CTRL_DI);
+
+    for (i = 0; i < 96; i++) {
+        g_assert_cmphex(readl(DEST_ADDR + i * 4), ==, 0x10203040 + i * 0x01010101);
+    }
+    g_assert_cmphex(readl(DMAC_BASE + CH_CONF(0)) & CONF_E, ==, 0);
+    g_assert_cmphex(readl(DMAC_BASE + CH_SRC(0)), ==, SRC_ADDR + 96 * 4);
+    g_assert_cmphex(readl(DMAC_BASE + CH_DEST(0)), ==, DEST_ADDR + 96 * 4);
+    g_assert_cmphex(readl(DMAC_BASE + CH_CTRL(0)) & 0xfff, ==, 0);
+    g_assert_cmphex(readl(DMAC_BASE + INT_TC_STATUS), ==, 1);
+}
+
+/* A fixed source address, like a peripheral FIFO, is read once per element */
+static void test_fixed_src(void)
+{
+    uint32_t i;
+
+    writel(SRC_ADDR, 0xdeadbeef);
+    fill(DEST_ADDR, 17, 0);
+
+    start(1, SRC_ADDR, DEST_ADDR, 0, 16 | CTRL_WORDS | CTRL_DI | CTRL_I);
+
+    for (i = 0; i < 16; i++) {
+        g_assert_cmphex(readl(DEST_ADDR + i * 4), ==, 0xdeadbeef);
+    }
+    g_assert_cmphex(readl(DEST_ADDR + 16 * 4), ==, 16 * 0x01010101);
+    g_assert_cmphex(readl(DMAC_BASE + CH_SRC(1)), ==, SRC_ADDR);
+    g_assert_cmphex(readl(DMAC_BASE + CH_DEST(1)), ==, DEST_ADDR + 16 * 4);
+    g_assert_cmphex(readl(DMAC_BASE + INT_TC_STATUS), ==, 2);
+}
+
+/* A destination one word above the source repeats the first word */
+static void test_overlap_fill(void)
+{
+    uint32_t i;
+
+    fill(SRC_ADDR, 17, 0x55aa0000);
+
+    start(2, SRC_ADDR, SRC_ADDR + 4, 0, 16 | CTRL_WORDS | CTRL_SI | CTRL_DI | CTRL_I);
+
+    for (i = 0; i < 17; i++) {
+        g_assert_cmphex(readl(SRC_ADDR + i * 4), ==, 0x55aa0000);
+    }
+    g_assert_cmphex(readl(DMAC_BASE + CH_SRC(2)), ==, SRC_ADDR + 16 * 4);
+    g_assert_cmphex(readl(DMAC_BASE + CH_DEST(2)), ==, SRC_ADDR + 17 * 4);
+    g_assert_cmphex(readl(DMAC_BASE + INT_TC_STATUS), ==, 4);
+}
+
+int main(int argc, char **argv)
+{
+    int r;
+
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_start("-machine versatilepb");
+
+    qtest_add_func("/pl080/mem-to-mem-lli", test_mem_to_mem_lli);
+    qtest_add_func("/pl080/fixed-src", test_fixed_src);
+    qtest_add_func("/pl080/overlap-fill", test_overlap_fill);
+
+    r = g_test_run();
+
+    qtest_end();
+
+    return r;
+}
@@ -0,0 +1,143 @@
+/*
+ * Framebuffer pixel conversion kernel tests
+ *
+ * Runs every SIMD line kernel the host supports against the portable one.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "ui/console.h"
+#include "hw/display/framebuffer.h"
+
+#define FB_TEST_MAX_WIDTH 300
+#define FB_TEST_MAX_OFFSET 3
+#define FB_TEST_GUARD 16
+
+static const struct {
+    FramebufferImpl impl;
+    const char *name;
+} fb_simd_impls[] = {
+    { FRAMEBUFFER_IMPL_SSE2, "sse2" },
+    { FRAMEBUFFER_IMPL_AVX2, "avx2" },
+    { FRAMEBUFFER_IMPL_NEON, "neon" },
+};
+
+static int fb_src_bytes(FramebufferFormat format)
+{
+    switch (format) {
+    case FRAMEBUFFER_FORMAT_RGB565:
+    case FRAMEBUFFER_FORMAT_RGB555:
+        return 2;
+    case FRAMEBUFFER_FORMAT_RGB888:
+        return 3;
+    case FRAMEBUFFER_FORMAT_PAL8:
+        return 1;
+    }
+    g_assert_not_reached();
+}
+
+static void fb_random_fill(GRand *rand, uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = g_rand_int_range(rand, 0, 256);
+    }
+}
+
+/*
+ * Converts the same random line with both kernels, for every width up to
+ * FB_TEST_MAX_WIDTH so that each length of SIMD body and scalar tail is
+ * covered, from unaligned sources and into packed and strided destinations.
+ * The destination is pre-filled so that writes past the line are caught too.
+ */
+static void fb_compare(GRand *rand, FramebufferFormat format,
+                       drawfn ref, drawfn fn)
+{
+    int bytes = fb_src_bytes(format);
+    size_t src_len = FB_TEST_MAX_WIDTH * bytes + FB_TEST_MAX_OFFSET;
+    size_t dst_len = FB_TEST_MAX_WIDTH * 8 + FB_TEST_GUARD;
+    g_autofree uint8_t *src = g_malloc(src_len);
+    g_autofree uint8_t *fill = g_malloc(dst_len);
+    g_autofree uint8_t *expected = g_malloc(dst_len);
+    g_autofree uint8_t *actual = g_malloc(dst_len);
+    uint32_t palette[256];
+    int width, offset, step;
+
+    fb_random_fill(rand, (uint8_t *)palette, sizeof(palette));
+    fb_random_fill(rand, src, src_len);
+    fb_random_fill(rand, fill, dst_len);
+
+    for (step = 4; step <= 8; step += 4) {
+        for (offset = 0; offset <= FB_TEST_MAX_OFFSET; offset++) {
+            for (width = 1; width <= FB_TEST_MAX_WIDTH; width++) {
+                memcpy(expected, fill, dst_len);
+                memcpy(actual, fill, dst_len);
+                ref(palette, expected, src + offset, width, step);
+                fn(palette, actual, src + offset, width, step);
+                if (memcmp(expected, actual, dst_len)) {
+                    g_test_message("width %d, source offset %d, step %d",
+                                   width, offset, step);
+                    g_assert_cmpmem(expected, dst_len, actual, dst_len);
+                }
+            }
+        }
+    }
+}
+
+static void test_fb_kernels(const void *opaque)
+{
+    FramebufferFormat format = GPOINTER_TO_INT(opaque);
+    g_autoptr(GRand) rand = g_rand_new_with_seed(format + 1);
+    drawfn ref = framebuffer_get_drawfn_impl(format, 32, FRAMEBUFFER_IMPL_C);
+    bool tested = false;
+    int i;
+
+    g_assert_nonnull(ref);
+    g_assert(framebuffer_get_drawfn(format, 32) != NULL);
+
+    for (i = 0; i < ARRAY_SIZE(fb_simd_impls); i++) {
+        drawfn fn = framebuffer_get_drawfn_impl(format, 32,
+                                                fb_simd_impls[i].impl);
+        if (!fn) {
+            continue;
+        }
+        g_test_message("checking %s", fb_simd_impls[i].name);
+        fb_compare(rand, format, ref, fn);
+        tested = true;
+    }
+
+    if (!tested) {
+        g_test_skip("no SIMD kernel for this format on this host");
+    }
+}
+
+static void test_fb_kernels_unsupported(void)
+{
+    g_assert_null(framebuffer_get_drawfn(FRAMEBUFFER_FORMAT_RGB565, 16));
+    g_assert_null(framebuffer_get_drawfn_impl(FRAMEBUFFER_FORMAT_RGB565, 16,
+                                              FRAMEBUFFER_IMPL_C));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/framebuffer-kernels/rgb565",
+                         GINT_TO_POINTER(FRAMEBUFFER_FORMAT_RGB565),
+                         test_fb_kernels);
+    g_test_add_data_func("/framebuffer-kernels/rgb555",
+                         GINT_TO_POINTER(FRAMEBUFFER_FORMAT_RGB555),
+                         test_fb_kernels);
+    g_test_add_data_func("/framebuffer-kernels/rgb888",
+                         GINT_TO_POINTER(FRAMEBUFFER_FORMAT_RGB888),
+                         test_fb_kernels);
+    g_test_add_data_func("/framebuffer-kernels/pal8",
+                         GINT_TO_POINTER(FRAMEBUFFER_FORMAT_PAL8),
+                         test_fb_kernels);
+    g_test_add_func("/framebuffer-kernels/unsupported",
+                    test_fb_kernels_unsupported);
+
+    return g_test_run();
+}
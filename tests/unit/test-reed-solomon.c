@@ -0,0 +1,166 @@
+/*
+ * Reed-Solomon encoder and decoder tests
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/reed-solomon.h"
+
+typedef struct RSTestParams {
+    unsigned int symsize;
+    unsigned int gfpoly;
+    unsigned int fcr;
+    unsigned int nroots;
+    unsigned int len;
+} RSTestParams;
+
+/* the 8-bit field used by most storage codes, and the 10-bit one of the NAND ECC */
+static const RSTestParams rs_gf256 = { 8, 0x11d, 0, 16, 223 };
+static const RSTestParams rs_gf1024 = { 10, 0x409, 1, 8, 410 };
+static const RSTestParams rs_gf1024_short = { 10, 0x409, 1, 16, 16 };
+
+static ReedSolomon *rs_new_for_test(const RSTestParams *p)
+{
+    return reed_solomon_new(p->symsize, p->gfpoly, p->fcr, p->nroots,
+                            &error_abort);
+}
+
+static void rs_random_data(GRand *rand, const RSTestParams *p, uint16_t *data)
+{
+    unsigned int i;
+
+    for (i = 0; i < p->len; i++) {
+        data[i] = g_rand_int_range(rand, 0, 1 << p->symsize);
+    }
+}
+
+/* Corrupts nerrs distinct symbols, anywhere in the data or the parity */
+static void rs_corrupt(GRand *rand, const RSTestParams *p, unsigned int nerrs,
+                       uint16_t *data, uint16_t *parity)
+{
+    g_autofree bool *hit = g_new0(bool, p->len + p->nroots);
+    unsigned int i;
+
+    for (i = 0; i < nerrs; i++) {
+        unsigned int pos, flip;
+
+        do {
+            pos = g_rand_int_range(rand, 0, p->len + p->nroots);
+        } while (hit[pos]);
+        hit[pos] = true;
+
+        flip = g_rand_int_range(rand, 1, 1 << p->symsize);
+        if (pos < p->len) {
+            data[pos] ^= flip;
+        } else {
+            parity[pos - p->len] ^= flip;
+        }
+    }
+}
+
+static void test_rs_zero(const void *opaque)
+{
+    const RSTestParams *p = opaque;
+    g_autoptr(ReedSolomon) rs = rs_new_for_test(p);
+    g_autofree uint16_t *data = g_new0(uint16_t, p->len);
+    uint16_t parity[REED_SOLOMON_MAX_ROOTS];
+    unsigned int i;
+
+    /* the code is linear, so all zero data has all zero parity */
+    reed_solomon_encode(rs, data, p->len, parity);
+    for (i = 0; i < p->nroots; i++) {
+        g_assert_cmpuint(parity[i], ==, 0);
+    }
+    g_assert_cmpint(reed_solomon_decode(rs, data, p->len, parity), ==, 0);
+}
+
+static void test_rs_correct(const void *opaque)
+{
+    const RSTestParams *p = opaque;
+    g_autoptr(ReedSolomon) rs = rs_new_for_test(p);
+    g_autoptr(GRand) rand = g_rand_new_with_seed(p->symsize * 1000 + p->nroots);
+    g_autofree uint16_t *orig = g_new(uint16_t, p->len);
+    g_autofree uint16_t *data = g_new(uint16_t, p->len);
+    uint16_t orig_parity[REED_SOLOMON_MAX_ROOTS], parity[REED_SOLOMON_MAX_ROOTS];
+    unsigned int nerrs, iter;
+
+    for (iter = 0; iter < 50; iter++) {
+        rs_random_data(rand, p, orig);
+        reed_solomon_encode(rs, orig, p->len, orig_parity);
+
+        for (nerrs = 0; nerrs <= p->nroots / 2; nerrs++) {
+            memcpy(data, orig, p->len * sizeof(data[0]));
+            memcpy(parity, orig_parity, sizeof(parity));
+            rs_corrupt(rand, p, nerrs, data, parity);
+
+            g_assert_cmpint(reed_solomon_decode(rs, data, p->len, parity), ==, nerrs);
+            g_assert(memcmp(data, orig, p->len * sizeof(data[0])) == 0);
+            g_assert(memcmp(parity, orig_parity, p->nroots * sizeof(parity[0])) == 0);
+        }
+    }
+}
+
+static void test_rs_uncorrectable(const void *opaque)
+{
+    const RSTestParams *p = opaque;
+    g_autoptr(ReedSolomon) rs = rs_new_for_test(p);
+    g_autoptr(GRand) rand = g_rand_new_with_seed(p->symsize * 1000 + p->nroots + 1);
+    g_autofree uint16_t *orig = g_new(uint16_t, p->len);
+    g_autofree uint16_t *data = g_new(uint16_t, p->len);
+    uint16_t parity[REED_SOLOMON_MAX_ROOTS];
+    unsigned int iter;
+    int ret;
+
+    for (iter = 0; iter < 50; iter++) {
+        rs_random_data(rand, p, orig);
+        memcpy(data, orig, p->len * sizeof(data[0]));
+        reed_solomon_encode(rs, data, p->len, parity);
+        rs_corrupt(rand, p, p->nroots / 2 + 1, data, parity);
+
+        /* either detected, or miscorrected into a different codeword */
+        ret = reed_solomon_decode(rs, data, p->len, parity);
+        g_assert(ret == -EBADMSG ||
+                 memcmp(data, orig, p->len * sizeof(data[0])) != 0);
+    }
+}
+
+static void test_rs_invalid(void)
+{
+    Error *err = NULL;
+
+    /* irreducible, but x only generates 51 of the 255 elements */
+    g_assert_null(reed_solomon_new(8, 0x11b, 0, 16, &err));
+    error_free_or_abort(&err);
+
+    g_assert_null(reed_solomon_new(8, 0x409, 0, 16, &err));
+    error_free_or_abort(&err);
+
+    g_assert_null(reed_solomon_new(8, 0x11d, 0, REED_SOLOMON_MAX_ROOTS + 1, &err));
+    error_free_or_abort(&err);
+
+    g_assert_null(reed_solomon_new(17, 0x2000b, 0, 16, &err));
+    error_free_or_abort(&err);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/reed-solomon/gf256/zero", &rs_gf256, test_rs_zero);
+    g_test_add_data_func("/reed-solomon/gf256/correct", &rs_gf256, test_rs_correct);
+    g_test_add_data_func("/reed-solomon/gf256/uncorrectable", &rs_gf256,
+                         test_rs_uncorrectable);
+    g_test_add_data_func("/reed-solomon/gf1024/zero", &rs_gf1024, test_rs_zero);
+    g_test_add_data_func("/reed-solomon/gf1024/correct", &rs_gf1024, test_rs_correct);
+    g_test_add_data_func("/reed-solomon/gf1024/uncorrectable", &rs_gf1024,
+                         test_rs_uncorrectable);
+    g_test_add_data_func("/reed-solomon/gf1024-short/correct", &rs_gf1024_short,
+                         test_rs_correct);
+    g_test_add_data_func("/reed-solomon/gf1024-short/uncorrectable", &rs_gf1024_short,
+                         test_rs_uncorrectable);
+    g_test_add_func("/reed-solomon/invalid", test_rs_invalid);
+
+    return g_test_run();
+}
@@ -0,0 +1,342 @@
+/*
+ * Reed-Solomon codes over GF(2^m)
+ *
+ * The decoder follows Phil Karn's classic Berlekamp-Massey, Chien search
+ * and Forney implementation. The encoder is table driven: every field
+ * element has a precomputed row with its products by the generator
+ * polynomial coefficients, so each data symbol costs one row XORed into
+ * the shifted parity, a loop the compiler turns into vector code.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/reed-solomon.h"
+
+struct ReedSolomon {
+    unsigned int symsize;
+    unsigned int nn;        /* symbols per unshortened codeword, 2^m - 1 */
+    unsigned int fcr;
+    unsigned int nroots;
+    uint16_t *alpha_to;     /* log -> value, alpha_to[nn] = 0 */
+    uint16_t *index_of;     /* value -> log, index_of[0] = nn */
+    uint16_t genpoly[REED_SOLOMON_MAX_ROOTS + 1];   /* in log form */
+    uint16_t *enc_table;    /* (nn + 1) rows of nroots symbols */
+};
+
+static inline unsigned int rs_modnn(const ReedSolomon *rs, unsigned int x)
+{
+    while (x >= rs->nn) {
+        x -= rs->nn;
+        x = (x >> rs->symsize) + (x & rs->nn);
+    }
+    return x;
+}
+
+ReedSolomon *reed_solomon_new(unsigned int symsize, unsigned int gfpoly,
+                              unsigned int fcr, unsigned int nroots,
+                              Error **errp)
+{
+    g_autoptr(ReedSolomon) rs = NULL;
+    unsigned int nn, sr, i, j;
+
+    if (symsize < 2 || symsize > REED_SOLOMON_MAX_SYMSIZE) {
+        error_setg(errp, "symbol size %u is out of range", symsize);
+        return NULL;
+    }
+    nn = (1U << symsize) - 1;
+    if (gfpoly >> symsize != 1) {
+        error_setg(errp, "polynomial 0x%x is not of degree %u", gfpoly, symsize);
+        return NULL;
+    }
+    if (nroots == 0 || nroots > REED_SOLOMON_MAX_ROOTS || nroots >= nn) {
+        error_setg(errp, "%u roots are out of range", nroots);
+        return NULL;
+    }
+    if (fcr >= nn) {
+        error_setg(errp, "first root %u is out of range", fcr);
+        return NULL;
+    }
+
+    rs = g_new0(ReedSolomon, 1);
+    rs->symsize = symsize;
+    rs->nn = nn;
+    rs->fcr = fcr;
+    rs->nroots = nroots;
+    rs->alpha_to = g_new(uint16_t, nn + 1);
+    rs->index_of = g_new(uint16_t, nn + 1);
+
+    /* log tables, x must generate all nn non-zero elements */
+    rs->index_of[0] = nn;
+    rs->alpha_to[nn] = 0;
+    sr = 1;
+    for (i = 0; i < nn; i++) {
+        if (i && sr == 1) {
+            error_setg(errp, "polynomial 0x%x is not primitive", gfpoly);
+            return NULL;
+        }
+        rs->index_of[sr] = i;
+        rs->alpha_to[i] = sr;
+        sr <<= 1;
+        if (sr & (1U << symsize)) {
+            sr ^= gfpoly;
+        }
+    }
+
+    /* generator polynomial, the product of (x - alpha^(fcr + i)) */
+    rs->genpoly[0] = 1;
+    for (i = 0; i < nroots; i++) {
+        unsigned int root = rs_modnn(rs, fcr + i);
+
+        rs->genpoly[i + 1] = 1;
+        for (j = i; j > 0; j--) {
+            if (rs->genpoly[j] != 0) {
+                rs->genpoly[j] = rs->genpoly[j - 1] ^
+                    rs->alpha_to[rs_modnn(rs, rs->index_of[rs->genpoly[j]] + root)];
+            } else {
+                rs->genpoly[j] = rs->genpoly[j - 1];
+            }
+        }
+        rs->genpoly[0] = rs->alpha_to[rs_modnn(rs, rs->index_of[rs->genpoly[0]] + root)];
+    }
+    for (i = 0; i <= nroots; i++) {
+        rs->genpoly[i] = rs->index_of[rs->genpoly[i]];
+    }
+
+    /* row v holds the parity update for a feedback symbol v */
+    rs->enc_table = g_new(uint16_t, (size_t)(nn + 1) * nroots);
+    for (i = 0; i <= nn; i++) {
+        unsigned int fb = rs->index_of[i];
+        uint16_t *row = rs->enc_table + (size_t)i * nroots;
+
+        for (j = 0; j < nroots; j++) {
+            unsigned int g = rs->genpoly[nroots - 1 - j];
+
+            row[j] = (fb == nn || g == nn) ? 0 : rs->alpha_to[rs_modnn(rs, fb + g)];
+        }
+    }
+
+    return g_steal_pointer(&rs);
+}
+
+void reed_solomon_free(ReedSolomon *rs)
+{
+    if (!rs) {
+        return;
+    }
+    g_free(rs->alpha_to);
+    g_free(rs->index_of);
+    g_free(rs->enc_table);
+    g_free(rs);
+}
+
+unsigned int reed_solomon_max_len(const ReedSolomon *rs)
+{
+    return rs->nn - rs->nroots;
+}
+
+void reed_solomon_encode(const ReedSolomon *rs, const uint16_t *data,
+                         size_t len, uint16_t *parity)
+{
+    /* the parity register, shifted by alternating between two buffers */
+    uint16_t buf[2][REED_SOLOMON_MAX_ROOTS + 1] = { { 0 } };
+    uint16_t *cur = buf[0], *next = buf[1], *tmp;
+    unsigned int nroots = rs->nroots;
+    size_t i;
+    unsigned int j;
+
+    assert(len <= reed_solomon_max_len(rs));
+
+    for (i = 0; i < len; i++) {
+        const uint16_t *row = rs->enc_table +
+            (size_t)((data[i] ^ cur[0]) & rs->nn) * nroots;
+
+        for (j = 0; j < nroots; j++) {
+            next[j] = cur[j + 1] ^ row[j];
+        }
+        tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+    memcpy(parity, cur, nroots * sizeof(parity[0]));
+}
+
+int reed_solomon_decode(const ReedSolomon *rs, uint16_t *data, size_t len,
+                        uint16_t *parity)
+{
+    const uint16_t *alpha_to = rs->alpha_to;
+    const uint16_t *index_of = rs->index_of;
+    unsigned int nn = rs->nn, a0 = rs->nn, nroots = rs->nroots;
+    unsigned int pad = nn - nroots - len;
+    uint16_t diff[REED_SOLOMON_MAX_ROOTS];
+    uint16_t s[REED_SOLOMON_MAX_ROOTS];
+    uint16_t lambda[REED_SOLOMON_MAX_ROOTS + 1], b[REED_SOLOMON_MAX_ROOTS + 1];
+    uint16_t t[REED_SOLOMON_MAX_ROOTS + 1], omega[REED_SOLOMON_MAX_ROOTS + 1];
+    uint16_t reg[REED_SOLOMON_MAX_ROOTS + 1];
+    unsigned int root[REED_SOLOMON_MAX_ROOTS], loc[REED_SOLOMON_MAX_ROOTS];
+    uint16_t err[REED_SOLOMON_MAX_ROOTS];
+    unsigned int i, k, r, el, differs = 0;
+    int j, deg_lambda, deg_omega, count, corrected;
+
+    assert(len <= reed_solomon_max_len(rs));
+
+    /* fast path: the data re-encodes to the stored parity */
+    reed_solomon_encode(rs, data, len, diff);
+    for (i = 0; i < nroots; i++) {
+        diff[i] ^= parity[i] & nn;
+        differs |= diff[i];
+    }
+    if (!differs) {
+        return 0;
+    }
+
+    /*
+     * The parity difference is the received word minus the codeword for
+     * the received data, so it has the same syndromes.
+     */
+    for (i = 0; i < nroots; i++) {
+        unsigned int x = rs_modnn(rs, rs->fcr + i);
+        unsigned int si = 0;
+
+        for (k = 0; k < nroots; k++) {
+            si = (si ? alpha_to[rs_modnn(rs, index_of[si] + x)] : 0) ^ diff[k];
+        }
+        s[i] = index_of[si];
+    }
+
+    /* Berlekamp-Massey for the error locator polynomial lambda(x) */
+    memset(&lambda[1], 0, nroots * sizeof(lambda[0]));
+    lambda[0] = 1;
+    for (i = 0; i <= nroots; i++) {
+        b[i] = index_of[lambda[i]];
+    }
+    el = 0;
+    for (r = 1; r <= nroots; r++) {
+        unsigned int discr_r = 0;
+
+        for (i = 0; i < r; i++) {
+            if (lambda[i] != 0 && s[r - i - 1] != a0) {
+                discr_r ^= alpha_to[rs_modnn(rs, index_of[lambda[i]] + s[r - i - 1])];
+            }
+        }
+        discr_r = index_of[discr_r];
+        if (discr_r == a0) {
+            memmove(&b[1], b, nroots * sizeof(b[0]));
+            b[0] = a0;
+            continue;
+        }
+
+        t[0] = lambda[0];
+        for (i = 0; i < nroots; i++) {
+            t[i + 1] = lambda[i + 1];
+            if (b[i] != a0) {
+                t[i + 1] ^= alpha_to[rs_modnn(rs, discr_r + b[i])];
+            }
+        }
+        if (2 * el <= r - 1) {
+            el = r - el;
+            for (i = 0; i <= nroots; i++) {
+                b[i] = lambda[i] == 0 ? a0 :
+                    rs_modnn(rs, index_of[lambda[i]] - discr_r + nn);
+            }
+        } else {
+            memmove(&b[1], b, nroots * sizeof(b[0]));
+            b[0] = a0;
+        }
+        memcpy(lambda, t, (nroots + 1) * sizeof(t[0]));
+    }
+
+    deg_lambda = 0;
+    for (i = 0; i <= nroots; i++) {
+        lambda[i] = index_of[lambda[i]];
+        if (lambda[i] != a0) {
+            deg_lambda = i;
+        }
+    }
+    if (deg_lambda == 0 || deg_lambda > nroots / 2) {
+        return -EBADMSG;
+    }
+
+    /* Chien search for the roots of lambda(x) */
+    memcpy(&reg[1], &lambda[1], nroots * sizeof(reg[0]));
+    count = 0;
+    for (i = 1, k = 0; i <= nn; i++, k++) {
+        unsigned int q = 1;
+
+        for (j = deg_lambda; j > 0; j--) {
+            if (reg[j] != a0) {
+                reg[j] = rs_modnn(rs, reg[j] + j);
+                q ^= alpha_to[reg[j]];
+            }
+        }
+        if (q != 0) {
+            continue;
+        }
+        root[count] = i;
+        loc[count] = k;
+        if (++count == deg_lambda) {
+            break;
+        }
+    }
+    if (count != deg_lambda) {
+        return -EBADMSG;
+    }
+
+    /* error evaluator omega(x) = s(x) * lambda(x) mod x^nroots */
+    deg_omega = deg_lambda - 1;
+    for (i = 0; i <= deg_omega; i++) {
+        unsigned int tmp = 0;
+
+        for (j = i; j >= 0; j--) {
+            if (s[i - j] != a0 && lambda[j] != a0) {
+                tmp ^= alpha_to[rs_modnn(rs, s[i - j] + lambda[j])];
+            }
+        }
+        omega[i] = index_of[tmp];
+    }
+
+    /* Forney, all error values are checked before anything is touched */
+    for (j = count - 1; j >= 0; j--) {
+        unsigned int num1 = 0, num2, den = 0;
+        int l;
+
+        if (loc[j] < pad) {
+            /* the error is in the symbols the shortened code leaves out */
+            return -EBADMSG;
+        }
+        for (l = deg_omega; l >= 0; l--) {
+            if (omega[l] != a0) {
+                num1 ^= alpha_to[rs_modnn(rs, omega[l] + l * root[j])];
+            }
+        }
+        num2 = alpha_to[(rs_modnn(rs, root[j]) * (rs->fcr + nn - 1)) % nn];
+        /* lambda[l + 1] for even l is the formal derivative of lambda */
+        for (l = MIN(deg_lambda, (int)nroots - 1) & ~1; l >= 0; l -= 2) {
+            if (lambda[l + 1] != a0) {
+                den ^= alpha_to[rs_modnn(rs, lambda[l + 1] + l * root[j])];
+            }
+        }
+        if (den == 0) {
+            return -EBADMSG;
+        }
+        err[j] = num1 == 0 ? 0 :
+            alpha_to[rs_modnn(rs, index_of[num1] + index_of[num2] + nn - index_of[den])];
+    }
+
+    corrected = 0;
+    for (j = 0; j < count; j++) {
+        unsigned int pos = loc[j] - pad;
+
+        if (!err[j]) {
+            continue;
+        }
+        if (pos < len) {
+            data[pos] ^= err[j];
+        } else {
+            parity[pos - len] ^= err[j];
+        }
+        corrected++;
+    }
+    return corrected;
+}